@@ -0,0 +1,24 @@
+; ALU-heavy loop: arithmetic, logic, shifts and skips
+; without memory access or drawing
+start:
+MOV V0, 0
+MOV V1, 1
+MOV V2, 90
+loop:
+ADD V0, 1
+ADD V1, V0 ; sets VF on carry
+XOR V2, V1
+OR V3, V2
+AND V3, V1
+SUB V4, V2
+SUBN V5, V1
+SHR V6, V2
+SHL V7
+ADD V7, V4
+MOV V8, V7
+SNE V8, 128
+  ADD V9, 1
+SE V0, 0 ; until V0 wraps around
+  JMP loop
+ADD V10, 1
+JMP start
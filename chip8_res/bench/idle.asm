@@ -0,0 +1,16 @@
+; DT-polling idle program: waits two frames at a time
+; and then redraws a counter digit
+MOV V4, 2 ; frames to wait
+MOV V5, 15
+start:
+MOV DT, V4
+wait:
+MOV V0, DT
+SE V0, 0
+  JMP wait
+ADD V1, 1
+AND V1, V5
+CLS
+MOV F, V1
+DRW V3, V3, 5
+JMP start
@@ -0,0 +1,23 @@
+; Memory shuffler: BCD conversion, register dumps and
+; loads at a moving address
+MOV V5, 0 ; counter
+loop:
+MOV I, digits
+MOV B, V5
+MOV V2, [I] ; V0-V2: digits of V5
+ADD V6, V0
+ADD V6, V1
+ADD V6, V2
+MOV I, buffer
+ADD I, V5
+MOV [I], V7 ; V0-V7 to buffer + counter
+MOV I, buffer
+ADD I, V6
+MOV V7, [I] ; and back from buffer + digit sum
+ADD V5, 1
+JMP loop
+digits:
+NOP 0
+NOP 0
+buffer:
+NOP 0
@@ -0,0 +1,17 @@
+; Deep CALL/RET recursion, 11 levels, which fits
+; the 12 entry stack
+start:
+MOV V0, 10 ; depth
+CALL down
+ADD V2, 1
+JMP start
+; Sums depths on the way down and counts them back up
+down:
+ADD V1, V0
+SNE V0, 0
+  RET
+ADD V0, 255 ; V0--
+CALL down
+ADD V0, 1
+ADD V3, V0
+RET
@@ -0,0 +1,23 @@
+; DRW-heavy sprite storm: font digits and an 8x8 sprite at
+; every position, also wrapping around the screen edges
+MOV V0, 0 ; x
+MOV V1, 0 ; y
+MOV V2, 0 ; digit
+MOV V3, 15
+loop:
+MOV F, V2
+DRW V0, V1, 5
+MOV I, sprite
+DRW V1, V0, 8
+ADD V4, V15 ; collisions
+ADD V0, 7
+ADD V1, 3
+ADD V2, 1
+AND V2, V3
+JMP loop
+; Hex numbers can't end in a letter, so rows are in decimal
+sprite:
+NOP 65409 ; 0xff 0x81
+NOP 48549 ; 0xbd 0xa5
+NOP 42429 ; 0xa5 0xbd
+NOP 33279 ; 0x81 0xff
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "chip8.h"
+#include "pool.h"
+#include "runner.h"
+#include "util.h"
+
+#define DEFAULT_FRAMES  (60 * CHIP8_DT_FREQ) /* One minute */
+#define SECOND_IN_NSEC  1000000000
+
+const char* help_text = \
+"./chip8_batch <manifest> <output> [-w <count>] [-n <count>] [-f <count>] [-T <seconds>] [-t|-j]\n"
+"\tRuns each line of manifest, \"<rom> [<key script>|-] [<max instructions>] [<max seconds>]\",\n"
+"\ton a chip of its own and writes a result line per job to output as soon as it finishes\n"
+"\t-w\tWorker threads (default: number of cores)\n"
+"\t-n\tInstructions to run if the job doesn't give them\n"
+"\t-f\tFrames to run, 60 per second (default: 3600 if there is no instruction limit)\n"
+"\t-T\tSeconds to run if the job doesn't give them (default: no limit)\n"
+"\t-t\tUse threaded-code execution engine\n"
+"\t-j\tUse x86-64 JIT compiler execution engine\n";
+
+typedef struct {
+    char*              rom;
+    char*              script;      /* NULL if no keys are pressed */
+    unsigned long long max_cycles;  /* 0 for the default */
+    double             max_seconds; /* 0 for the default */
+} batch_job;
+
+typedef struct {
+    batch_job*         jobs;
+    unsigned           count;
+    unsigned long long max_cycles;
+    unsigned long long max_frames;
+    double             max_seconds;
+    unsigned           engine;
+
+    FILE*              output;
+    pthread_mutex_t    output_lock;
+    atomic_uint        failed;
+    atomic_ullong      cycles;
+} batch;
+
+static double GetSeconds()
+{
+    struct timespec ts = {0};
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + (double)ts.tv_nsec / SECOND_IN_NSEC;
+}
+
+static void BatchFree(batch* b)
+{
+    for (unsigned i = 0; i < b->count; i++)
+    {
+        free(b->jobs[i].rom);
+        free(b->jobs[i].script);
+    }
+    free(b->jobs);
+    b->jobs  = NULL;
+    b->count = 0;
+}
+
+static bool BatchLoad(batch* b, const char* file)
+{
+    unsigned char* text = NULL;
+    unsigned len = 0;
+    if (!ReadFile(file, false, &text, &len)) return false;
+
+    unsigned capacity = 0;
+    bool ok = true;
+    for (char* line = strtok((char*)text, "\n"); line != NULL && ok; line = strtok(NULL, "\n"))
+    {
+        char rom[256], script[256];
+        batch_job job = { NULL, NULL, 0, 0 };
+        if (line[0] == '#') continue;
+        int fields = sscanf(line, "%255s %255s %llu %lf", rom, script, &job.max_cycles, &job.max_seconds);
+        if (fields < 1) continue;
+
+        if (b->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            batch_job* jobs = realloc(b->jobs, capacity * sizeof(batch_job));
+            if (!jobs)
+            {
+                ok = false;
+                break;
+            }
+            b->jobs = jobs;
+        }
+        job.rom    = strdup(rom);
+        job.script = (fields >= 2 && strcmp(script, "-") != 0) ? strdup(script) : NULL;
+        b->jobs[ b->count++ ] = job;
+    }
+
+    free(text);
+    if (!ok) BatchFree(b);
+    return ok;
+}
+
+/* Runs on any worker, jobs share nothing but the output */
+static void RunJob(void* context, unsigned index, unsigned worker)
+{
+    batch* b = context;
+    const batch_job* job = &(b->jobs[ index ]);
+
+    chip8_hw chip;
+    Chip8Init( &chip );
+    chip.engine = b->engine;
+
+    key_script script = { NULL, 0 };
+    run_config config = { job->max_cycles ? job->max_cycles : b->max_cycles, b->max_frames, NULL, NULL, NULL,
+                          job->max_seconds > 0 ? job->max_seconds : b->max_seconds };
+    run_result result = { 0, 0, 0, -1, false };
+    if (config.max_cycles == 0 && config.max_frames == 0) config.max_frames = DEFAULT_FRAMES;
+
+    char status[32] = "load-failed";
+    if (Chip8LoadProgram(&chip, job->rom) && (!job->script || KeyScriptLoad(&script, job->script)))
+    {
+        config.script = job->script ? &script : NULL;
+        RunHeadless(&chip, &config, &result);
+        if (result.status != 0) snprintf(status, sizeof(status), "error %d", result.status);
+        else                    strcpy(status, result.timed_out ? "timeout" : "ok");
+    }
+    if (result.status != 0) atomic_fetch_add(&b->failed, 1);
+    atomic_fetch_add_explicit(&b->cycles, result.cycles, memory_order_relaxed);
+
+    pthread_mutex_lock(&b->output_lock);
+    fprintf(b->output, "%u\t%s\t%s\t%s\t%.16llx\t%llu\t%llu\t%f\n", index, job->rom, job->script ? job->script : "-",
+            status, RunStateHash(&chip), result.cycles, result.frames, result.seconds);
+    fflush(b->output);
+    pthread_mutex_unlock(&b->output_lock);
+
+    KeyScriptFree( &script );
+    Chip8Free( &chip );
+}
+
+int main( int argc, char** argv )
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Manifest or output file is missing!\n%s", help_text);
+        return -3;
+    }
+
+    batch b = { NULL, 0, 0, 0, 0, CHIP8_ENGINE_INTERPRETER, NULL, PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned workers = cores > 0 ? cores : 1;
+    for (int i = 3; i < argc; i++)
+    {
+        char* arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "-w") == 0 && has_value && atoi(argv[i+1]) > 0)
+        {
+            workers = atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "-n") == 0 && has_value)
+        {
+            b.max_cycles = strtoull(argv[++i], NULL, 0);
+        }
+        else if (strcmp(arg, "-f") == 0 && has_value)
+        {
+            b.max_frames = strtoull(argv[++i], NULL, 0);
+        }
+        else if (strcmp(arg, "-T") == 0 && has_value)
+        {
+            b.max_seconds = atof(argv[++i]);
+        }
+        else if (strcmp(arg, "-t") == 0)
+        {
+            b.engine = CHIP8_ENGINE_THREADED;
+        }
+        else if (strcmp(arg, "-j") == 0)
+        {
+            b.engine = CHIP8_ENGINE_JIT;
+        }
+        else
+        {
+            fprintf(stderr, "Invalid arguments!\n%s", help_text);
+            return -3;
+        }
+    }
+
+    if (!BatchLoad(&b, argv[1]))
+    {
+        fprintf(stderr, "Failed to load manifest %s\n", argv[1]);
+        return -2;
+    }
+    b.output = fopen(argv[2], "w");
+    if (!b.output)
+    {
+        fprintf(stderr, "Failed to open output %s\n", argv[2]);
+        BatchFree(&b);
+        return -2;
+    }
+    fprintf(b.output, "# job\trom\tkeys\tstatus\tstate hash\tcycles\tframes\tseconds\n");
+
+    double begin = GetSeconds();
+    unsigned stolen = 0;
+    bool ok = PoolRun(b.count, workers, RunJob, &b, &stolen);
+    double sec = GetSeconds() - begin;
+    if (fclose(b.output) != 0) ok = false;
+
+    unsigned long long cycles = atomic_load(&b.cycles);
+    fprintf(stdout, "Jobs: %u, failed: %u, workers: %u, stolen: %u\n", b.count, atomic_load(&b.failed), workers, stolen);
+    fprintf(stdout, "Time: %f s, %.0f instructions/s\n", sec, sec > 0 ? cycles / sec : 0.0);
+    if (!ok) fprintf(stderr, "Failed to run jobs or write %s\n", argv[2]);
+
+    ok = ok && atomic_load(&b.failed) == 0;
+    BatchFree(&b);
+    return ok ? 0 : -1;
+}
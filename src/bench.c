@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "decoder.h"
+#include "disasm.h"
+#include "lockstep.h"
+#include "opcodes.h"
+#include "rewind.h"
+#include "token.h"
+#include "util.h"
+
+#define SECOND_IN_NSEC  1000000000
+#define OPCODE_SAMPLES  0x10000
+#define EXECUTE_BATCH   1000
+#define SOURCE_BLOCKS   256  /* Generated source has 6 instructions per block */
+
+typedef unsigned long long (*bench_fptr)(unsigned long long iterations, const void* param);
+typedef struct {
+    bench_fptr  bench_fun;
+    const char* name;
+    unsigned long long iterations;
+    const void* param;  /**< Passed to bench_fun, e.g. code to execute */
+} bench_entry;
+
+/* Code executed by one of the engines */
+typedef struct {
+    const unsigned short* code;
+    unsigned len;
+    unsigned engine;
+} execute_mix;
+
+typedef struct {
+    double ns_per_op;
+    double ops_per_sec;
+} bench_result;
+
+static unsigned long long bench_DecodeOpcodeScan(unsigned long long, const void*);
+static unsigned long long bench_DecodeOpcode(unsigned long long, const void*);
+static unsigned long long bench_Execute(unsigned long long, const void*);
+static unsigned long long bench_Lockstep(unsigned long long, const void*);
+static unsigned long long bench_Dxyn(unsigned long long, const void*);
+static unsigned long long bench_CompileSource(unsigned long long, const void*);
+static unsigned long long bench_Disassemble(unsigned long long, const void*);
+static unsigned long long bench_SaveState(unsigned long long, const void*);
+static unsigned long long bench_LoadState(unsigned long long, const void*);
+static unsigned long long bench_RewindCapture(unsigned long long, const void*);
+
+static const execute_mix alu_interpreter, alu_threaded, alu_jit;
+static const execute_mix memory_interpreter, memory_threaded, memory_jit;
+static const execute_mix draw_interpreter, draw_threaded, draw_jit;
+static const unsigned char aligned_x   = 8;
+static const unsigned char unaligned_x = 61; /* Wraps around the right edge */
+
+const bench_entry benchmarks[] =
+{
+    { bench_DecodeOpcodeScan, "DecodeOpcodeScan", 20000000 },
+    { bench_DecodeOpcode    , "DecodeOpcode"    , 20000000 },
+    { bench_Execute, "Execute/interpreter/alu"   , 50000000, &alu_interpreter },
+    { bench_Execute, "Execute/threaded/alu"      , 50000000, &alu_threaded },
+    { bench_Execute, "Execute/jit/alu"           , 50000000, &alu_jit },
+    { bench_Execute, "Execute/interpreter/memory", 20000000, &memory_interpreter },
+    { bench_Execute, "Execute/threaded/memory"   , 20000000, &memory_threaded },
+    { bench_Execute, "Execute/jit/memory"        , 20000000, &memory_jit },
+    { bench_Execute, "Execute/interpreter/draw"  , 20000000, &draw_interpreter },
+    { bench_Execute, "Execute/threaded/draw"     , 20000000, &draw_threaded },
+    { bench_Execute, "Execute/jit/draw"          , 20000000, &draw_jit },
+    { bench_Lockstep, "Lockstep/alu"   , 50000000, &alu_interpreter },
+    { bench_Lockstep, "Lockstep/memory", 20000000, &memory_interpreter },
+    { bench_Dxyn   , "Dxyn/aligned"              , 20000000, &aligned_x },
+    { bench_Dxyn   , "Dxyn/unaligned"            , 20000000, &unaligned_x },
+    { bench_CompileSource, "CompileSource"       , 20 },
+    { bench_Disassemble  , "Disassemble"         , 200 },
+    { bench_SaveState         , "SaveState"          , 2000000 },
+    { bench_LoadState         , "LoadState"          , 2000000 },
+    { bench_RewindCapture     , "RewindCapture"      , 1000000 },
+
+    { NULL, NULL, 0 },
+};
+
+/* Opcodes in random order, so that the branch predictor can't learn the sequence */
+static unsigned short opcodes[ OPCODE_SAMPLES ];
+
+/* ALU heavy loop */
+static const unsigned short alu_loop[] = {
+    0x6000, // 0x200: MOV V0, 0
+    0x6101, // 0x202: MOV V1, 1
+    0x7001, // 0x204: ADD V0, 1
+    0x8014, // 0x206: ADD V0, V1
+    0x8203, // 0x208: XOR V2, V0
+    0x8326, // 0x20a: SHR V3, V2
+    0x3000, // 0x20c: SE  V0, 0
+    0x1204, // 0x20e: JMP 0x204
+    0x1200, // 0x210: JMP 0x200
+};
+
+/* Register dump and load, BCD */
+static const unsigned short memory_loop[] = {
+    0xA400, // 0x200: MOV I, 0x400
+    0x7001, // 0x202: ADD V0, 1
+    0xF755, // 0x204: MOV [I], V7
+    0xF765, // 0x206: MOV V7, [I]
+    0xF033, // 0x208: BCD V0
+    0xF01E, // 0x20a: ADD I, V0
+    0x1200, // 0x20c: JMP 0x200
+};
+
+/* Sprite moving over the screen, at aligned and unaligned positions */
+static const unsigned short draw_loop[] = {
+    0xA400, // 0x200: MOV I, 0x400
+    0xD015, // 0x202: DRW V0, V1, 5
+    0x7003, // 0x204: ADD V0, 3
+    0x7101, // 0x206: ADD V1, 1
+    0x1202, // 0x208: JMP 0x202
+};
+
+#define MIX(code, engine) { code, sizeof(code)/sizeof(code[0]), engine }
+static const execute_mix alu_interpreter    = MIX(alu_loop, CHIP8_ENGINE_INTERPRETER);
+static const execute_mix alu_threaded       = MIX(alu_loop, CHIP8_ENGINE_THREADED);
+static const execute_mix alu_jit            = MIX(alu_loop, CHIP8_ENGINE_JIT);
+static const execute_mix memory_interpreter = MIX(memory_loop, CHIP8_ENGINE_INTERPRETER);
+static const execute_mix memory_threaded    = MIX(memory_loop, CHIP8_ENGINE_THREADED);
+static const execute_mix memory_jit         = MIX(memory_loop, CHIP8_ENGINE_JIT);
+static const execute_mix draw_interpreter   = MIX(draw_loop, CHIP8_ENGINE_INTERPRETER);
+static const execute_mix draw_threaded      = MIX(draw_loop, CHIP8_ENGINE_THREADED);
+static const execute_mix draw_jit           = MIX(draw_loop, CHIP8_ENGINE_JIT);
+#undef MIX
+
+static void LoadCode(chip8_hw* chip, const unsigned short* code, unsigned len)
+{
+    for (unsigned i = 0; i < len; ++i)
+    {
+        chip->ram[ CHIP8_PROG_START + i*2   ] = code[i] >> 8;
+        chip->ram[ CHIP8_PROG_START + i*2+1 ] = code[i] & 0xff;
+    }
+    Chip8InvalidateCode(chip, CHIP8_PROG_START, len*2);
+    chip->PC = CHIP8_PROG_START;
+}
+
+static double GetSeconds()
+{
+    struct timespec ts = {0};
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + (double)ts.tv_nsec / SECOND_IN_NSEC;
+}
+
+/* ns/op of name in a file written by WriteJson(), 0 if not found */
+static double FindBaseline(const char* baseline, const char* name)
+{
+    char key[128];
+    snprintf(key, sizeof(key), "\"name\": \"%s\",", name);
+    const char* entry = baseline ? strstr(baseline, key) : NULL;
+    double ns = 0;
+    if (entry && sscanf(entry + strlen(key), " \"ns_per_op\": %lf", &ns) != 1)
+    {
+        ns = 0;
+    }
+    return ns;
+}
+
+static bool WriteJson(const char* file, const bench_result* results)
+{
+    FILE* f = fopen(file, "w");
+    if (!f) return false;
+
+    fprintf(f, "{\n  \"benchmarks\": [\n");
+    for (unsigned i = 0; benchmarks[i].bench_fun != NULL; ++i)
+    {
+        fprintf(f, "    { \"name\": \"%s\", \"ns_per_op\": %.3f, \"ops_per_sec\": %.0f }%s\n",
+            benchmarks[i].name, results[i].ns_per_op, results[i].ops_per_sec,
+            benchmarks[i+1].bench_fun != NULL ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return fclose(f) == 0;
+}
+
+static void PrintUsage()
+{
+    fprintf(stderr,
+        "bench [-j <file>] [-b <file>]\n"
+        "  -j <file>  Write results as JSON\n"
+        "  -b <file>  Compare against results saved with -j\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* json_file = NULL;
+    char* baseline = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            json_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+        {
+            unsigned len = 0;
+            if (!ReadFile(argv[++i], false, (unsigned char**)&baseline, &len))
+            {
+                fprintf(stderr, "Failed to read baseline '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        else
+        {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    srand(1);
+    for (unsigned i = 0; i < OPCODE_SAMPLES; ++i)
+    {
+        opcodes[i] = rand() & 0xffff;
+    }
+
+    static bench_result results[ sizeof(benchmarks)/sizeof(benchmarks[0]) ];
+    for (unsigned i = 0; benchmarks[i].bench_fun != NULL; ++i)
+    {
+        const bench_entry* cur = &(benchmarks[i]);
+
+        double begin = GetSeconds();
+        unsigned long long ops = cur->bench_fun( cur->iterations, cur->param );
+        double sec = GetSeconds() - begin;
+
+        results[i].ns_per_op   = sec * SECOND_IN_NSEC / ops;
+        results[i].ops_per_sec = ops / sec;
+        printf("%-28s %10.2f ns/op %14.0f ops/s", cur->name, results[i].ns_per_op, results[i].ops_per_sec);
+
+        double base_ns = FindBaseline(baseline, cur->name);
+        if (base_ns > 0)
+        {
+            // Negative is faster than the baseline
+            printf(" %+8.1f%%", (results[i].ns_per_op - base_ns) * 100 / base_ns);
+        }
+        printf("\n");
+    }
+    free(baseline);
+
+    if (json_file && !WriteJson(json_file, results))
+    {
+        fprintf(stderr, "Failed to write '%s'\n", json_file);
+        return 1;
+    }
+    return 0;
+}
+
+unsigned long long bench_DecodeOpcodeScan(unsigned long long iterations, const void* param)
+{
+    volatile unsigned sink = 0;
+    for (unsigned long long i = 0; i < iterations; ++i)
+    {
+        sink += DecodeOpcodeScan( opcodes[ i % OPCODE_SAMPLES ] );
+    }
+    return iterations;
+}
+
+unsigned long long bench_DecodeOpcode(unsigned long long iterations, const void* param)
+{
+    volatile unsigned sink = 0;
+    for (unsigned long long i = 0; i < iterations; ++i)
+    {
+        sink += DecodeOpcode( opcodes[ i % OPCODE_SAMPLES ] );
+    }
+    return iterations;
+}
+
+unsigned long long bench_Execute(unsigned long long iterations, const void* param)
+{
+    const execute_mix* mix = param;
+    chip8_hw chip;
+    Chip8Init( &chip );
+    LoadCode( &chip, mix->code, mix->len );
+    chip.engine = mix->engine;
+
+    unsigned long long ops = 0;
+    for (; ops < iterations; ops += EXECUTE_BATCH)
+    {
+        Chip8Execute( &chip, EXECUTE_BATCH );
+    }
+    Chip8Free( &chip );
+    return ops;
+}
+
+/* All lanes run the same code, instructions are counted per chip */
+unsigned long long bench_Lockstep(unsigned long long iterations, const void* param)
+{
+    const execute_mix* mix = param;
+    static chip8_hw chips[ LOCKSTEP_LANES ];
+    chip8_hw* lanes[ LOCKSTEP_LANES ];
+    for (unsigned i = 0; i < LOCKSTEP_LANES; ++i)
+    {
+        Chip8Init( &chips[i] );
+        LoadCode( &chips[i], mix->code, mix->len );
+        chips[i].engine = mix->engine;
+        lanes[i] = &chips[i];
+    }
+
+    static chip8_lockstep ls;
+    LockstepInit( &ls, lanes, LOCKSTEP_LANES );
+    unsigned long long ops = 0;
+    for (; ops < iterations; ops += EXECUTE_BATCH * LOCKSTEP_LANES)
+    {
+        LockstepExecute( &ls, EXECUTE_BATCH );
+    }
+    for (unsigned i = 0; i < LOCKSTEP_LANES; ++i)
+    {
+        Chip8Free( &chips[i] );
+    }
+    return ops;
+}
+
+/* 5 row sprite at column given by param, moving down a row at a time */
+unsigned long long bench_Dxyn(unsigned long long iterations, const void* param)
+{
+    chip8_hw chip;
+    Chip8Init( &chip );
+    chip.I    = 0x400;
+    chip.V[0] = *(const unsigned char*)param;
+    decoded_instr instr = {0};
+    DecodeOperands( 0xD015, &instr );
+
+    volatile unsigned sink = 0;
+    for (unsigned long long i = 0; i < iterations; ++i)
+    {
+        chip.ram[ 0x400 + i % 5 ] = i;
+        chip.V[1] = i;
+        _Dxyn( &chip, &instr );
+        sink += chip.V[0xf];
+    }
+    Chip8Free( &chip );
+    return iterations;
+}
+
+/* Source with labels and a mix of instructions, SOURCE_BLOCKS * 6 instructions */
+static char* GenerateSource()
+{
+    static const char* block =
+        "loop%u:\n"
+        "MOV V0, %u\n"
+        "ADD V1, V0\n"
+        "MOV I, 1024\n"
+        "DRW V0, V1, 5\n"
+        "SE V0, 3\n"
+        "JMP loop%u\n";
+
+    unsigned len = strlen(block) + 32;
+    char* src = (char*)malloc(SOURCE_BLOCKS * len + 1);
+    unsigned pos = 0;
+    for (unsigned i = 0; i < SOURCE_BLOCKS; ++i)
+    {
+        pos += sprintf(src + pos, block, i, i % 0x100, i);
+    }
+    return src;
+}
+
+/* Returns compiled instructions */
+unsigned long long bench_CompileSource(unsigned long long iterations, const void* param)
+{
+    char* src = GenerateSource();
+    unsigned long long ops = 0;
+    for (unsigned long long i = 0; i < iterations; ++i)
+    {
+        unsigned char* code = NULL;
+        unsigned len = 0;
+        if (!CompileSource( src, &code, &len ))
+        {
+            fprintf(stderr, "Failed to compile generated source\n");
+            break;
+        }
+        ops += len / 2;
+        free(code);
+    }
+    free(src);
+    return ops;
+}
+
+/* Returns disassembled instructions */
+unsigned long long bench_Disassemble(unsigned long long iterations, const void* param)
+{
+    // Valid opcodes only, invalid ones would be reported to stderr
+    static unsigned char bin[ OPCODE_SAMPLES / 8 ];
+    unsigned len = 0;
+    for (unsigned i = 0; i < OPCODE_SAMPLES && len < sizeof(bin); ++i)
+    {
+        if (DecodeOpcode( opcodes[i] ) == INVALID_OPCODE) continue;
+        bin[ len++ ] = opcodes[i] >> 8;
+        bin[ len++ ] = opcodes[i] & 0xff;
+    }
+
+    unsigned long long ops = 0;
+    for (unsigned long long i = 0; i < iterations; ++i)
+    {
+        char* output = NULL;
+        unsigned output_len = 0;
+        DisassembleCode( bin, len, &output, &output_len );
+        ops += len / 2;
+        free(output);
+    }
+    return ops;
+}
+
+unsigned long long bench_SaveState(unsigned long long iterations, const void* param)
+{
+    static chip8_state state;
+    chip8_hw chip;
+    Chip8Init( &chip );
+    LoadCode( &chip, alu_loop, sizeof(alu_loop)/sizeof(alu_loop[0]) );
+
+    for (unsigned long long i = 0; i < iterations; ++i)
+    {
+        chip.V[0] = i;
+        Chip8SaveState( &chip, &state );
+    }
+    Chip8Free( &chip );
+    return iterations;
+}
+
+/* Restores a checkpoint while running, so part of RAM differs each time */
+unsigned long long bench_LoadState(unsigned long long iterations, const void* param)
+{
+    static chip8_state state;
+    chip8_hw chip;
+    Chip8Init( &chip );
+    LoadCode( &chip, alu_loop, sizeof(alu_loop)/sizeof(alu_loop[0]) );
+    Chip8SaveState( &chip, &state );
+
+    for (unsigned long long i = 0; i < iterations; ++i)
+    {
+        chip.ram[ 0x400 + i % 0x100 ] = i;
+        Chip8LoadState( &chip, &state );
+    }
+    Chip8Free( &chip );
+    return iterations;
+}
+
+/* One tick of emulation between captures */
+unsigned long long bench_RewindCapture(unsigned long long iterations, const void* param)
+{
+    static rewind_buffer rw;
+    chip8_hw chip;
+    Chip8Init( &chip );
+    LoadCode( &chip, alu_loop, sizeof(alu_loop)/sizeof(alu_loop[0]) );
+    RewindInit( &rw, 600 );
+
+    for (unsigned long long i = 0; i < iterations; ++i)
+    {
+        Chip8Execute( &chip, CHIP8_CPU_FREQ / CHIP8_DT_FREQ );
+        chip.ram[ 0x400 + i % 0x100 ] = i;
+        RewindCapture( &rw, &chip );
+    }
+    RewindFree( &rw );
+    Chip8Free( &chip );
+    return iterations;
+}
@@ -4,30 +4,44 @@
 
 #include "chip8.h"
 #include "decoder.h"
+#include "threaded.h"
+#include "jit.h"
 
-bool Chip8Init( chip8_hw* chip )
-{
-    memset( chip->V    , 0, REGISTER_V_COUNT );
-    memset( chip->gfx  , 0, CHIP8_GFX_LEN    );
-    memset( chip->stack, 0, sizeof(unsigned)*CHIP8_STACK_LEN);
+#define IDLE_LOOP_MAX_LEN  8 /* Instructions */
+#define STATE_RAM_CHUNK    0x40 /* Bytes compared at once when loading state */
+#define DUMP_BUFFER_LEN    0x4000 /* Fits whole text dump */
+#define DUMP_ITEM_MAX      0x40
+
+#ifdef CHIP8_PROFILE
+#define PROFILE_ENABLED  1
+#else
+#define PROFILE_ENABLED  0
+#endif
 
-    chip->I  = 0;
-    chip->PC = 0;
-    chip->DT = 0;
-    chip->ST = 0;
-    chip->stack_top = 0;
+_Static_assert(offsetof(chip8_hw, cycles) <= CHIP8_CACHE_LINE, "Registers don't fit in the first cache line");
 
-    chip->get_key_blocking = NULL;
-    chip->is_key_down      = NULL;
-    chip->draw_screen      = NULL;
+bool Chip8Init( chip8_hw* chip )
+{
+    // Zero padding too, save states copy the whole block
+    memset( chip, 0, sizeof(chip8_hw) );
 
-    chip->log_level = 0;
+    Chip8Seed(chip, 1);
+    chip->engine = CHIP8_ENGINE_INTERPRETER;
 
-    chip->ram = (unsigned char*)calloc( CHIP8_RAM_LEN, sizeof(unsigned char) );
-    if ( chip->ram == NULL )
+    chip->icache = (decoded_instr*)calloc( CHIP8_RAM_LEN, sizeof(decoded_instr) );
+    if ( chip->icache == NULL )
     {
         return false;
     }
+#ifdef CHIP8_PROFILE
+    chip->profile = (chip8_profile*)calloc( 1, sizeof(chip8_profile) );
+    if ( chip->profile == NULL )
+    {
+        free(chip->icache);
+        chip->icache = NULL;
+        return false;
+    }
+#endif
 
     memcpy( chip->ram+CHIP8_RAM_CHARSET_BEGIN, chip8_charset, CHIP8_CHARSET_LEN );
 
@@ -38,14 +52,18 @@ void Chip8Free( chip8_hw* chip  )
 {
     if ( chip )
     {
-        free(chip->ram);
-        chip->ram = NULL;
+        free(chip->icache);
+        chip->icache = NULL;
+#ifdef CHIP8_PROFILE
+        free(chip->profile);
+        chip->profile = NULL;
+#endif
+        JitFree(chip);
     }
 }
 
 bool Chip8LoadProgram( chip8_hw* chip, const char* file )
 {
-    if ( chip->ram == NULL ) return false;
 
     FILE* prog = fopen( file, "rb" );
     if ( !prog ) return false;
@@ -57,85 +75,393 @@ bool Chip8LoadProgram( chip8_hw* chip, const char* file )
 
     if ( bytes == 0 ) return false;
     chip->PC = CHIP8_PROG_START;
+    Chip8InvalidateCode( chip, CHIP8_PROG_START, bytes );
 
     return true;
 }
 
+/* Dump text is formatted into one buffer and written when it fills up */
+typedef struct {
+    FILE*    output;
+    unsigned len;
+    bool     ok;
+    char     data[ DUMP_BUFFER_LEN ];
+} dump_buffer;
+
+static void DumpFlush(dump_buffer* buf)
+{
+    if (buf->len > 0 && fwrite(buf->data, 1, buf->len, buf->output) != buf->len) buf->ok = false;
+    buf->len = 0;
+}
+
+/* Make room for an item, no item is longer than DUMP_ITEM_MAX */
+static char* DumpReserve(dump_buffer* buf)
+{
+    if (buf->len > DUMP_BUFFER_LEN - DUMP_ITEM_MAX) DumpFlush(buf);
+    return buf->data + buf->len;
+}
+
+static void DumpStr(dump_buffer* buf, const char* str)
+{
+    char* p = DumpReserve(buf);
+    while (*str) *p++ = *str++;
+    buf->len = p - buf->data;
+}
+
+static void DumpHex(dump_buffer* buf, unsigned value, unsigned digits)
+{
+    static const char hex[] = "0123456789abcdef";
+    char* p = DumpReserve(buf);
+    for (unsigned i = digits; i > 0; i--)
+    {
+        p[i-1] = hex[ value & 0xf ];
+        value >>= 4;
+    }
+    buf->len += digits;
+}
+
+static void DumpDec(dump_buffer* buf, unsigned long long value)
+{
+    char tmp[20];
+    unsigned len = 0;
+    do
+    {
+        tmp[len++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    char* p = DumpReserve(buf);
+    for (unsigned i = 0; i < len; i++) p[i] = tmp[len-1-i];
+    buf->len += len;
+}
+
+/* "0x<hex> (<dec>)" */
+static void DumpValue(dump_buffer* buf, unsigned value, unsigned digits)
+{
+    DumpStr(buf, "0x");
+    DumpHex(buf, value, digits);
+    DumpStr(buf, " (");
+    DumpDec(buf, value);
+    DumpStr(buf, ")");
+}
+
+static void DumpGfxRow(dump_buffer* buf, uint64_t row)
+{
+    for (unsigned shift = CHIP8_GFX_W; shift > 0; shift -= 8)
+    {
+        DumpHex(buf, (row >> (shift - 8)) & 0xff, 2);
+        DumpStr(buf, " ");
+    }
+}
+
+static void DumpRamLine(dump_buffer* buf, const unsigned char* ram, unsigned addr)
+{
+    for (unsigned i = addr; i < addr + 0x10 && i < CHIP8_RAM_LEN; i++)
+    {
+        DumpHex(buf, ram[i], 2);
+        DumpStr(buf, " ");
+    }
+}
+
 bool Chip8Dump( chip8_hw* chip, FILE* output )
 {
+    static const char* names[] = { "DT: ", "ST: ", "I : ", "PC: " };
+    const unsigned values[] = { chip->DT, chip->ST, chip->I, chip->PC };
+    const unsigned digits[] = { 2, 2, 4, 4 };
+
+    dump_buffer* buf = (dump_buffer*)malloc(sizeof(dump_buffer));
+    if (!buf) return false;
+    buf->output = output;
+    buf->len    = 0;
+    buf->ok     = true;
+
     for (unsigned i = 0; i < REGISTER_V_COUNT; i++)
     {
-        fprintf(output, "V%u: 0x%.2x (%u)\t", i, chip->V[i], chip->V[i]);
-        if ((i+1) % 4 == 0)
-        {
-            fprintf(output, "\n");
-        }
+        DumpStr(buf, "V");
+        DumpDec(buf, i);
+        DumpStr(buf, ": ");
+        DumpValue(buf, chip->V[i], 2);
+        DumpStr(buf, (i+1) % 4 == 0 ? "\t\n" : "\t");
     }
 
-    fprintf(output, "\n\n");
-    fprintf(output, "DT: 0x%.2x (%u)\n", chip->DT, chip->DT);
-    fprintf(output, "ST: 0x%.2x (%u)\n", chip->ST, chip->ST);
-    fprintf(output, "I : 0x%.4x (%u)\n", chip->I , chip->I );
-    fprintf(output, "PC: 0x%.4x (%u)\n\n", chip->PC, chip->PC);
+    DumpStr(buf, "\n\n");
+    for (unsigned i = 0; i < 4; i++)
+    {
+        DumpStr(buf, names[i]);
+        DumpValue(buf, values[i], digits[i]);
+        DumpStr(buf, "\n");
+    }
 
-    fprintf(output, "STACK_TOP: %u\n", chip->stack_top);
-    fprintf(output, "STACK:\n\t");
+    DumpStr(buf, "\nSTACK_TOP: ");
+    DumpDec(buf, chip->stack_top);
+    DumpStr(buf, "\nSTACK:\n\t");
     for (unsigned i = 0; i < CHIP8_STACK_LEN; i++)
     {
-        fprintf(output, "%.8x ", chip->stack[i]);
-        if ((i+1) % 2 == 0) fprintf(output, "\n\t");
+        DumpHex(buf, chip->stack[i], 8);
+        DumpStr(buf, (i+1) % 2 == 0 ? " \n\t" : " ");
     }
 
-    fprintf(output, "\nGFX:\n\t");
-    for (unsigned i = 0; i < CHIP8_GFX_LEN; i++)
+    DumpStr(buf, "\nGFX:\n\t");
+    for (unsigned y = 0; y < CHIP8_GFX_H; y++)
     {
-        fprintf(output, "%.2x ", chip->gfx[i]);
-        if ((i+1) % 8 == 0) fprintf(output, "\n\t");
+        DumpGfxRow(buf, chip->gfx[y]);
+        DumpStr(buf, "\n\t");
     }
 
-    fprintf(output, "\nRAM contents:\n");
-    for (unsigned i = 0; i < CHIP8_RAM_LEN; i++)
+    DumpStr(buf, "\nRAM contents:\n");
+    for (unsigned addr = 0; addr < CHIP8_RAM_LEN; addr += 0x10)
     {
-        if (i%0x10 == 0)
-        {
-            // new line
-            fprintf(output, "\n%.4x  %.2x ", i, (unsigned char)chip->ram[i]);
-        }
-        else
-        {
-            fprintf(output, "%.2x ", (unsigned char)chip->ram[i]);
-        }
+        DumpStr(buf, "\n");
+        DumpHex(buf, addr, 4);
+        DumpStr(buf, "  ");
+        DumpRamLine(buf, chip->ram, addr);
     }
-    fprintf(output, "\n");
-    return true;
+    DumpStr(buf, "\n");
+    DumpFlush(buf);
+
+    bool ok = buf->ok;
+    free(buf);
+    return ok;
 }
 
-int Chip8Execute(chip8_hw* chip, unsigned op_count)
+const chip8_profile* Chip8GetProfile(const chip8_hw* chip)
 {
-    unsigned* pc = &(chip->PC);
-    for(unsigned i = op_count; i > 0; i--)
+#ifdef CHIP8_PROFILE
+    return chip->profile;
+#else
+    return NULL;
+#endif
+}
+
+bool Chip8WriteProfile(const chip8_hw* chip, FILE* output, bool json)
+{
+    const chip8_profile* profile = Chip8GetProfile(chip);
+    if (!profile) return false;
+
+    unsigned count = GetMnemonicCount();
+    const char* sep = "";
+    if (json) fprintf(output, "{\n  \"mnemonics\": [");
+    else      fprintf(output, "kind,key,mnemonic,count\n");
+    for (unsigned i = 0; i < count; i++)
     {
-        unsigned opcode = chip->ram[*pc] << 8 | chip->ram[*pc+1];
-        unsigned op_index = DecodeOpcode(opcode);
-        *pc += 2;
+        if (profile->mnemonic[i] == 0) continue;
+        if (json) fprintf(output, "%s\n    { \"base\": \"0x%.4x\", \"mnemonic\": \"%s\", \"count\": %llu }",
+                          sep, mnemonic_list[i].base, mnemonic_list[i].mnemonic, profile->mnemonic[i]);
+        else      fprintf(output, "mnemonic,0x%.4x,%s,%llu\n", mnemonic_list[i].base, mnemonic_list[i].mnemonic, profile->mnemonic[i]);
+        sep = ",";
+    }
 
-        if (op_index == INVALID_OPCODE)
+    sep = "";
+    if (json) fprintf(output, "\n  ],\n  \"pc\": [");
+    for (unsigned pc = 0; pc < CHIP8_RAM_LEN; pc++)
+    {
+        if (profile->pc[pc] == 0) continue;
+        const char* name = chip->icache[pc].fun ? mnemonic_list[ chip->icache[pc].index ].mnemonic : "";
+        if (json) fprintf(output, "%s\n    { \"pc\": \"0x%.4x\", \"mnemonic\": \"%s\", \"count\": %llu }",
+                          sep, pc, name, profile->pc[pc]);
+        else      fprintf(output, "pc,0x%.4x,%s,%llu\n", pc, name, profile->pc[pc]);
+        sep = ",";
+    }
+    if (json) fprintf(output, "\n  ]\n}\n");
+    return !ferror(output);
+}
+
+bool Chip8DumpBinary(const chip8_hw* chip, FILE* output)
+{
+    chip8_state* state = (chip8_state*)malloc(sizeof(chip8_state));
+    if (!state) return false;
+    Chip8SaveState(chip, state);
+    bool ok = fwrite(state, sizeof(chip8_state), 1, output) == 1;
+    free(state);
+    return ok;
+}
+
+/* Copy field of chip8_hw from a saved state, the data has no alignment */
+#define STATE_FIELD(state, field, out) \
+    memcpy(&(out), (state)->data + (offsetof(chip8_hw, field) - CHIP8_STATE_BEGIN), sizeof(out))
+
+bool Chip8DumpDiff(const chip8_hw* chip, const chip8_state* ref, FILE* output)
+{
+    if (ref->magic    != CHIP8_STATE_MAGIC   ||
+        ref->version  != CHIP8_STATE_VERSION ||
+        ref->size     != sizeof(chip8_state) ||
+        ref->data_len != sizeof(ref->data))
+    {
+        return false;
+    }
+
+    dump_buffer* buf = (dump_buffer*)malloc(sizeof(dump_buffer));
+    if (!buf) return false;
+    buf->output = output;
+    buf->len    = 0;
+    buf->ok     = true;
+
+    // Reference fields are read from the state at their offsets in chip8_hw
+    unsigned char old_V[ REGISTER_V_COUNT ];
+    uint16_t old_I, old_PC, old_stack[ CHIP8_STACK_LEN ];
+    uint8_t  old_DT, old_ST, old_stack_top;
+    uint32_t old_rng;
+    unsigned long long old_cycles;
+    uint64_t old_gfx[ CHIP8_GFX_H ];
+    STATE_FIELD(ref, V, old_V);
+    STATE_FIELD(ref, I, old_I);
+    STATE_FIELD(ref, PC, old_PC);
+    STATE_FIELD(ref, DT, old_DT);
+    STATE_FIELD(ref, ST, old_ST);
+    STATE_FIELD(ref, stack_top, old_stack_top);
+    STATE_FIELD(ref, rng, old_rng);
+    STATE_FIELD(ref, stack, old_stack);
+    STATE_FIELD(ref, cycles, old_cycles);
+    STATE_FIELD(ref, gfx, old_gfx);
+    const unsigned char* old_ram = ref->data + (offsetof(chip8_hw, ram) - CHIP8_STATE_BEGIN);
+
+    static const char* names[] = { "DT", "ST", "I ", "PC", "SP", "RNG" };
+    const unsigned values[]    = { chip->DT, chip->ST, chip->I, chip->PC, chip->stack_top, chip->rng };
+    const unsigned old_values[] = { old_DT, old_ST, old_I, old_PC, old_stack_top, old_rng };
+    const unsigned digits[]    = { 2, 2, 4, 4, 2, 8 };
+
+    for (unsigned i = 0; i < REGISTER_V_COUNT; i++)
+    {
+        if (chip->V[i] == old_V[i]) continue;
+        DumpStr(buf, "V");
+        DumpHex(buf, i, 1);
+        DumpStr(buf, ": ");
+        DumpValue(buf, old_V[i], 2);
+        DumpStr(buf, " -> ");
+        DumpValue(buf, chip->V[i], 2);
+        DumpStr(buf, "\n");
+    }
+    for (unsigned i = 0; i < sizeof(names)/sizeof(names[0]); i++)
+    {
+        if (values[i] == old_values[i]) continue;
+        DumpStr(buf, names[i]);
+        DumpStr(buf, ": ");
+        DumpValue(buf, old_values[i], digits[i]);
+        DumpStr(buf, " -> ");
+        DumpValue(buf, values[i], digits[i]);
+        DumpStr(buf, "\n");
+    }
+    for (unsigned i = 0; i < CHIP8_STACK_LEN; i++)
+    {
+        if (chip->stack[i] == old_stack[i]) continue;
+        DumpStr(buf, "STACK[");
+        DumpDec(buf, i);
+        DumpStr(buf, "]: ");
+        DumpHex(buf, old_stack[i], 4);
+        DumpStr(buf, " -> ");
+        DumpHex(buf, chip->stack[i], 4);
+        DumpStr(buf, "\n");
+    }
+    if (chip->cycles != old_cycles)
+    {
+        DumpStr(buf, "CYCLES: ");
+        DumpDec(buf, old_cycles);
+        DumpStr(buf, " -> ");
+        DumpDec(buf, chip->cycles);
+        DumpStr(buf, "\n");
+    }
+
+    // Rows and lines as before and after
+    for (unsigned y = 0; y < CHIP8_GFX_H; y++)
+    {
+        if (chip->gfx[y] == old_gfx[y]) continue;
+        DumpStr(buf, "GFX ");
+        DumpHex(buf, y, 2);
+        DumpStr(buf, "\n- ");
+        DumpGfxRow(buf, old_gfx[y]);
+        DumpStr(buf, "\n+ ");
+        DumpGfxRow(buf, chip->gfx[y]);
+        DumpStr(buf, "\n");
+    }
+    for (unsigned addr = 0; addr < CHIP8_RAM_LEN; addr += 0x10)
+    {
+        unsigned len = CHIP8_RAM_LEN - addr < 0x10 ? CHIP8_RAM_LEN - addr : 0x10;
+        if (memcmp(chip->ram + addr, old_ram + addr, len) == 0) continue;
+        DumpStr(buf, "RAM ");
+        DumpHex(buf, addr, 4);
+        DumpStr(buf, "\n- ");
+        DumpRamLine(buf, old_ram, addr);
+        DumpStr(buf, "\n+ ");
+        DumpRamLine(buf, chip->ram, addr);
+        DumpStr(buf, "\n");
+    }
+    DumpFlush(buf);
+
+    bool ok = buf->ok;
+    free(buf);
+    return ok;
+}
+
+static int Chip8ExecuteInterpreter(chip8_hw* chip, unsigned op_count)
+{
+    for(unsigned i = op_count; i > 0; i--)
+    {
+        unsigned pc = chip->PC;
+        if (pc >= CHIP8_RAM_LEN - 1)
         {
-            fprintf(stderr, "ERROR: Invalid opcode 0x%.4x[%u] at %u\n", opcode, op_index, *pc -2);
+            fprintf(stderr, "ERROR: PC out of RAM at %u\n", pc);
             return -1;
         }
 
+        decoded_instr* instr = &(chip->icache[ pc ]);
+        if (instr->fun == NULL)
+        {
+            unsigned opcode = chip->ram[pc] << 8 | chip->ram[pc+1];
+            if (!DecodeOperands(opcode, instr))
+            {
+                fprintf(stderr, "ERROR: Invalid opcode 0x%.4x at %u\n", opcode, pc);
+                return -1;
+            }
+        }
+        chip->PC = pc + 2;
+
+#ifdef CHIP8_PROFILE
+        chip->profile->mnemonic[ instr->index ]++;
+        chip->profile->pc[ pc ]++;
+#endif
         if (chip->log_level >= 2)
         {
-            printf("Executing opcode index: 0x%.4x[%u] (%s) at %u\n", opcode, op_index, mnemonic_list[op_index].mnemonic, *pc -2);
+            printf("Executing opcode index: 0x%.4x[%u] (%s) at %u\n", instr->opcode, instr->index, mnemonic_list[instr->index].mnemonic, pc);
+        }
+        instr->fun(chip, instr);
+
+        if (instr->fun == _1nnn && !instr->busy)
+        {
+            i -= Chip8SkipIdleLoop(chip, pc, chip->PC, i - 1);
         }
-        instr_fptr fun = mnemonic_list[op_index].fun;
-        fun(chip, opcode);
     }
 
     return 0;
 }
 
+int Chip8Execute(chip8_hw* chip, unsigned op_count)
+{
+    int ret;
+    chip->idle = false;
+
+    // Only the interpreter logs and profiles executed instructions
+    if (chip->log_level >= 2 || PROFILE_ENABLED)
+    {
+        ret = Chip8ExecuteInterpreter(chip, op_count);
+    }
+    else switch (chip->engine)
+    {
+        case CHIP8_ENGINE_THREADED:
+            ret = Chip8ExecuteThreaded(chip, op_count);
+            break;
+        case CHIP8_ENGINE_JIT:
+            ret = Chip8ExecuteJit(chip, op_count);
+            break;
+        case CHIP8_ENGINE_INTERPRETER:
+        default:
+            ret = Chip8ExecuteInterpreter(chip, op_count);
+            break;
+    }
+
+    if (ret == 0) chip->cycles += op_count;
+    return ret;
+}
+
 int Chip8ProcessTimers(chip8_hw* chip, unsigned decrement_count)
 {
     if (chip->DT > 0)
@@ -162,3 +488,127 @@ int Chip8ProcessTimers(chip8_hw* chip, unsigned decrement_count)
     }
     return 0;
 }
+
+void Chip8Seed(chip8_hw* chip, unsigned seed)
+{
+    // Spread close seeds apart, xorshift gets stuck at 0
+    uint32_t x = seed * 0x9e3779b9u;
+    x ^= x >> 16;
+    chip->rng = x ? x : 1;
+}
+
+void Chip8InvalidateCode(chip8_hw* chip, unsigned addr, unsigned len)
+{
+    // Instruction starting from previous byte overlaps addr too
+    unsigned begin = (addr > 0) ? addr - 1 : 0;
+    unsigned end   = addr + len;
+    if (end > CHIP8_RAM_LEN)
+    {
+        // Stores through I wrap around to the beginning of RAM
+        if (addr < CHIP8_RAM_LEN) Chip8InvalidateCode(chip, 0, end - CHIP8_RAM_LEN);
+        end = CHIP8_RAM_LEN;
+    }
+
+    for (unsigned i = begin; i < end; i++)
+    {
+        chip->icache[ i ].fun  = NULL;
+        chip->icache[ i ].busy = false;
+    }
+    JitInvalidate(chip, addr, end);
+}
+
+static const decoded_instr* GetInstr(chip8_hw* chip, unsigned addr)
+{
+    if (addr >= CHIP8_RAM_LEN - 1) return NULL;
+
+    decoded_instr* instr = &(chip->icache[ addr ]);
+    if (instr->fun == NULL && !DecodeOperands(chip->ram[addr] << 8 | chip->ram[addr+1], instr)) return NULL;
+    return instr;
+}
+
+/* Loop body may only read DT and keys, and must take the same path every time */
+static unsigned GetIdleLoopLength(chip8_hw* chip, unsigned jump, unsigned target)
+{
+    decoded_instr* jmp = (decoded_instr*)GetInstr(chip, jump);
+    if (!jmp || jmp->busy) return 0;
+
+    // Jumps that can never close an idle loop are remembered too
+    if (target > jump || (jump - target) % 2 != 0 || (jump - target) / 2 >= IDLE_LOOP_MAX_LEN)
+    {
+        jmp->busy = true;
+        return 0;
+    }
+
+    for (unsigned addr = target; addr < jump; addr += 2)
+    {
+        const decoded_instr* in = GetInstr(chip, addr);
+        if (!in) return 0;
+
+        const unsigned char* V = chip->V;
+        bool stable;
+        if      (in->fun == _Fx07) stable = V[ in->x ] == chip->DT;
+        else if (in->fun == _3xnn) stable = V[ in->x ] != in->nn;
+        else if (in->fun == _4xnn) stable = V[ in->x ] == in->nn;
+        else if (in->fun == _5xy0) stable = V[ in->x ] != V[ in->y ];
+        else if (in->fun == _9xy0) stable = V[ in->x ] == V[ in->y ];
+        else if (in->fun == _Ex9E) stable = !Chip8IsKeyDown(chip, V[ in->x ]);
+        else if (in->fun == _ExA1) stable =  Chip8IsKeyDown(chip, V[ in->x ]);
+        else
+        {
+            // Remember loops with side effects, they are never idle
+            jmp->busy = true;
+            return 0;
+        }
+
+        if (!stable) return 0;
+    }
+    return (jump - target) / 2 + 1;
+}
+
+unsigned Chip8SkipIdleLoop(chip8_hw* chip, unsigned jump, unsigned target, unsigned remaining)
+{
+    unsigned len = GetIdleLoopLength(chip, jump, target);
+    if (len == 0) return 0;
+
+    unsigned skipped = remaining / len * len;
+    chip->idle_cycles += skipped;
+    chip->idle = true;
+    return skipped;
+}
+
+void Chip8SaveState(const chip8_hw* chip, chip8_state* state)
+{
+    state->magic       = CHIP8_STATE_MAGIC;
+    state->version     = CHIP8_STATE_VERSION;
+    state->size        = sizeof(chip8_state);
+    state->data_len    = sizeof(state->data);
+    memcpy(state->data, (const unsigned char*)chip + CHIP8_STATE_BEGIN, sizeof(state->data));
+}
+
+bool Chip8LoadState(chip8_hw* chip, const chip8_state* state)
+{
+    if (state->magic    != CHIP8_STATE_MAGIC   ||
+        state->version  != CHIP8_STATE_VERSION ||
+        state->size     != sizeof(chip8_state) ||
+        state->data_len != sizeof(state->data))
+    {
+        return false;
+    }
+
+    chip->idle         = false;
+    chip->was_blocking = false;
+    memcpy((unsigned char*)chip + CHIP8_STATE_BEGIN, state->data, offsetof(chip8_hw, ram) - CHIP8_STATE_BEGIN);
+
+    // Only changed parts of RAM can hold stale code
+    const unsigned char* ram = state->data + (offsetof(chip8_hw, ram) - CHIP8_STATE_BEGIN);
+    for (unsigned addr = 0; addr < CHIP8_RAM_LEN; addr += STATE_RAM_CHUNK)
+    {
+        unsigned len = CHIP8_RAM_LEN - addr < STATE_RAM_CHUNK ? CHIP8_RAM_LEN - addr : STATE_RAM_CHUNK;
+        if (memcmp(chip->ram + addr, ram + addr, len) != 0)
+        {
+            memcpy(chip->ram + addr, ram + addr, len);
+            Chip8InvalidateCode(chip, addr, len);
+        }
+    }
+    return true;
+}
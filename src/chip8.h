@@ -3,9 +3,12 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #define CHIP8_PROG_START    0x200
-#define CHIP8_RAM_LEN       0xE90
+#define CHIP8_RAM_LEN       0x1000
+#define CHIP8_ADDR_MASK     ( CHIP8_RAM_LEN - 1 ) /* Addresses through I wrap around at 12 bits */
 #define CHIP8_PROG_MAX_LEN  ( CHIP8_RAM_LEN - CHIP8_PROG_START )
 
 #define CHIP8_CHARSET_LEN         5*16
@@ -16,32 +19,92 @@
 #define CHIP8_STACK_LEN     12
 #define CHIP8_GFX_W         64
 #define CHIP8_GFX_H         32
-#define CHIP8_GFX_LEN       ( CHIP8_GFX_W / 8 * CHIP8_GFX_H )
+#define CHIP8_GFX_LEN       ( CHIP8_GFX_W / 8 * CHIP8_GFX_H ) /* Bytes */
+
+/* Pixel x of gfx row, 1 if set */
+#define CHIP8_GFX_PIXEL(row, x)  (((row) >> (CHIP8_GFX_W - 1 - (x))) & 1)
+
+#define CHIP8_KEY_COUNT     0x10
 
 #define CHIP8_CPU_FREQ  500
 #define CHIP8_DT_FREQ   60
 
+/* Execution engines, see chip8_hw.engine */
+enum {
+    CHIP8_ENGINE_INTERPRETER = 0,
+    CHIP8_ENGINE_THREADED,
+    CHIP8_ENGINE_JIT,
+};
+
 typedef struct chip8_hw chip8_hw;
+typedef struct decoded_instr decoded_instr;
+#define CHIP8_CACHE_LINE    64
+
+#define CHIP8_PROFILE_MNEMONICS  0x100 /* decoded_instr.index is a byte */
+
+/* Executed instructions, only counted in builds with CHIP8_PROFILE defined */
+typedef struct {
+    unsigned long long mnemonic[ CHIP8_PROFILE_MNEMONICS ]; /* By mnemonic_list index */
+    unsigned long long pc[ CHIP8_RAM_LEN ];                 /* By address */
+} chip8_profile;
+
+/*
+ *  Hot state first: icache and the registers fill the first cache line,
+ *  counters and gfx follow, then RAM on a line of its own. Host hooks and
+ *  settings are cold and go last.
+ */
 struct chip8_hw {
-    unsigned char* ram;
+    decoded_instr* icache; /* Decoded instruction for each RAM address */
+
+    /* Machine state from V to ram is saved as is, see Chip8SaveState() */
     unsigned char  V[ REGISTER_V_COUNT ]; /* General purpose registers */
-    unsigned short I;   /* Address register */
+    uint16_t I;   /* Address register */
+    uint16_t PC;  /* Program counter */
+    uint8_t  DT;  /* Delay timer */
+    uint8_t  ST;  /* Sound timer */
+    uint8_t  stack_top;
+    uint8_t  pad0;
+    uint16_t keys;               /* Keys down, bit per key. Latched by host between Chip8Execute() calls */
+    uint16_t pad1;
+    uint32_t rng;                /* Cxnn xorshift state, never 0. See Chip8Seed() */
+    uint16_t stack[ CHIP8_STACK_LEN ];
+
+    unsigned long long cycles;      /* Instructions retired, including skipped ones */
+    unsigned long long idle_cycles; /* Instructions skipped in idle loops */
+    uint64_t gfx[ CHIP8_GFX_H ];    /* Row per word, most significant bit is x = 0 */
 
-    unsigned PC;      /* Program counter */
-    unsigned char DT; /* Delay timer */
-    unsigned char ST; /* Sound timer */
-    unsigned stack[ CHIP8_STACK_LEN ];
-    unsigned stack_top;
-    unsigned char gfx[ CHIP8_GFX_LEN ];
+    unsigned char ram[ CHIP8_RAM_LEN ] __attribute__((aligned(CHIP8_CACHE_LINE)));
 
-    bool     (*is_key_down)(unsigned);
+    struct jit_state* jit; /* Compiled code, see jit.c */
+
+    bool     (*is_key_down)(unsigned); /* Optional, overrides keys for lower latency */
     unsigned (*get_key_blocking)();
     void     (*draw_screen)(chip8_hw*);
+    void     (*play_sound)(unsigned ticks); /* Optional, called when ST is set */
 
     unsigned log_level;
+    unsigned engine;    /* CHIP8_ENGINE_* used by Chip8Execute() */
+#ifdef CHIP8_PROFILE
+    chip8_profile* profile;
+#endif
 
+    bool idle; // last Chip8Execute() ended in an idle loop
     bool was_blocking; // blocking instruction was run
-};
+} __attribute__((aligned(CHIP8_CACHE_LINE)));
+
+#define CHIP8_STATE_MAGIC    0x38504843 /* "CHP8" */
+#define CHIP8_STATE_VERSION  4
+#define CHIP8_STATE_BEGIN    offsetof(chip8_hw, V)
+#define CHIP8_STATE_END      ( offsetof(chip8_hw, ram) + CHIP8_RAM_LEN )
+
+/* Binary save state, only valid for the build it was saved with */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;       /* sizeof(chip8_state) */
+    uint32_t data_len;
+    unsigned char data[ CHIP8_STATE_END - CHIP8_STATE_BEGIN ];
+} chip8_state;
 
 static const char chip8_charset[ CHIP8_CHARSET_LEN ] = {
     0xf0, 0x90, 0x90, 0x90, 0xf0, // 0
@@ -63,6 +126,24 @@ static const char chip8_charset[ CHIP8_CHARSET_LEN ] = {
 };
 
 
+/* Key state seen by Ex9E and ExA1 */
+static inline bool Chip8IsKeyDown(chip8_hw* chip, unsigned key)
+{
+    if (chip->is_key_down) return chip->is_key_down(key);
+    return key < CHIP8_KEY_COUNT && (chip->keys >> key) & 1;
+}
+
+/* Next random number of chip, xorshift32 */
+static inline uint32_t Chip8Random(chip8_hw* chip)
+{
+    uint32_t x = chip->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    chip->rng = x;
+    return x;
+}
+
 bool Chip8Init( chip8_hw* chip );
 void Chip8Free( chip8_hw* chip );
 bool Chip8LoadProgram( chip8_hw* chip, const char* file );
@@ -70,4 +151,54 @@ bool Chip8Dump( chip8_hw* chip, FILE* output );
 int  Chip8Execute(chip8_hw* chip, unsigned op_count);
 int  Chip8ProcessTimers(chip8_hw* chip, unsigned decrement_count);
 
+/* Start random number sequence of Cxnn, same seed gives same numbers. Chip8Init() uses 1 */
+void Chip8Seed(chip8_hw* chip, unsigned seed);
+
+/**
+ *  \brief  Copy machine state and RAM to state
+ *  \note   Host hooks, engine and caches are not saved
+ */
+void Chip8SaveState(const chip8_hw* chip, chip8_state* state);
+
+/**
+ *  \brief  Restore machine state saved by Chip8SaveState()
+ *  \return false if state is from another version, chip is not changed then
+ */
+bool Chip8LoadState(chip8_hw* chip, const chip8_state* state);
+
+/* Instruction counts of chip, NULL if not built with CHIP8_PROFILE */
+const chip8_profile* Chip8GetProfile(const chip8_hw* chip);
+
+/**
+ *  \brief  Write instruction counts by mnemonic and by address as JSON or CSV
+ *  \return false if not built with CHIP8_PROFILE or writing failed
+ */
+bool Chip8WriteProfile(const chip8_hw* chip, FILE* output, bool json);
+
+/* Write chip8_state of chip as saved by Chip8SaveState(), for tools to parse */
+bool Chip8DumpBinary(const chip8_hw* chip, FILE* output);
+
+/**
+ *  \brief  Write only registers, gfx rows and RAM lines that differ from ref
+ *  \return false if ref is from another version or writing failed
+ */
+bool Chip8DumpDiff(const chip8_hw* chip, const chip8_state* ref, FILE* output);
+
+/**
+ *  \brief  Drop decoded instructions overlapping RAM[addr...addr+len-1]
+ *  \note   Must be called after writing to chip->ram outside of opcodes
+ */
+void Chip8InvalidateCode(chip8_hw* chip, unsigned addr, unsigned len);
+
+/**
+ *  \brief  Fast-forward a loop which only polls DT or keys
+ *  \param  jump      Address of the 1nnn closing the loop
+ *  \param  target    Address jumped to
+ *  \param  remaining Instructions left in the current Chip8Execute()
+ *  \return Instructions skipped, a multiple of the loop length
+ *  \note   Nothing changes inside such a loop until the next Chip8ProcessTimers()
+ *          or key event, so executing it until the budget runs out is pointless
+ */
+unsigned Chip8SkipIdleLoop(chip8_hw* chip, unsigned jump, unsigned target, unsigned remaining);
+
 #endif // CHIP8_H
@@ -1,39 +1,34 @@
 #include <stdlib.h>
+#include <assert.h>
 
 #include "chip8.h"
 #include "decoder.h"
 #include "opcodes.h"
 
+#define MAX_MNEMONICS DECODE_TABLE_INVALID
+
 typedef struct {
     unsigned mask;
     unsigned base;
 } opcode_info;
 
-static opcode_info* opcode_table = NULL;
-static unsigned     opcode_table_len = 0;
+static opcode_info opcode_table[ MAX_MNEMONICS ];
+static unsigned    opcode_table_len = 0;
 
-void FreeOpcodeTable()
-{
-    if (opcode_table) free(opcode_table);
-}
+unsigned char decode_table[ DECODE_TABLE_LEN ];
 
-void GenerateOpcodeTable()
+static void GenerateOpcodeTable()
 {
-    if (opcode_table != NULL) return;
-
     unsigned list_size = GetMnemonicCount();
-    opcode_table = (opcode_info*)malloc(sizeof(opcode_info)*list_size);
-    if (!opcode_table) return;
+    assert(list_size < MAX_MNEMONICS);
     opcode_table_len = list_size;
 
-    atexit(FreeOpcodeTable); // Free opcode table at exit
-
     for (unsigned i = 0; i < list_size; i++)
     {
         const mnemonic* m = &mnemonic_list[ i ];
         opcode_table[i].base = m->base;
         opcode_table[i].mask = 0;
-        for (unsigned j = 0; m->operands[ j ].fmt != NULL && j < MAX_OPERANDS; j++)
+        for (unsigned j = 0; j < MAX_OPERANDS && m->operands[ j ].fmt != NULL; j++)
         {
             opcode_table[i].mask |= m->operands[ j ].mask;
         }
@@ -41,10 +36,21 @@ void GenerateOpcodeTable()
     }
 }
 
-unsigned DecodeOpcode(unsigned opcode)
+/* Run before main() so that DecodeOpcode() doesn't need to check for the table */
+__attribute__((constructor))
+static void GenerateDecodeTable()
 {
-    if (!opcode_table) GenerateOpcodeTable();
+    GenerateOpcodeTable();
 
+    for (unsigned opcode = 0; opcode < DECODE_TABLE_LEN; opcode++)
+    {
+        unsigned index = DecodeOpcodeScan(opcode);
+        decode_table[ opcode ] = (index == INVALID_OPCODE) ? DECODE_TABLE_INVALID : index;
+    }
+}
+
+unsigned DecodeOpcodeScan(unsigned opcode)
+{
     for (unsigned i=0; i < opcode_table_len; i++)
     {
         opcode_info* op = opcode_table+i;
@@ -53,3 +59,21 @@ unsigned DecodeOpcode(unsigned opcode)
 
     return INVALID_OPCODE;
 }
+
+bool DecodeOperands(unsigned opcode, decoded_instr* output)
+{
+    unsigned index = DecodeOpcode(opcode);
+    if (index == INVALID_OPCODE) return false;
+
+    output->opcode = opcode;
+    output->nnn    = opcode & 0xfff;
+    output->nn     = opcode & 0xff;
+    output->n      = GET_NIBBLE(opcode, 0);
+    output->y      = GET_NIBBLE(opcode, 1);
+    output->x      = GET_NIBBLE(opcode, 2);
+    output->index  = index;
+    output->busy   = false;
+    output->fun    = mnemonic_list[ index ].fun;
+
+    return true;
+}
@@ -1,6 +1,33 @@
+#ifndef DECODER_H
+#define DECODER_H
+
 #include "chip8.h"
 #include "opcodes.h"
 
 #define INVALID_OPCODE 0xffff
 
-unsigned DecodeOpcode( unsigned );
+#define DECODE_TABLE_LEN      0x10000
+#define DECODE_TABLE_INVALID  0xff
+
+/**
+ *  Maps every 16-bit opcode directly to its index in mnemonic_list.
+ *  Generated once before main() is entered, see decoder.c.
+ */
+extern unsigned char decode_table[ DECODE_TABLE_LEN ];
+
+static inline unsigned DecodeOpcode(unsigned opcode)
+{
+    unsigned index = decode_table[ opcode & 0xffff ];
+    return index == DECODE_TABLE_INVALID ? INVALID_OPCODE : index;
+}
+
+/**
+ *  \brief  Decode opcode and extract all of its operands
+ *  \return false if opcode is invalid, output isn't modified then
+ */
+bool DecodeOperands( unsigned opcode, decoded_instr* output );
+
+/* Linear scan over mnemonic_list, used to build decode_table */
+unsigned DecodeOpcodeScan( unsigned );
+
+#endif // DECODER_H
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "decoder.h"
+#include "disasm.h"
+#include "opcodes.h"
+
+#define BUF_CHUNK_SZ 512
+
+bool DisassembleInstruction(unsigned short instr, char* output)
+{
+    unsigned index = DecodeOpcode( instr );
+    if (index == INVALID_OPCODE)
+    {
+        return false;
+    }
+
+    const char* mnemonic_str = mnemonic_list[ index ].mnemonic;
+    const operand* opers     = mnemonic_list[ index ].operands;
+
+    strcpy(output, mnemonic_str);
+
+    for (unsigned i=0; i < 3 && opers[i].fmt; i++)
+    {
+        unsigned l = strlen(output);
+        if (i > 0)
+        {
+            output[l++] = ',';
+        }
+        output[l++] = ' ';
+        output[l]   = '\0';
+
+        strcpy( output + l, opers[i].fmt);
+        if (opers[i].mask != 0)
+        {
+            unsigned value = GetValueByMask(instr, opers[i].mask);
+            char fmt_str[128];
+            strcpy(fmt_str, output);
+            sprintf( output, fmt_str, value);
+        }
+    }
+    return true;
+}
+
+static bool AppendString(char** buffer, unsigned* buffer_len, const char* new_str)
+{
+    unsigned buf_chunks = (*buffer_len / BUF_CHUNK_SZ) + 1;
+    unsigned new_len    = strlen(new_str) + *buffer_len +2;
+
+    // Reallocate more space if needed
+    if (new_len > buf_chunks * BUF_CHUNK_SZ ||
+        *buffer == NULL)
+    {
+        buf_chunks = new_len / BUF_CHUNK_SZ +1;
+        *buffer = (char*)realloc(*buffer, buf_chunks * BUF_CHUNK_SZ);
+    }
+    if (*buffer == NULL) return false;
+
+    strcpy( *buffer + *buffer_len, new_str);
+    (*buffer)[new_len-2]   = '\n';
+    (*buffer)[new_len-1] = '\0';
+    *buffer_len = new_len-1;
+    return true;
+}
+
+bool DisassembleCode(const unsigned char* bin, unsigned len, char** output, unsigned* output_len)
+{
+    bool ok = true;
+    char decoded_str[ DISASM_MAX_INSTR_CHR ] = {0};
+    *output     = NULL;
+    *output_len = 0;
+    for (unsigned i = 0; i + 1 < len; i += 2)
+    {
+        unsigned short cur = bin[i] << 8 | bin[i+1];
+        if (DisassembleInstruction( cur, decoded_str ))
+        {
+            ok = AppendString(output, output_len, decoded_str) && ok;
+        }
+        else
+        {
+            fprintf(stderr, "Failed to decode instruction '%.4x'\n", cur);
+        }
+    }
+    return ok;
+}
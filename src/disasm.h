@@ -0,0 +1,21 @@
+#ifndef DISASM_H
+#define DISASM_H
+
+#include <stdbool.h>
+
+#define DISASM_MAX_INSTR_CHR  32 /* Longest disassembled instruction with terminator */
+
+/**
+ *  \brief  Write mnemonic and operands of instruction, e.g. "MOV V0, 1"
+ *  \param[out] output  At least DISASM_MAX_INSTR_CHR characters
+ *  \return false if instruction is invalid
+ */
+bool DisassembleInstruction(unsigned short instr, char* output);
+
+/**
+ *  \brief  Disassemble big-endian code, a line per instruction
+ *  \note   Invalid instructions are reported and skipped. output must be freed!
+ */
+bool DisassembleCode(const unsigned char* bin, unsigned len, char** output, unsigned* output_len);
+
+#endif // DISASM_H
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "chip8.h"
+#include "emu_thread.h"
+#include "scheduler.h"
+
+#define KEY_WAIT_INTERVAL_NSEC  1000000
+
+/*
+ *  Triple buffer: the thread owns back, the UI owns front and the third
+ *  buffer is exchanged through middle. FRAME_FRESH is set in middle when
+ *  it holds a frame the UI hasn't taken yet.
+ */
+#define FRAME_FRESH  4
+
+static struct {
+    emu_frame      frames[3];
+    atomic_uint    middle;
+    unsigned       back;
+    unsigned       front;
+
+    atomic_ushort  keys;
+    atomic_bool    stop;
+
+    chip8_hw*      chip;
+    pthread_t      thread;
+    bool           running;
+} emu;
+
+static void PublishFrame(chip8_hw* chip)
+{
+    emu_frame* frame = &(emu.frames[ emu.back ]);
+    memcpy(frame->gfx, chip->gfx, sizeof(frame->gfx));
+    frame->cycles = chip->cycles;
+
+    unsigned prev = atomic_exchange_explicit(&emu.middle, emu.back | FRAME_FRESH, memory_order_acq_rel);
+    emu.back = prev & ~FRAME_FRESH;
+}
+
+static bool IsKeyDown(unsigned key)
+{
+    unsigned short keys = atomic_load_explicit(&emu.keys, memory_order_relaxed);
+    return key < CHIP8_KEY_COUNT && (keys >> key) & 1;
+}
+
+static unsigned GetKeyBlocking()
+{
+    const struct timespec interval = { 0, KEY_WAIT_INTERVAL_NSEC };
+    while (!atomic_load_explicit(&emu.stop, memory_order_relaxed))
+    {
+        unsigned short keys = atomic_load_explicit(&emu.keys, memory_order_relaxed);
+        for (unsigned i = 0; i < CHIP8_KEY_COUNT; i++)
+        {
+            if (keys & (1 << i)) return i;
+        }
+        nanosleep(&interval, NULL);
+    }
+    return 0;
+}
+
+static void* EmuThreadMain(void* arg)
+{
+    chip8_hw* chip = (chip8_hw*)arg;
+
+    chip8_scheduler sched;
+    SchedulerInit(&sched, CHIP8_CPU_FREQ, CHIP8_DT_FREQ);
+
+    while (!atomic_load_explicit(&emu.stop, memory_order_relaxed))
+    {
+        chip->keys = atomic_load_explicit(&emu.keys, memory_order_relaxed);
+        if (SchedulerUpdate(&sched, chip) > 0)
+        {
+            PublishFrame(chip);
+        }
+        SchedulerWaitNextTick(&sched);
+    }
+    return NULL;
+}
+
+bool EmuThreadStart(chip8_hw* chip)
+{
+    if (emu.running) return false;
+
+    memset(emu.frames, 0, sizeof(emu.frames));
+    atomic_store(&emu.middle, 1);
+    emu.back  = 0;
+    emu.front = 2;
+    atomic_store(&emu.keys, 0);
+    atomic_store(&emu.stop, false);
+
+    // Fx0A shows the screen before waiting for a key
+    if (chip->is_key_down) chip->is_key_down = IsKeyDown;
+    chip->get_key_blocking = GetKeyBlocking;
+    chip->draw_screen      = PublishFrame;
+
+    emu.chip = chip;
+    if (pthread_create(&emu.thread, NULL, EmuThreadMain, chip) != 0)
+    {
+        fprintf(stderr, "ERROR: Failed to create emulation thread\n");
+        return false;
+    }
+    emu.running = true;
+    return true;
+}
+
+void EmuThreadStop()
+{
+    if (!emu.running) return;
+
+    atomic_store(&emu.stop, true);
+    pthread_join(emu.thread, NULL);
+    emu.running = false;
+}
+
+void EmuThreadSetKeys(unsigned short keys)
+{
+    atomic_store_explicit(&emu.keys, keys, memory_order_relaxed);
+}
+
+const emu_frame* EmuThreadGetFrame()
+{
+    if (atomic_load_explicit(&emu.middle, memory_order_relaxed) & FRAME_FRESH)
+    {
+        unsigned prev = atomic_exchange_explicit(&emu.middle, emu.front, memory_order_acq_rel);
+        emu.front = prev & ~FRAME_FRESH;
+    }
+    return &(emu.frames[ emu.front ]);
+}
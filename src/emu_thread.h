@@ -0,0 +1,34 @@
+#ifndef EMU_THREAD_H
+#define EMU_THREAD_H
+
+#include <stdint.h>
+#include "chip8.h"
+
+/* Output of the emulation thread shown by the UI */
+typedef struct {
+    uint64_t           gfx[ CHIP8_GFX_H ];
+    unsigned long long cycles;
+} emu_frame;
+
+/**
+ *  \brief  Run Chip8Execute() and Chip8ProcessTimers() of chip on a thread of its own
+ *  \note   chip must not be touched by the caller until EmuThreadStop().
+ *          Keys are latched before every scheduler update, or read on each
+ *          Ex9E/ExA1 if chip->is_key_down is set. Key and draw callbacks of
+ *          chip are replaced, only one thread can run at a time.
+ */
+bool EmuThreadStart(chip8_hw* chip);
+
+/* Stop thread and wait for it to finish */
+void EmuThreadStop();
+
+/* Keys held down, one bit per key. Read by the thread without locks */
+void EmuThreadSetKeys(unsigned short keys);
+
+/**
+ *  \brief  Newest frame published by the thread
+ *  \note   Stays valid until the next call, never blocks
+ */
+const emu_frame* EmuThreadGetFrame();
+
+#endif // EMU_THREAD_H
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "runner.h"
+#include "util.h"
+
+#define DEFAULT_FRAMES  (60 * CHIP8_DT_FREQ) /* One minute */
+#define DEFAULT_SAMPLE_INTERVAL  97 /* Prime, so loops don't line up with samples */
+
+const char* help_text = \
+"./chip8_headless <path-to-chip8-bin> [-n <count>] [-f <count>] [-k <file>] [-r <file>] [-s <seed>] [-t|-j] [-d] [-D <file>] [-c <file>] [-p <file>]\n"
+"\t[-g <file> [-i <count>] [-m <file>]] [-H <hash>]\n"
+"\t-n\tRun given number of instructions\n"
+"\t-f\tRun given number of frames, 60 per second (default: 3600)\n"
+"\t-k\tRead key presses from file, lines of \"<frame> <key mask>\"\n"
+"\t-r\tReplay input log recorded by the emulator, runs to its end by default\n"
+"\t-s\tSeed of random numbers, replay uses the recorded one (default: 1)\n"
+"\t-t\tUse threaded-code execution engine\n"
+"\t-j\tUse x86-64 JIT compiler execution engine\n"
+"\t-d\tDump full machine state at the end\n"
+"\t-D\tWrite machine state at the end to file as binary\n"
+"\t-c\tPrint only what differs from binary state in file at the end\n"
+"\t-p\tWrite instruction counts to .json or .csv file, needs a PROFILE=1 build\n"
+"\t-g\tSample call stacks and write them to file in folded format for flamegraphs\n"
+"\t-i\tInstructions between call stack samples (default: 97)\n"
+"\t-m\tName routines with label map written by assembler -m\n"
+"\t-H\tFail unless the state hash at the end is the given one\n";
+
+static bool DumpBinary(const chip8_hw* chip, const char* file)
+{
+    FILE* f = fopen(file, "wb");
+    bool ok = f && Chip8DumpBinary(chip, f);
+    if (f && fclose(f) != 0) ok = false;
+    if (!ok) fprintf(stderr, "Failed to write state to %s\n", file);
+    return ok;
+}
+
+static bool DumpDiff(const chip8_hw* chip, const char* file)
+{
+    unsigned char* ref = NULL;
+    unsigned len = 0;
+    bool ok = ReadFile(file, true, &ref, &len) && len == sizeof(chip8_state) &&
+              Chip8DumpDiff(chip, (const chip8_state*)ref, stdout);
+    if (!ok) fprintf(stderr, "Failed to compare to state in %s\n", file);
+    free(ref);
+    return ok;
+}
+
+int main( int argc, char** argv )
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Path to chip8 program is missing!\n%s", help_text);
+        return -3;
+    }
+
+    chip8_hw chip8;
+    Chip8Init( &chip8 );
+    const char* prog_path = argv[1];
+    if (!Chip8LoadProgram(&chip8, prog_path))
+    {
+        fprintf(stderr, "Failed to load program %s\n%s", prog_path, help_text);
+        Chip8Free( &chip8 );
+        return -2;
+    }
+
+    run_config config = { 0, 0, NULL, NULL, NULL, 0 };
+    key_script script = { NULL, 0 };
+    input_log  replay;
+    InputLogInit(&replay, 0);
+    bool dump = false;
+    const char* binary_path = NULL;
+    const char* ref_path    = NULL;
+    const char* profile_path = NULL;
+    const char* folded_path  = NULL;
+    const char* map_path     = NULL;
+    unsigned sample_interval = DEFAULT_SAMPLE_INTERVAL;
+    const char* expected_hash = NULL;
+    for (int i = 2; i < argc; i++)
+    {
+        char* arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "-n") == 0 && has_value)
+        {
+            config.max_cycles = strtoull(argv[++i], NULL, 0);
+        }
+        else if (strcmp(arg, "-f") == 0 && has_value)
+        {
+            config.max_frames = strtoull(argv[++i], NULL, 0);
+        }
+        else if (strcmp(arg, "-k") == 0 && has_value && config.script == NULL)
+        {
+            const char* script_path = argv[++i];
+            if (!KeyScriptLoad(&script, script_path))
+            {
+                fprintf(stderr, "Failed to load key script %s\n", script_path);
+                Chip8Free( &chip8 );
+                return -2;
+            }
+            config.script = &script;
+        }
+        else if (strcmp(arg, "-r") == 0 && has_value && config.replay == NULL)
+        {
+            const char* log_path = argv[++i];
+            if (!InputLogLoad(&replay, log_path))
+            {
+                fprintf(stderr, "Failed to load input log %s\n", log_path);
+                KeyScriptFree( &script );
+                Chip8Free( &chip8 );
+                return -2;
+            }
+            config.replay = &replay;
+        }
+        else if (strcmp(arg, "-s") == 0 && has_value)
+        {
+            Chip8Seed( &chip8, strtoul(argv[++i], NULL, 0) );
+        }
+        else if (strcmp(arg, "-t") == 0)
+        {
+            chip8.engine = CHIP8_ENGINE_THREADED;
+        }
+        else if (strcmp(arg, "-j") == 0)
+        {
+            chip8.engine = CHIP8_ENGINE_JIT;
+        }
+        else if (strcmp(arg, "-d") == 0)
+        {
+            dump = true;
+        }
+        else if (strcmp(arg, "-D") == 0 && has_value)
+        {
+            binary_path = argv[++i];
+        }
+        else if (strcmp(arg, "-c") == 0 && has_value)
+        {
+            ref_path = argv[++i];
+        }
+        else if (strcmp(arg, "-p") == 0 && has_value)
+        {
+            profile_path = argv[++i];
+        }
+        else if (strcmp(arg, "-g") == 0 && has_value)
+        {
+            folded_path = argv[++i];
+        }
+        else if (strcmp(arg, "-i") == 0 && has_value && atoi(argv[i+1]) > 0)
+        {
+            sample_interval = atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "-m") == 0 && has_value)
+        {
+            map_path = argv[++i];
+        }
+        else if (strcmp(arg, "-H") == 0 && has_value)
+        {
+            expected_hash = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "Invalid arguments!\n%s", help_text);
+            KeyScriptFree( &script );
+            InputLogFree( &replay );
+            Chip8Free( &chip8 );
+            return -3;
+        }
+    }
+    if (config.replay && config.max_cycles == 0 && config.max_frames == 0)
+    {
+        config.max_cycles = replay.end_cycle;
+    }
+    if (config.max_cycles == 0 && config.max_frames == 0)
+    {
+        config.max_frames = DEFAULT_FRAMES;
+    }
+
+    guest_sampler sampler;
+    if (folded_path)
+    {
+        if (!SamplerInit(&sampler, sample_interval) || (map_path && !SamplerLoadLabels(&sampler, map_path)))
+        {
+            fprintf(stderr, "Failed to set up sampling%s%s\n", map_path ? " with label map " : "", map_path ? map_path : "");
+            SamplerFree(&sampler);
+            KeyScriptFree( &script );
+            InputLogFree( &replay );
+            Chip8Free( &chip8 );
+            return -2;
+        }
+        config.sampler = &sampler;
+    }
+
+    run_result result;
+    RunHeadless(&chip8, &config, &result);
+
+    if (dump) Chip8Dump( &chip8, stdout );
+    if (ref_path && !DumpDiff(&chip8, ref_path)) result.status = -1;
+    if (binary_path && !DumpBinary(&chip8, binary_path)) result.status = -1;
+    if (profile_path && !RunWriteProfile(&chip8, profile_path)) result.status = -1;
+    if (folded_path)
+    {
+        FILE* f = fopen(folded_path, "w");
+        bool ok = f && SamplerWriteFolded(&sampler, f);
+        if (f && fclose(f) != 0) ok = false;
+        if (!ok)
+        {
+            fprintf(stderr, "Failed to write call stacks to %s\n", folded_path);
+            result.status = -1;
+        }
+        SamplerFree(&sampler);
+    }
+    if (expected_hash && RunStateHash(&chip8) != strtoull(expected_hash, NULL, 16))
+    {
+        fprintf(stderr, "State hash %.16llx differs from expected %s\n", RunStateHash(&chip8), expected_hash);
+        result.status = -1;
+    }
+    RunPrintResult(stdout, &chip8, &result);
+
+    KeyScriptFree( &script );
+    InputLogFree( &replay );
+    Chip8Free( &chip8 );
+    return result.status == 0 ? 0 : -1;
+}
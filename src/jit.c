@@ -0,0 +1,668 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "chip8.h"
+#include "decoder.h"
+#include "opcodes.h"
+#include "threaded.h"
+#include "jit.h"
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+
+/*
+ *  Basic blocks end at jumps, calls, returns, skips and opcodes writing RAM.
+ *  Most opcodes are compiled inline, the rest become a call to the handler
+ *  in opcodes.c. Compiled code keeps chip in rbx, the instruction budget in
+ *  r12 and jit_state in r13. A block takes its length from the budget when
+ *  it is entered and returns to C if the budget runs out. Otherwise it jumps
+ *  straight to the next block through jit_state.entry, which points to the
+ *  exit stub for code that isn't compiled yet. chip->PC is stored before
+ *  each jump, so the exit stub always leaves a valid PC behind.
+ *
+ *  The code cache is writable only while a block is translated, W^X.
+ */
+
+#define JIT_CODE_CACHE_LEN  0x100000
+#define JIT_MAX_BLOCK_LEN   64  /* Instructions */
+#define JIT_MAX_INSTR_CODE  352 /* Bytes of machine code per instruction at most, Fx65 being the longest */
+#define JIT_MAX_BLOCKS      2048
+#define JIT_MAX_FALLBACKS   8192
+
+#define V_OFFSET(x)  (offsetof(chip8_hw, V) + (x))
+#define I_OFFSET     offsetof(chip8_hw, I)
+#define PC_OFFSET    offsetof(chip8_hw, PC)
+#define DT_OFFSET    offsetof(chip8_hw, DT)
+#define SP_OFFSET    offsetof(chip8_hw, stack_top)
+#define STACK_OFFSET offsetof(chip8_hw, stack)
+#define RAM_OFFSET   offsetof(chip8_hw, ram)
+
+#define ENTRY_OFFSET(pc)  (offsetof(jit_state, entry) + (pc) * sizeof(void*))
+#define IDLE_OFFSET       offsetof(jit_state, idle_jump)
+
+/* x86-64 registers used */
+#define REG_AL  0
+#define REG_CL  1
+#define REG_DL  2
+#define REG_RBX 3
+
+/* x86-64 condition codes */
+#define CC_B    0x2
+#define CC_AE   0x3
+#define CC_E    0x4
+#define CC_NE   0x5
+
+typedef struct jit_state jit_state;
+
+/* Stub entering compiled code at block with given budget, returns budget left */
+typedef unsigned (*jit_enter_fptr)(chip8_hw* chip, jit_state* jit, unsigned remaining, const void* block);
+
+typedef struct {
+    const void*    code;
+    unsigned short begin; /* Compiled RAM range [begin, end) */
+    unsigned short end;
+    unsigned       len;   /* Instruction count */
+} jit_block;
+
+struct jit_state {
+    unsigned char* code;  /* Code cache, stubs first and blocks after them */
+    unsigned       code_pos;
+    unsigned       stubs_len;
+    jit_enter_fptr enter;
+    unsigned char* exit;     /* Stub returning to C with chip->PC set */
+    unsigned char* dispatch; /* Stub jumping to entry[ chip->PC ] */
+
+    jit_block      block_pool[ JIT_MAX_BLOCKS ];
+    unsigned       block_count;
+    decoded_instr  fallback_pool[ JIT_MAX_FALLBACKS ]; /* Operands passed to handlers */
+    unsigned       fallback_count;
+
+    unsigned       idle_jump; /* 1nnn that may close an idle loop, set on exit. CHIP8_RAM_LEN if none */
+    jit_block*     blocks[ CHIP8_RAM_LEN ]; /* Block beginning from address */
+    const void*    entry[ CHIP8_RAM_LEN ];  /* Code of the block or the exit stub */
+    unsigned short cover[ CHIP8_RAM_LEN ];  /* Number of blocks covering address */
+};
+
+static void Emit8(unsigned char** p, unsigned value)
+{
+    *(*p)++ = value;
+}
+
+static void Emit16(unsigned char** p, unsigned value)
+{
+    unsigned short v = value;
+    memcpy(*p, &v, sizeof(v));
+    *p += sizeof(v);
+}
+
+static void Emit32(unsigned char** p, unsigned value)
+{
+    memcpy(*p, &value, sizeof(value));
+    *p += sizeof(value);
+}
+
+static void Emit64(unsigned char** p, const void* value)
+{
+    memcpy(*p, &value, sizeof(value));
+    *p += sizeof(value);
+}
+
+/* ModRM addressing [rbx + disp] */
+static void EmitChipAddr(unsigned char** p, unsigned reg, unsigned disp)
+{
+    if (disp < 0x80)
+    {
+        Emit8(p, 0x40 | (reg << 3) | REG_RBX);
+        Emit8(p, disp);
+    }
+    else
+    {
+        Emit8(p, 0x80 | (reg << 3) | REG_RBX);
+        Emit32(p, disp);
+    }
+}
+
+/* ModRM and SIB addressing [rbx + index * scale + disp32], scale as shift */
+static void EmitChipIndexAddr(unsigned char** p, unsigned reg, unsigned index, unsigned scale, unsigned disp)
+{
+    Emit8(p, 0x84 | (reg << 3));
+    Emit8(p, (scale << 6) | (index << 3) | REG_RBX);
+    Emit32(p, disp);
+}
+
+/* jmp rel32 to target */
+static void EmitJump(unsigned char** p, const unsigned char* target)
+{
+    Emit8(p, 0xe9);
+    Emit32(p, target - (*p + 4));
+}
+
+/* Short conditional jump, returns the offset to patch with PatchJump() */
+static unsigned char* EmitJumpIf(unsigned char** p, unsigned cc)
+{
+    Emit8(p, 0x70 | cc);
+    Emit8(p, 0);
+    return *p - 1;
+}
+
+static void PatchJump(unsigned char* rel8, const unsigned char* target)
+{
+    *rel8 = target - (rel8 + 1);
+}
+
+static void EmitStorePC(unsigned char** p, unsigned pc)
+{
+    Emit8(p, 0x66); Emit8(p, 0xc7);   // mov word [rbx + PC], imm16
+    EmitChipAddr(p, 0, PC_OFFSET);
+    Emit16(p, pc);
+}
+
+/* Continue at pc, in the next block if there is one */
+static void EmitChain(unsigned char** p, const jit_state* jit, unsigned pc)
+{
+    EmitStorePC(p, pc);
+    if (pc < CHIP8_RAM_LEN - 1)
+    {
+        Emit8(p, 0x41); Emit8(p, 0xff); Emit8(p, 0xa5); // jmp [r13 + entry[pc]]
+        Emit32(p, ENTRY_OFFSET(pc));
+    }
+    else
+    {
+        EmitJump(p, jit->exit);
+    }
+}
+
+static void EmitCall(unsigned char** p, const decoded_instr* in)
+{
+    Emit8(p, 0x48); Emit8(p, 0x89); Emit8(p, 0xdf); // mov rdi, rbx
+    Emit8(p, 0x48); Emit8(p, 0xbe); Emit64(p, in);  // mov rsi, in
+    Emit8(p, 0x48); Emit8(p, 0xb8); Emit64(p, (const void*)in->fun); // mov rax, in->fun
+    Emit8(p, 0xff); Emit8(p, 0xd0);                 // call rax
+}
+
+/* al = V[y]; <op> [V[x]], al */
+static void EmitRegOp(unsigned char** p, unsigned char op, const decoded_instr* in)
+{
+    Emit8(p, 0x8a);
+    EmitChipAddr(p, REG_AL, V_OFFSET(in->y));
+    Emit8(p, op);
+    EmitChipAddr(p, REG_AL, V_OFFSET(in->x));
+}
+
+/* V[f] = flag of condition cc */
+static void EmitSetFlag(unsigned char** p, unsigned cc)
+{
+    Emit8(p, 0x0f); Emit8(p, 0x90 | cc);   // setcc byte [V+f]
+    EmitChipAddr(p, 0, V_OFFSET(0xf));
+}
+
+/* movzx eax, byte [V+x] */
+static void EmitLoadV(unsigned char** p, unsigned x)
+{
+    Emit8(p, 0x0f); Emit8(p, 0xb6);
+    EmitChipAddr(p, REG_AL, V_OFFSET(x));
+}
+
+/*
+ *  Compile opcode without calling its handler, false if not supported.
+ *  VF is written in the same order as in opcodes.c, so 8xyn with x or y
+ *  being f gives the same result.
+ */
+static bool EmitInline(unsigned char** p, const decoded_instr* in)
+{
+    instr_fptr f = in->fun;
+    if (f == _6xnn)
+    {
+        Emit8(p, 0xc6);                   // mov byte [V+x], nn
+        EmitChipAddr(p, 0, V_OFFSET(in->x));
+        Emit8(p, in->nn);
+    }
+    else if (f == _7xnn)
+    {
+        Emit8(p, 0x80);                   // add byte [V+x], nn
+        EmitChipAddr(p, 0, V_OFFSET(in->x));
+        Emit8(p, in->nn);
+    }
+    else if (f == _8xy0) EmitRegOp(p, 0x88, in); // mov
+    else if (f == _8xy1) EmitRegOp(p, 0x08, in); // or
+    else if (f == _8xy2) EmitRegOp(p, 0x20, in); // and
+    else if (f == _8xy3) EmitRegOp(p, 0x30, in); // xor
+    else if (f == _8xy4)
+    {
+        EmitRegOp(p, 0x00, in);           // add
+        EmitSetFlag(p, CC_B);
+    }
+    else if (f == _8xy5)
+    {
+        Emit8(p, 0x8a);                   // mov cl, [V+y]
+        EmitChipAddr(p, REG_CL, V_OFFSET(in->y));
+        Emit8(p, 0x38);                   // cmp [V+x], cl
+        EmitChipAddr(p, REG_CL, V_OFFSET(in->x));
+        EmitSetFlag(p, CC_AE);
+        Emit8(p, 0x28);                   // sub [V+x], cl
+        EmitChipAddr(p, REG_CL, V_OFFSET(in->x));
+    }
+    else if (f == _8xy6)
+    {
+        EmitLoadV(p, in->x);
+        Emit8(p, 0x24); Emit8(p, 0x01);   // and al, 1
+        Emit8(p, 0x88);                   // mov [V+f], al
+        EmitChipAddr(p, REG_AL, V_OFFSET(0xf));
+        Emit8(p, 0xd0);                   // shr byte [V+x], 1
+        EmitChipAddr(p, 5, V_OFFSET(in->x));
+    }
+    else if (f == _8xy7)
+    {
+        Emit8(p, 0x8a);                   // mov cl, [V+y]
+        EmitChipAddr(p, REG_CL, V_OFFSET(in->y));
+        Emit8(p, 0x3a);                   // cmp cl, [V+x]
+        EmitChipAddr(p, REG_CL, V_OFFSET(in->x));
+        EmitSetFlag(p, CC_AE);
+        Emit8(p, 0x2a);                   // sub cl, [V+x]
+        EmitChipAddr(p, REG_CL, V_OFFSET(in->x));
+        Emit8(p, 0x88);                   // mov [V+x], cl
+        EmitChipAddr(p, REG_CL, V_OFFSET(in->x));
+    }
+    else if (f == _8xyE)
+    {
+        EmitLoadV(p, in->x);
+        Emit8(p, 0xc0); Emit8(p, 0xe8); Emit8(p, 7); // shr al, 7
+        Emit8(p, 0x88);                   // mov [V+f], al
+        EmitChipAddr(p, REG_AL, V_OFFSET(0xf));
+        Emit8(p, 0xd0);                   // shl byte [V+x], 1
+        EmitChipAddr(p, 4, V_OFFSET(in->x));
+    }
+    else if (f == _Annn)
+    {
+        Emit8(p, 0x66); Emit8(p, 0xc7);   // mov word [I], nnn
+        EmitChipAddr(p, 0, I_OFFSET);
+        Emit16(p, in->nnn);
+    }
+    else if (f == _Fx07)
+    {
+        Emit8(p, 0x8a);                   // mov al, [DT]
+        EmitChipAddr(p, REG_AL, DT_OFFSET);
+        Emit8(p, 0x88);                   // mov [V+x], al
+        EmitChipAddr(p, REG_AL, V_OFFSET(in->x));
+    }
+    else if (f == _Fx15)
+    {
+        Emit8(p, 0x8a);                   // mov al, [V+x]
+        EmitChipAddr(p, REG_AL, V_OFFSET(in->x));
+        Emit8(p, 0x88);                   // mov [DT], al
+        EmitChipAddr(p, REG_AL, DT_OFFSET);
+    }
+    else if (f == _Fx1E)
+    {
+        EmitLoadV(p, in->x);
+        Emit8(p, 0x66); Emit8(p, 0x01);   // add word [I], ax
+        EmitChipAddr(p, REG_AL, I_OFFSET);
+    }
+    else if (f == _Fx29)
+    {
+        EmitLoadV(p, in->x);
+        Emit8(p, 0x8d); Emit8(p, 0x04); Emit8(p, 0x80); // lea eax, [rax + rax*4]
+        Emit8(p, 0x05); Emit32(p, CHIP8_RAM_CHARSET_BEGIN); // add eax, charset
+        Emit8(p, 0x66); Emit8(p, 0x89);   // mov [I], ax
+        EmitChipAddr(p, REG_AL, I_OFFSET);
+    }
+    else if (f == _Fx65)
+    {
+        Emit8(p, 0x0f); Emit8(p, 0xb7);   // movzx eax, word [I]
+        EmitChipAddr(p, REG_AL, I_OFFSET);
+        for (unsigned i = 0; i <= in->x; i++)
+        {
+            Emit8(p, 0x8d); Emit8(p, 0x48); Emit8(p, i); // lea ecx, [rax + i]
+            Emit8(p, 0x81); Emit8(p, 0xe1); Emit32(p, CHIP8_ADDR_MASK); // and ecx, mask
+            Emit8(p, 0x0f); Emit8(p, 0xb6);              // movzx edx, byte [ram + rcx]
+            EmitChipIndexAddr(p, REG_DL, REG_CL, 0, RAM_OFFSET);
+            Emit8(p, 0x88);                              // mov [V+i], dl
+            EmitChipAddr(p, REG_DL, V_OFFSET(i));
+        }
+    }
+    else if (f == _invalid_op)
+    {
+        /* Nothing to do */
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+/* Skip over the next instruction if condition cc holds */
+static void EmitSkip(unsigned char** p, const jit_state* jit, unsigned cc, unsigned next)
+{
+    unsigned char* skip = EmitJumpIf(p, cc);
+    EmitChain(p, jit, next);
+    PatchJump(skip, *p);
+    EmitChain(p, jit, next + 2);
+}
+
+/*
+ *  Compile the opcode ending a block and jump to the next block.
+ *  A 1nnn goes back to C while it may close an idle loop, so that
+ *  Chip8SkipIdleLoop() sees it just like with the other engines.
+ */
+static void EmitBlockEnd(unsigned char** p, jit_state* jit, chip8_hw* chip, const decoded_instr* in, unsigned jump)
+{
+    instr_fptr f = in->fun;
+    unsigned next = jump + 2;
+    if (f == _1nnn)
+    {
+        Emit8(p, 0x48); Emit8(p, 0xb8);   // mov rax, &busy
+        Emit64(p, &(chip->icache[ jump ].busy));
+        Emit8(p, 0x80); Emit8(p, 0x38); Emit8(p, 0x00); // cmp byte [rax], 0
+        unsigned char* idle = EmitJumpIf(p, CC_E);
+        EmitChain(p, jit, in->nnn);
+        PatchJump(idle, *p);
+        EmitStorePC(p, in->nnn);
+        Emit8(p, 0x41); Emit8(p, 0xc7); Emit8(p, 0x85); // mov dword [r13 + idle_jump], jump
+        Emit32(p, IDLE_OFFSET);
+        Emit32(p, jump);
+        EmitJump(p, jit->exit);
+    }
+    else if (f == _2nnn)
+    {
+        Emit8(p, 0x0f); Emit8(p, 0xb6);   // movzx eax, byte [SP]
+        EmitChipAddr(p, REG_AL, SP_OFFSET);
+        Emit8(p, 0x66); Emit8(p, 0xc7);   // mov word [stack + rax*2], next
+        EmitChipIndexAddr(p, 0, REG_AL, 1, STACK_OFFSET);
+        Emit16(p, next);
+        Emit8(p, 0xfe);                   // inc byte [SP]
+        EmitChipAddr(p, 0, SP_OFFSET);
+        EmitChain(p, jit, in->nnn);
+    }
+    else if (f == _00EE)
+    {
+        Emit8(p, 0x8a);                   // mov al, [SP]
+        EmitChipAddr(p, REG_AL, SP_OFFSET);
+        Emit8(p, 0xfe); Emit8(p, 0xc8);   // dec al
+        Emit8(p, 0x88);                   // mov [SP], al
+        EmitChipAddr(p, REG_AL, SP_OFFSET);
+        Emit8(p, 0x0f); Emit8(p, 0xb6); Emit8(p, 0xc0); // movzx eax, al
+        Emit8(p, 0x0f); Emit8(p, 0xb7);   // movzx eax, word [stack + rax*2]
+        EmitChipIndexAddr(p, REG_AL, REG_AL, 1, STACK_OFFSET);
+        Emit8(p, 0x66); Emit8(p, 0x89);   // mov [PC], ax
+        EmitChipAddr(p, REG_AL, PC_OFFSET);
+        EmitJump(p, jit->dispatch);
+    }
+    else if (f == _Bnnn)
+    {
+        EmitLoadV(p, 0);
+        Emit8(p, 0x05); Emit32(p, in->nnn); // add eax, nnn
+        Emit8(p, 0x66); Emit8(p, 0x89);   // mov [PC], ax
+        EmitChipAddr(p, REG_AL, PC_OFFSET);
+        EmitJump(p, jit->dispatch);
+    }
+    else if (f == _3xnn || f == _4xnn)
+    {
+        Emit8(p, 0x80);                   // cmp byte [V+x], nn
+        EmitChipAddr(p, 7, V_OFFSET(in->x));
+        Emit8(p, in->nn);
+        EmitSkip(p, jit, f == _3xnn ? CC_E : CC_NE, next);
+    }
+    else if (f == _5xy0 || f == _9xy0)
+    {
+        Emit8(p, 0x8a);                   // mov al, [V+x]
+        EmitChipAddr(p, REG_AL, V_OFFSET(in->x));
+        Emit8(p, 0x3a);                   // cmp al, [V+y]
+        EmitChipAddr(p, REG_AL, V_OFFSET(in->y));
+        EmitSkip(p, jit, f == _5xy0 ? CC_E : CC_NE, next);
+    }
+    else
+    {
+        // Handler sets PC, Ex9E, ExA1 and Fx0A may skip or block
+        decoded_instr* fallback = &(jit->fallback_pool[ jit->fallback_count++ ]);
+        *fallback = *in;
+        EmitStorePC(p, next);
+        EmitCall(p, fallback);
+        if (f == _Fx33 || f == _Fx55) EmitChain(p, jit, next);
+        else                          EmitJump(p, jit->dispatch);
+    }
+}
+
+static bool IsBlockEnd(instr_fptr f)
+{
+    return f == _00EE || f == _1nnn || f == _2nnn || f == _Bnnn ||
+           f == _3xnn || f == _4xnn || f == _5xy0 || f == _9xy0 ||
+           f == _Ex9E || f == _ExA1 || f == _Fx0A ||
+           f == _Fx33 || f == _Fx55; // May overwrite rest of the block
+}
+
+static bool SetWritable(jit_state* jit, bool writable)
+{
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+    return mprotect(jit->code, JIT_CODE_CACHE_LEN, prot) == 0;
+}
+
+/* Stubs between C and compiled code, first in the cache and never flushed */
+static void EmitStubs(jit_state* jit)
+{
+    unsigned char* p = jit->code;
+
+    jit->enter = (jit_enter_fptr)p;
+    Emit8(&p, 0x53);                                // push rbx
+    Emit8(&p, 0x41); Emit8(&p, 0x54);               // push r12
+    Emit8(&p, 0x41); Emit8(&p, 0x55);               // push r13, stack is aligned for calls again
+    Emit8(&p, 0x48); Emit8(&p, 0x89); Emit8(&p, 0xfb); // mov rbx, rdi
+    Emit8(&p, 0x49); Emit8(&p, 0x89); Emit8(&p, 0xf5); // mov r13, rsi
+    Emit8(&p, 0x41); Emit8(&p, 0x89); Emit8(&p, 0xd4); // mov r12d, edx
+    Emit8(&p, 0xff); Emit8(&p, 0xe1);               // jmp rcx
+
+    jit->exit = p;
+    Emit8(&p, 0x44); Emit8(&p, 0x89); Emit8(&p, 0xe0); // mov eax, r12d
+    Emit8(&p, 0x41); Emit8(&p, 0x5d);               // pop r13
+    Emit8(&p, 0x41); Emit8(&p, 0x5c);               // pop r12
+    Emit8(&p, 0x5b);                                // pop rbx
+    Emit8(&p, 0xc3);                                // ret
+
+    jit->dispatch = p;
+    Emit8(&p, 0x0f); Emit8(&p, 0xb7);               // movzx eax, word [PC]
+    EmitChipAddr(&p, REG_AL, PC_OFFSET);
+    Emit8(&p, 0x3d); Emit32(&p, CHIP8_RAM_LEN - 1); // cmp eax, RAM_LEN - 1
+    Emit8(&p, 0x0f); Emit8(&p, 0x80 | CC_AE);       // jae exit
+    Emit32(&p, jit->exit - (p + 4));
+    Emit8(&p, 0x41); Emit8(&p, 0xff); Emit8(&p, 0xa4); Emit8(&p, 0xc5); // jmp [r13 + rax*8 + entry]
+    Emit32(&p, ENTRY_OFFSET(0));
+
+    jit->stubs_len = p - jit->code;
+}
+
+static void JitFlush(jit_state* jit)
+{
+    jit->code_pos       = jit->stubs_len;
+    jit->block_count    = 0;
+    jit->fallback_count = 0;
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->cover , 0, sizeof(jit->cover));
+    for (unsigned a = 0; a < CHIP8_RAM_LEN; a++)
+    {
+        jit->entry[ a ] = jit->exit;
+    }
+}
+
+static jit_state* JitCreate(chip8_hw* chip)
+{
+    jit_state* jit = (jit_state*)calloc(1, sizeof(jit_state));
+    if (!jit) return NULL;
+
+    jit->code = mmap(NULL, JIT_CODE_CACHE_LEN, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED)
+    {
+        free(jit);
+        return NULL;
+    }
+    EmitStubs(jit);
+    if (!SetWritable(jit, false))
+    {
+        munmap(jit->code, JIT_CODE_CACHE_LEN);
+        free(jit);
+        return NULL;
+    }
+    JitFlush(jit);
+
+    chip->jit = jit;
+    return jit;
+}
+
+static jit_block* Translate(chip8_hw* chip, jit_state* jit, unsigned pc)
+{
+    decoded_instr instrs[ JIT_MAX_BLOCK_LEN ];
+    unsigned count = 0;
+    unsigned addr  = pc;
+    while (count < JIT_MAX_BLOCK_LEN && addr < CHIP8_RAM_LEN - 1)
+    {
+        if (!DecodeOperands(chip->ram[addr] << 8 | chip->ram[addr+1], &instrs[count])) break;
+        addr += 2;
+        if (IsBlockEnd(instrs[count++].fun)) break;
+    }
+    if (count == 0) return NULL;
+
+    // Everything is compiled again after flushing
+    if (jit->block_count >= JIT_MAX_BLOCKS ||
+        jit->fallback_count + count > JIT_MAX_FALLBACKS ||
+        jit->code_pos + (count + 1) * JIT_MAX_INSTR_CODE > JIT_CODE_CACHE_LEN)
+    {
+        JitFlush(jit);
+    }
+    if (!SetWritable(jit, true)) return NULL;
+
+    unsigned char* begin = jit->code + jit->code_pos;
+    unsigned char* p = begin;
+    Emit8(&p, 0x41); Emit8(&p, 0x81); Emit8(&p, 0xec); Emit32(&p, count); // sub r12d, count
+    Emit8(&p, 0x0f); Emit8(&p, 0x80 | CC_B);        // jb refund
+    unsigned char* refund = p;
+    Emit32(&p, 0);
+
+    unsigned last = count - 1;
+    bool ended = IsBlockEnd(instrs[ last ].fun);
+    for (unsigned i = 0; i < (ended ? last : count); i++)
+    {
+        if (!EmitInline(&p, &instrs[i]))
+        {
+            decoded_instr* in = &(jit->fallback_pool[ jit->fallback_count++ ]);
+            *in = instrs[i];
+            EmitStorePC(&p, pc + (i+1) * 2);
+            EmitCall(&p, in);
+        }
+    }
+    if (ended) EmitBlockEnd(&p, jit, chip, &instrs[ last ], addr - 2);
+    else       EmitChain(&p, jit, addr);
+
+    // Budget too small, chip->PC is still the beginning of the block
+    Emit32(&refund, p - (refund + 4));
+    Emit8(&p, 0x41); Emit8(&p, 0x81); Emit8(&p, 0xc4); Emit32(&p, count); // add r12d, count
+    EmitJump(&p, jit->exit);
+
+    if (!SetWritable(jit, false)) return NULL;
+
+    jit_block* block = &(jit->block_pool[ jit->block_count++ ]);
+    block->code  = begin;
+    block->begin = pc;
+    block->end   = addr;
+    block->len   = count;
+
+    jit->code_pos += p - begin;
+    jit->blocks[ pc ] = block;
+    jit->entry[ pc ]  = begin;
+    for (unsigned a = pc; a < addr; a++)
+    {
+        jit->cover[ a ]++;
+    }
+    return block;
+}
+
+int Chip8ExecuteJit(chip8_hw* chip, unsigned op_count)
+{
+    jit_state* jit = chip->jit ? chip->jit : JitCreate(chip);
+    if (!jit) return Chip8ExecuteThreaded(chip, op_count);
+
+    unsigned remaining = op_count;
+    while (remaining > 0)
+    {
+        unsigned pc = chip->PC;
+        jit_block* block = NULL;
+        if (pc < CHIP8_RAM_LEN - 1)
+        {
+            block = jit->blocks[ pc ];
+            if (!block) block = Translate(chip, jit, pc);
+        }
+
+        // Errors and partial blocks are left to the threaded engine
+        if (!block || block->len > remaining)
+        {
+            return Chip8ExecuteThreaded(chip, remaining);
+        }
+
+        // Runs until the budget is out, code isn't compiled or an idle loop may be found
+        jit->idle_jump = CHIP8_RAM_LEN;
+        remaining = jit->enter(chip, jit, remaining, block->code);
+        if (jit->idle_jump < CHIP8_RAM_LEN)
+        {
+            remaining -= Chip8SkipIdleLoop(chip, jit->idle_jump, chip->PC, remaining);
+        }
+    }
+    return 0;
+}
+
+void JitInvalidate(chip8_hw* chip, unsigned begin, unsigned end)
+{
+    jit_state* jit = chip->jit;
+    if (!jit) return;
+    if (end > CHIP8_RAM_LEN) end = CHIP8_RAM_LEN;
+
+    bool covered = false;
+    for (unsigned a = begin; a < end && !covered; a++)
+    {
+        covered = jit->cover[ a ] > 0;
+    }
+    if (!covered) return;
+
+    // Blocks are limited in length, so only nearby blocks can overlap
+    unsigned first = (begin > JIT_MAX_BLOCK_LEN * 2) ? begin - JIT_MAX_BLOCK_LEN * 2 : 0;
+    for (unsigned a = first; a < end; a++)
+    {
+        jit_block* block = jit->blocks[ a ];
+        if (block && block->begin < end && block->end > begin)
+        {
+            for (unsigned c = block->begin; c < block->end; c++)
+            {
+                jit->cover[ c ]--;
+            }
+            jit->blocks[ a ] = NULL;
+            jit->entry[ a ]  = jit->exit;
+        }
+    }
+}
+
+void JitFree(chip8_hw* chip)
+{
+    jit_state* jit = chip->jit;
+    if (!jit) return;
+
+    munmap(jit->code, JIT_CODE_CACHE_LEN);
+    free(jit);
+    chip->jit = NULL;
+}
+
+#else // !__x86_64__
+
+int Chip8ExecuteJit(chip8_hw* chip, unsigned op_count)
+{
+    return Chip8ExecuteThreaded(chip, op_count);
+}
+
+void JitInvalidate(chip8_hw* chip, unsigned begin, unsigned end)
+{
+}
+
+void JitFree(chip8_hw* chip)
+{
+}
+
+#endif // __x86_64__
@@ -0,0 +1,18 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "chip8.h"
+
+/**
+ *  \brief  Execute op_count instructions by compiling basic blocks to x86-64
+ *  \note   On other architectures the threaded-code engine is used instead
+ */
+int  Chip8ExecuteJit(chip8_hw* chip, unsigned op_count);
+
+/* Drop compiled blocks overlapping RAM[begin...end-1] */
+void JitInvalidate(chip8_hw* chip, unsigned begin, unsigned end);
+
+/* Release code cache of chip */
+void JitFree(chip8_hw* chip);
+
+#endif // JIT_H
@@ -0,0 +1,424 @@
+#include <string.h>
+
+#include "chip8.h"
+#include "decoder.h"
+#include "lockstep.h"
+#include "opcodes.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+typedef uint32_t lane_mask; /* Bit per lane */
+
+/* State of one LockstepExecute() */
+typedef struct {
+    unsigned  op_count;
+    lane_mask failed;
+    lane_mask alone;  /* Lanes run on their own, their RAM is compared afterwards */
+    int       status;
+} lockstep_run;
+
+static void LaneToChip(const chip8_lockstep* ls, unsigned lane)
+{
+    chip8_hw* chip = ls->chips[ lane ];
+    for (unsigned r = 0; r < REGISTER_V_COUNT; r++)
+    {
+        chip->V[r] = ls->V[r][ lane ];
+    }
+    chip->I  = ls->I[ lane ];
+    chip->PC = ls->PC[ lane ];
+}
+
+static void ChipToLane(chip8_lockstep* ls, unsigned lane)
+{
+    const chip8_hw* chip = ls->chips[ lane ];
+    for (unsigned r = 0; r < REGISTER_V_COUNT; r++)
+    {
+        ls->V[r][ lane ] = chip->V[r];
+    }
+    ls->I[ lane ]  = chip->I;
+    ls->PC[ lane ] = chip->PC;
+}
+
+/* Mark RAM of lanes that differs from lane 0 */
+static void MarkDifferences(chip8_lockstep* ls, lane_mask lanes)
+{
+    const chip8_hw* ref = ls->chips[0];
+    for (unsigned lane = 1; lane < ls->count; lane++)
+    {
+        if (!((lanes >> lane) & 1)) continue;
+        const chip8_hw* chip = ls->chips[ lane ];
+        for (unsigned addr = 0; addr < CHIP8_RAM_LEN; addr += CHIP8_CACHE_LINE)
+        {
+            if (memcmp(chip->ram + addr, ref->ram + addr, CHIP8_CACHE_LINE) == 0) continue;
+            for (unsigned i = addr; i < addr + CHIP8_CACHE_LINE; i++)
+            {
+                ls->dirty[ i ] |= chip->ram[ i ] != ref->ram[ i ];
+            }
+        }
+    }
+}
+
+bool LockstepInit(chip8_lockstep* ls, chip8_hw* const* chips, unsigned count)
+{
+    if (count == 0 || count > LOCKSTEP_LANES) return false;
+
+    memset(ls, 0, sizeof(*ls));
+    memcpy(ls->chips, chips, count * sizeof(chip8_hw*));
+    ls->count = count;
+    MarkDifferences(ls, ~(lane_mask)0);
+
+    // Profiled builds count each instruction in the interpreter
+#if defined(__x86_64__) && !defined(CHIP8_PROFILE)
+    ls->avx2 = __builtin_cpu_supports("avx2");
+#endif
+    return true;
+}
+
+/* Instruction at pc of all lanes in mask, NULL if it differs between them or is invalid */
+static const decoded_instr* GroupInstr(chip8_lockstep* ls, lane_mask mask, unsigned pc)
+{
+    if (pc >= CHIP8_RAM_LEN - 1) return NULL;
+
+    chip8_hw* chip = ls->chips[ __builtin_ctz(mask) ];
+    if (ls->dirty[ pc ] || ls->dirty[ pc+1 ])
+    {
+        for (unsigned lane = 0; lane < ls->count; lane++)
+        {
+            if (!((mask >> lane) & 1)) continue;
+            if (memcmp(ls->chips[ lane ]->ram + pc, chip->ram + pc, 2) != 0) return NULL;
+        }
+    }
+
+    decoded_instr* in = &(chip->icache[ pc ]);
+    if (in->fun == NULL && !DecodeOperands(chip->ram[pc] << 8 | chip->ram[pc+1], in)) return NULL;
+    return in;
+}
+
+/* Run instruction of lane like the interpreter does */
+static void ScalarStep(chip8_lockstep* ls, unsigned lane, const decoded_instr* in, unsigned pc)
+{
+    chip8_hw* chip = ls->chips[ lane ];
+    LaneToChip(ls, lane);
+    chip->PC = pc + 2;
+    in->fun(chip, in);
+    ChipToLane(ls, lane);
+    ls->scalar_ops++;
+}
+
+/* Run rest of the budget of lane with Chip8Execute() on its own engine */
+static void RunAlone(chip8_lockstep* ls, lockstep_run* run, unsigned lane)
+{
+    chip8_hw* chip = ls->chips[ lane ];
+    unsigned rest = run->op_count - ls->executed[ lane ];
+    LaneToChip(ls, lane);
+    bool idle = chip->idle;
+    int ret = Chip8Execute(chip, rest);
+    chip->idle |= idle;
+    ChipToLane(ls, lane);
+
+    ls->executed[ lane ] = run->op_count;
+    ls->scalar_ops += rest;
+    run->alone |= 1u << lane;
+    if (ret != 0)
+    {
+        run->failed |= 1u << lane;
+        if (run->status == 0) run->status = ret;
+    }
+}
+
+/*
+ *  Lanes in mask ran the 1nnn at jump, done instructions after their
+ *  executed count. Fast-forward idle loops like Chip8Execute() does, with
+ *  the budget each lane has left. Returns true if any lane skipped.
+ */
+static bool SkipIdleLoops(chip8_lockstep* ls, const lockstep_run* run, lane_mask mask,
+                          unsigned jump, unsigned target, unsigned done)
+{
+    bool skipped = false;
+    for (unsigned lane = 0; lane < ls->count; lane++)
+    {
+        if (!((mask >> lane) & 1)) continue;
+        chip8_hw* chip = ls->chips[ lane ];
+        if (chip->icache[ jump ].busy) continue;
+
+        LaneToChip(ls, lane);
+        unsigned n = Chip8SkipIdleLoop(chip, jump, target, run->op_count - ls->executed[ lane ] - done);
+        ls->executed[ lane ] += n;
+        skipped = skipped || n > 0;
+    }
+    return skipped;
+}
+
+static bool IsVector(unsigned opcode)
+{
+    switch (opcode >> 12)
+    {
+        case 0x1: case 0x3: case 0x4: case 0x5:
+        case 0x6: case 0x7: case 0x9: case 0xa:
+            return true;
+        case 0x8:
+            return (opcode & 0xf) <= 0x7 || (opcode & 0xf) == 0xe;
+        case 0xf:
+            return (opcode & 0xff) == 0x1e;
+        default:
+            return false;
+    }
+}
+
+#if defined(__x86_64__)
+/* 0xff in bytes of lanes in mask */
+__attribute__((target("avx2")))
+static __m256i MaskToBytes(lane_mask mask)
+{
+    const __m256i spread = _mm256_setr_epi8(0,0,0,0,0,0,0,0, 1,1,1,1,1,1,1,1, 2,2,2,2,2,2,2,2, 3,3,3,3,3,3,3,3);
+    const __m256i bits   = _mm256_set1_epi64x(0x8040201008040201LL);
+    __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32(mask), spread);
+    return _mm256_cmpeq_epi8(_mm256_and_si256(bytes, bits), bits);
+}
+
+/* Bytes of lanes in sel from value, others from the register as is */
+__attribute__((target("avx2")))
+static void StoreV(uint8_t* reg, __m256i value, __m256i sel)
+{
+    __m256i old = _mm256_load_si256((const __m256i*)reg);
+    _mm256_store_si256((__m256i*)reg, _mm256_blendv_epi8(old, value, sel));
+}
+
+__attribute__((target("avx2")))
+static void StoreI(uint16_t* I, __m256i lo, __m256i hi, __m256i sel)
+{
+    __m256i sel_lo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(sel));
+    __m256i sel_hi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(sel, 1));
+    __m256i old_lo = _mm256_load_si256((const __m256i*)I);
+    __m256i old_hi = _mm256_load_si256((const __m256i*)(I + 16));
+    _mm256_store_si256((__m256i*)I,        _mm256_blendv_epi8(old_lo, lo, sel_lo));
+    _mm256_store_si256((__m256i*)(I + 16), _mm256_blendv_epi8(old_hi, hi, sel_hi));
+}
+
+/* Unsigned a >= b as 0 or 1 */
+__attribute__((target("avx2")))
+static __m256i GreaterEqual(__m256i a, __m256i b)
+{
+    return _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a), _mm256_set1_epi8(1));
+}
+
+/*
+ *  Run instruction on lanes in mask as the functions of opcodes.c do, VF
+ *  is written in the same order. Returns lanes that skip, for skips only.
+ */
+__attribute__((target("avx2")))
+static lane_mask VectorStep(chip8_lockstep* ls, const decoded_instr* in, lane_mask mask)
+{
+    const __m256i one = _mm256_set1_epi8(1);
+    __m256i sel = MaskToBytes(mask);
+    uint8_t* x  = ls->V[ in->x ];
+    uint8_t* vf = ls->V[ 0xf ];
+    __m256i vx = _mm256_load_si256((const __m256i*)x);
+    __m256i vy = _mm256_load_si256((const __m256i*)ls->V[ in->y ]);
+    __m256i nn = _mm256_set1_epi8(in->nn);
+
+    switch (in->opcode >> 12)
+    {
+        case 0x3: return  _mm256_movemask_epi8(_mm256_cmpeq_epi8(vx, nn)) & mask;
+        case 0x4: return ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(vx, nn)) & mask;
+        case 0x5: return  _mm256_movemask_epi8(_mm256_cmpeq_epi8(vx, vy)) & mask;
+        case 0x9: return ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(vx, vy)) & mask;
+        case 0x6: StoreV(x, nn, sel); break;
+        case 0x7: StoreV(x, _mm256_add_epi8(vx, nn), sel); break;
+        case 0xa:
+        {
+            __m256i nnn = _mm256_set1_epi16(in->nnn);
+            StoreI(ls->I, nnn, nnn, sel);
+            break;
+        }
+        case 0xf: // Fx1E
+        {
+            __m256i lo = _mm256_add_epi16(_mm256_load_si256((const __m256i*)ls->I),
+                                          _mm256_cvtepu8_epi16(_mm256_castsi256_si128(vx)));
+            __m256i hi = _mm256_add_epi16(_mm256_load_si256((const __m256i*)(ls->I + 16)),
+                                          _mm256_cvtepu8_epi16(_mm256_extracti128_si256(vx, 1)));
+            StoreI(ls->I, lo, hi, sel);
+            break;
+        }
+        case 0x8:
+            switch (in->opcode & 0xf)
+            {
+                case 0x0: StoreV(x, vy, sel); break;
+                case 0x1: StoreV(x, _mm256_or_si256(vx, vy), sel); break;
+                case 0x2: StoreV(x, _mm256_and_si256(vx, vy), sel); break;
+                case 0x3: StoreV(x, _mm256_xor_si256(vx, vy), sel); break;
+                case 0x4:
+                {
+                    __m256i sum = _mm256_add_epi8(vx, vy);
+                    StoreV(x, sum, sel);
+                    StoreV(vf, _mm256_xor_si256(GreaterEqual(sum, vy), one), sel);
+                    break;
+                }
+                case 0x5:
+                    StoreV(vf, GreaterEqual(vx, vy), sel);
+                    vx = _mm256_load_si256((const __m256i*)x);
+                    StoreV(x, _mm256_sub_epi8(vx, vy), sel);
+                    break;
+                case 0x6:
+                    StoreV(vf, _mm256_and_si256(vx, one), sel);
+                    vx = _mm256_load_si256((const __m256i*)x);
+                    StoreV(x, _mm256_and_si256(_mm256_srli_epi16(vx, 1), _mm256_set1_epi8(0x7f)), sel);
+                    break;
+                case 0x7:
+                    StoreV(vf, GreaterEqual(vy, vx), sel);
+                    vx = _mm256_load_si256((const __m256i*)x);
+                    StoreV(x, _mm256_sub_epi8(vy, vx), sel);
+                    break;
+                case 0xe:
+                    StoreV(vf, _mm256_and_si256(_mm256_srli_epi16(vx, 7), one), sel);
+                    vx = _mm256_load_si256((const __m256i*)x);
+                    StoreV(x, _mm256_add_epi8(vx, vx), sel);
+                    break;
+            }
+            break;
+    }
+    return 0;
+}
+#else
+static lane_mask VectorStep(chip8_lockstep* ls, const decoded_instr* in, lane_mask mask)
+{
+    return 0; // Never used, avx2 is false
+}
+#endif // __x86_64__
+
+/*
+ *  Run lanes in mask, all at pc, for at most steps instructions, until
+ *  their PCs differ or they reach wait_pc of other lanes. At a load, a
+ *  store or code that differs, the lanes run the rest of their budget on
+ *  their own.
+ */
+static void RunGroup(chip8_lockstep* ls, lockstep_run* run, lane_mask mask, unsigned pc, unsigned steps, unsigned wait_pc)
+{
+    unsigned done = 0;
+    bool together = true;
+    while (together && done < steps && pc != wait_pc)
+    {
+        // Loads and stores are cheaper chip by chip than lane by lane, and
+        // stores are where the code of the chips can start to differ
+        const decoded_instr* in = GroupInstr(ls, mask, pc);
+        if (!in || in->fun == _Fx33 || in->fun == _Fx55 || in->fun == _Fx65)
+        {
+            for (unsigned lane = 0; lane < ls->count; lane++)
+            {
+                if (!((mask >> lane) & 1)) continue;
+                ls->PC[ lane ] = pc;
+                ls->executed[ lane ] += done;
+                RunAlone(ls, run, lane);
+            }
+            return;
+        }
+
+        done++;
+        if (in->fun == _1nnn)
+        {
+            ls->vector_ops += __builtin_popcount(mask);
+            bool skipped = SkipIdleLoops(ls, run, mask, pc, in->nnn, done);
+            pc = in->nnn;
+            // Lanes that fast-forwarded have other budgets left
+            if (skipped) break;
+        }
+        else if (IsVector(in->opcode))
+        {
+            lane_mask skip = VectorStep(ls, in, mask);
+            ls->vector_ops += __builtin_popcount(mask);
+            if      (skip == 0)    pc = pc + 2;
+            else if (skip == mask) pc = pc + 4;
+            else
+            {
+                for (unsigned lane = 0; lane < ls->count; lane++)
+                {
+                    if ((mask >> lane) & 1) ls->PC[ lane ] = pc + 2 + ((skip >> lane) & 1) * 2;
+                }
+                together = false;
+            }
+        }
+        else
+        {
+            // Lane by lane, the group stays together if all end up at the same PC
+            for (unsigned lane = 0; lane < ls->count; lane++)
+            {
+                if ((mask >> lane) & 1) ScalarStep(ls, lane, in, pc);
+            }
+            pc = ls->PC[ __builtin_ctz(mask) ];
+            for (unsigned lane = 0; lane < ls->count && together; lane++)
+            {
+                if ((mask >> lane) & 1) together = ls->PC[ lane ] == pc;
+            }
+        }
+    }
+
+    for (unsigned lane = 0; lane < ls->count; lane++)
+    {
+        if (!((mask >> lane) & 1)) continue;
+        ls->executed[ lane ] += done;
+        if (together) ls->PC[ lane ] = pc;
+    }
+}
+
+int LockstepExecute(chip8_lockstep* ls, unsigned op_count)
+{
+    unsigned long long cycles[ LOCKSTEP_LANES ];
+    for (unsigned lane = 0; lane < ls->count; lane++)
+    {
+        cycles[ lane ] = ls->chips[ lane ]->cycles;
+        ChipToLane(ls, lane);
+        ls->executed[ lane ] = 0;
+        ls->chips[ lane ]->idle = false;
+    }
+
+    lockstep_run run = { op_count, 0, 0, 0 };
+    for (unsigned lane = 0; lane < ls->count; lane++)
+    {
+        // Logging is done by the interpreter
+        if (!ls->avx2 || ls->chips[ lane ]->log_level >= 2) RunAlone(ls, &run, lane);
+    }
+    for (;;)
+    {
+        // Lanes furthest behind go first and stop where the next ones wait,
+        // so that lanes split by a skip meet again
+        unsigned pc = CHIP8_RAM_LEN + 1;
+        unsigned wait_pc = CHIP8_RAM_LEN + 1;
+        lane_mask mask = 0;
+        for (unsigned lane = 0; lane < ls->count; lane++)
+        {
+            if (((run.failed >> lane) & 1) || ls->executed[ lane ] == op_count) continue;
+            if (ls->PC[ lane ] < pc)
+            {
+                wait_pc = pc;
+                pc = ls->PC[ lane ];
+                mask = 0;
+            }
+            else if (ls->PC[ lane ] > pc && ls->PC[ lane ] < wait_pc)
+            {
+                wait_pc = ls->PC[ lane ];
+            }
+            if (ls->PC[ lane ] == pc) mask |= 1u << lane;
+        }
+        if (mask == 0) break;
+
+        unsigned steps = op_count;
+        for (unsigned lane = 0; lane < ls->count; lane++)
+        {
+            if ((mask >> lane) & 1 && op_count - ls->executed[ lane ] < steps) steps = op_count - ls->executed[ lane ];
+        }
+        RunGroup(ls, &run, mask, pc, steps, wait_pc);
+    }
+
+    // Only lanes run on their own store, any lane may differ from lane 0 after it ran
+    if (run.alone) MarkDifferences(ls, (run.alone & 1) ? ~(lane_mask)0 : run.alone);
+
+    // Like Chip8Execute(), a chip that failed doesn't count its instructions
+    for (unsigned lane = 0; lane < ls->count; lane++)
+    {
+        LaneToChip(ls, lane);
+        ls->chips[ lane ]->cycles = cycles[ lane ] + (((run.failed >> lane) & 1) ? 0 : ls->executed[ lane ]);
+    }
+    return run.status;
+}
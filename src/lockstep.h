@@ -0,0 +1,49 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdint.h>
+#include "chip8.h"
+
+#define LOCKSTEP_LANES  32 /* Chips run together, one byte each in an AVX2 register */
+
+/*
+ *  Chips running the same program, e.g. with other seeds or inputs. While
+ *  the chips are at the same PC an instruction is run for all of them at
+ *  once, with AVX2 for ALU instructions, skips and jumps, other
+ *  instructions run chip by chip. At loads, stores and code that differs,
+ *  and without AVX2, the chips run the rest of their budget with
+ *  Chip8Execute().
+ *  V, I and PC of the chips are kept here in struct-of-arrays form while
+ *  running, everything else stays in the chips.
+ */
+typedef struct {
+    uint8_t   V[ REGISTER_V_COUNT ][ LOCKSTEP_LANES ] __attribute__((aligned(32)));
+    uint16_t  I[ LOCKSTEP_LANES ] __attribute__((aligned(32)));
+    uint16_t  PC[ LOCKSTEP_LANES ];
+    unsigned  executed[ LOCKSTEP_LANES ]; /* Instructions run in current LockstepExecute() */
+    uint8_t   dirty[ CHIP8_RAM_LEN ];     /* RAM that can differ between the chips */
+    chip8_hw* chips[ LOCKSTEP_LANES ];
+    unsigned  count;
+    bool      avx2;                       /* Vector path is used */
+
+    unsigned long long vector_ops;        /* Instructions run at once, counted per chip */
+    unsigned long long scalar_ops;        /* Instructions run chip by chip, or with Chip8Execute() */
+} chip8_lockstep;
+
+/**
+ *  \brief  Group count chips to be run in lockstep
+ *  \note   RAM of the chips is compared to find code that differs. Call
+ *          again if RAM is changed outside of LockstepExecute().
+ *  \return false if count is 0 or more than LOCKSTEP_LANES
+ */
+bool LockstepInit(chip8_lockstep* ls, chip8_hw* const* chips, unsigned count);
+
+/**
+ *  \brief  Run op_count instructions on each chip, same result as Chip8Execute() on each
+ *  \note   Idle loops are skipped as Chip8Execute() does, with the budget
+ *          each chip has left. A chip stops at an error, others go on.
+ *  \return 0 or error of the first chip that failed
+ */
+int LockstepExecute(chip8_lockstep* ls, unsigned op_count);
+
+#endif // LOCKSTEP_H
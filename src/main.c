@@ -1,18 +1,38 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "raylib_ui.h"
 #include "chip8.h"
+#include "scheduler.h"
+#include "emu_thread.h"
+#include "rewind.h"
+#include "runner.h"
 
 #define SECOND_IN_NSEC  1000000000
+#define REWIND_SECONDS  10
 
-unsigned GetStepsFromTimestamps(struct timespec* begin, struct timespec* end, unsigned freq);
-void PrintCounters(struct timespec* begin, struct timespec* end, unsigned ops, unsigned timer);
+void PrintCounters(struct timespec* begin, struct timespec* end, chip8_hw* chip, chip8_scheduler* sched);
+void RunEmuThread(chip8_hw* chip);
+unsigned RecordKeyBlocking();
+
+/* Inputs of the session when recording, key callbacks have no context */
+static input_log  record;
 
 const char* help_text = \
-"./emulator <path-to-chip8-bin> [-v[v]]\n"
+"./emulator <path-to-chip8-bin> [-v[v]] [-t|-j] [-T] [-l] [-a <samples>] [-r <seconds>] [-R <file>] [-s <seed>] [-p <file>]\n"
 "\t-v\tVerbose output\n"
-"\t-vv\tMore verbose output\n";
+"\t-vv\tMore verbose output\n"
+"\t-t\tUse threaded-code execution engine\n"
+"\t-j\tUse x86-64 JIT compiler execution engine\n"
+"\t-T\tRun emulation on a thread of its own\n"
+"\t-l\tRead keys on every key instruction instead of once per frame\n"
+"\t-a\tAudio buffer size in samples, smaller has less latency (default: 1024)\n"
+"\t-r\tSeconds of rewind history, hold backspace to rewind (default: 10, 0 disables)\n"
+"\t-R\tRecord inputs to file for replaying with chip8_headless -r, disables -T, -l and rewind\n"
+"\t-s\tSeed of random numbers (default: 1, current time when recording)\n"
+"\t-p\tWrite instruction counts to .json or .csv file on exit, needs a PROFILE=1 build\n";
 
 int main( int argc, char** argv )
 {
@@ -31,9 +51,15 @@ int main( int argc, char** argv )
         return -2;
     }
 
-    if (argc > 2)
+    bool emu_thread = false;
+    unsigned rewind_seconds = REWIND_SECONDS;
+    const char* record_path = NULL;
+    bool has_seed = false;
+    const char* profile_path = NULL;
+    unsigned seed = 1;
+    for (int i = 2; i < argc; i++)
     {
-        char* arg = argv[2];
+        char* arg = argv[i];
         if (arg[0] == '-' && arg[1] == 'v')
         {
             chip8.log_level = 1;
@@ -42,6 +68,43 @@ int main( int argc, char** argv )
                 chip8.log_level = 2;
             }
         }
+        else if (strcmp(arg, "-t") == 0)
+        {
+            chip8.engine = CHIP8_ENGINE_THREADED;
+        }
+        else if (strcmp(arg, "-j") == 0)
+        {
+            chip8.engine = CHIP8_ENGINE_JIT;
+        }
+        else if (strcmp(arg, "-T") == 0)
+        {
+            emu_thread = true;
+        }
+        else if (strcmp(arg, "-l") == 0)
+        {
+            chip8.is_key_down = RlIsKeyDown;
+        }
+        else if (strcmp(arg, "-a") == 0 && i + 1 < argc && atoi(argv[i+1]) > 0)
+        {
+            RlSetAudioBufferSize( atoi(argv[++i]) );
+        }
+        else if (strcmp(arg, "-r") == 0 && i + 1 < argc && atoi(argv[i+1]) >= 0)
+        {
+            rewind_seconds = atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "-R") == 0 && i + 1 < argc)
+        {
+            record_path = argv[++i];
+        }
+        else if (strcmp(arg, "-s") == 0 && i + 1 < argc)
+        {
+            seed = strtoul(argv[++i], NULL, 0);
+            has_seed = true;
+        }
+        else if (strcmp(arg, "-p") == 0 && i + 1 < argc)
+        {
+            profile_path = argv[++i];
+        }
         else
         {
             printf("Invalid arguments!\n%s", help_text);
@@ -51,107 +114,143 @@ int main( int argc, char** argv )
     }
 
     chip8.get_key_blocking = RlGetKeyBlocking;
-    chip8.is_key_down      = RlIsKeyDown;
     chip8.draw_screen      = RlDrawScreen;
+    chip8.play_sound       = RlPlaySound;
+
+    // Replay latches keys by instruction count and seeds the chip the same way
+    if (record_path && !has_seed) seed = time(NULL);
+    Chip8Seed(&chip8, seed);
+    if (record_path)
+    {
+        InputLogInit(&record, seed);
+        chip8.is_key_down      = NULL;
+        chip8.get_key_blocking = RecordKeyBlocking;
+        emu_thread     = false;
+        rewind_seconds = 0;
+    }
 
     RlInitializeWindow(10, "Chip8 - Emulator");
 
-    const unsigned cpu_freq = CHIP8_CPU_FREQ;
+    if (emu_thread)
+    {
+        RunEmuThread(&chip8);
+        if (profile_path) RunWriteProfile(&chip8, profile_path);
+        RlClose();
+        Chip8Free( &chip8 );
+        return 0;
+    }
+
+    chip8_scheduler sched;
+    SchedulerInit(&sched, CHIP8_CPU_FREQ, CHIP8_DT_FREQ);
+
+    static rewind_buffer history;
+    if (!RewindInit(&history, rewind_seconds * CHIP8_DT_FREQ))
+    {
+        fprintf(stderr, "Failed to allocate rewind buffer\n");
+        rewind_seconds = 0;
+    }
+
     struct timespec ts_begin = {0};
-    struct timespec ts[2] = { 0 };
     clock_gettime( CLOCK_MONOTONIC, &ts_begin );
-    ts[0] = ts_begin;
-    ts[1] = ts_begin;
-
-    unsigned timer_count = 0,
-             ops_count   = 0;
 
+    // Poll input, run emulation and present the result once per frame
     while(!RlShouldQuit())
     {
-        RlDrawScreen(&chip8);
+        if (record_path) InputLogLatch(&record, &chip8, RlGetKeys());
+        else             chip8.keys = RlGetKeys();
 
-        struct timespec ts_now = {0};
-        clock_gettime( CLOCK_MONOTONIC, &ts_now );
-
-        unsigned pending_ops = GetStepsFromTimestamps(&(ts[0]), &ts_now, cpu_freq);
-        ops_count += pending_ops;
-        for (; pending_ops > 0; pending_ops--)
+        // Step back one tick per frame, then continue from there on time
+        if (rewind_seconds > 0 && RlIsRewindDown())
         {
-            // Process opcodes
-            Chip8Execute(&chip8, pending_ops);
-            if (chip8.was_blocking) break;
+            RewindStep(&history, &chip8);
+            SchedulerResync(&sched);
+            RlDrawScreen(&chip8);
+            continue;
         }
 
-        unsigned timer_steps = GetStepsFromTimestamps(&(ts[1]), &ts_now, CHIP8_DT_FREQ);
-        timer_count += timer_steps;
-        if (timer_steps > 0)
+        // Idle loops run ahead to the next tick, frame pacing sleeps until then
+        int ticks = SchedulerUpdate(&sched, &chip8);
+        if (ticks > 0 && rewind_seconds > 0) RewindCapture(&history, &chip8);
+        if (ticks > 0 && chip8.log_level >= 1)
         {
-            // Decrement delay and sound timers
-            Chip8ProcessTimers(&chip8, timer_steps);
-            if (chip8.log_level >= 1)
-            {
-                PrintCounters(&ts_begin, &ts_now, ops_count, timer_count);
-            }
+            struct timespec ts_now = {0};
+            clock_gettime( CLOCK_MONOTONIC, &ts_now );
+            PrintCounters(&ts_begin, &ts_now, &chip8, &sched);
         }
 
-        if (chip8.was_blocking)
-        {
-            chip8.was_blocking = false;
-            clock_gettime( CLOCK_MONOTONIC, &(ts[0]) );
-        }
+        RlDrawScreen(&chip8);
     }
     Chip8Dump( &chip8, stdout );
 
+    RewindFree(&history);
+    if (record_path)
+    {
+        record.end_cycle = chip8.cycles;
+        if (!InputLogSave(&record, record_path)) fprintf(stderr, "Failed to save input log %s\n", record_path);
+        InputLogFree(&record);
+    }
+    if (profile_path) RunWriteProfile(&chip8, profile_path);
     RlClose();
     Chip8Free( &chip8 );
 
     return 0;
 }
 
-unsigned GetStepsFromTimestamps(struct timespec* begin, struct timespec* end, unsigned freq)
+void PrintCounters(struct timespec* begin, struct timespec* end, chip8_hw* chip, chip8_scheduler* sched)
 {
-    unsigned step = 0;
-    long step_nsec = SECOND_IN_NSEC / freq;
-
     time_t d_sec  = end->tv_sec  - begin->tv_sec;
     long   d_nsec = end->tv_nsec - begin->tv_nsec;
+
     if (d_nsec < 0)
     {
         d_sec--;
-        begin->tv_sec++;
         d_nsec = SECOND_IN_NSEC + d_nsec;
     }
 
-    while (1)
-    {
-        while (d_nsec > step_nsec)
-        {
-            d_nsec -= step_nsec;
-            step++;
-        }
-        if (d_sec == 0)
-        {
-            begin->tv_nsec = end->tv_nsec - d_nsec;
-            return step;
-        }
+    float sec = d_sec + (float)d_nsec/SECOND_IN_NSEC;
+    unsigned long long ops   = chip->cycles,
+                       timer = sched->ticks;
+    float idle = ops ? 100.0f * chip->idle_cycles / ops : 0.0f;
+    printf("OPS/s: %f(%llu), Timer/s: %f(%llu), Idle: %.1f%%, Dropped: %llu, sec: %f\n",
+           (float)ops/sec, ops, (float)timer/sec, timer, idle, sched->dropped, sec);
 
-        d_sec--;
-        begin->tv_sec++;
-        d_nsec += SECOND_IN_NSEC;
-    }
+    rl_stats stats;
+    RlGetStats(&stats);
+    printf("Frame: %.2f ms (max %.2f ms), input latency: %.2f ms (max %.2f ms, %llu inputs)\n",
+           stats.frame_time_avg * 1000, stats.frame_time_max * 1000,
+           stats.latency_avg * 1000, stats.latency_max * 1000, stats.inputs);
+    printf("Audio callbacks: %llu, underruns: %llu, tone latency: %.2f ms (max %.2f ms, %llu changes)\n",
+           stats.audio_callbacks, stats.audio_underruns,
+           stats.tone_latency_avg * 1000, stats.tone_latency_max * 1000, stats.tone_changes);
 }
 
-void PrintCounters(struct timespec* begin, struct timespec* end, unsigned ops, unsigned timer)
+/* UI only passes keys and shows the newest frame, emulation never waits for it */
+void RunEmuThread(chip8_hw* chip)
 {
-    time_t d_sec  = end->tv_sec  - begin->tv_sec;
-    long   d_nsec = end->tv_nsec - begin->tv_nsec;
+    if (!EmuThreadStart(chip)) return;
 
-    if (d_nsec < 0)
+    while(!RlShouldQuit())
     {
-        d_sec--;
-        d_nsec = SECOND_IN_NSEC + d_nsec;
+        EmuThreadSetKeys(RlGetKeys());
+
+        const emu_frame* frame = EmuThreadGetFrame();
+        RlDrawFrame(frame->gfx);
     }
+    EmuThreadStop();
 
-    float sec = d_sec + (float)d_nsec/SECOND_IN_NSEC;
-    printf("OPS/s: %f(%u), Timer/s: %f(%u), sec: %f\n", (float)ops/sec, ops, (float)timer/sec, timer, sec);
+    Chip8Dump( chip, stdout );
+    if (chip->log_level >= 1)
+    {
+        rl_stats stats;
+        RlGetStats(&stats);
+        printf("Cycles: %llu (idle %llu), frame: %.2f ms (max %.2f ms)\n",
+               chip->cycles, chip->idle_cycles, stats.frame_time_avg * 1000, stats.frame_time_max * 1000);
+    }
+}
+
+unsigned RecordKeyBlocking()
+{
+    unsigned key = RlGetKeyBlocking();
+    InputLogAdd(&record, 0, key, true);
+    return key;
 }
@@ -3,12 +3,22 @@
 #include <string.h>
 #include "opcodes.h"
 #include "chip8.h"
+#include "decoder.h"
+#include "lockstep.h"
+#include "pool.h"
+#include "scheduler.h"
+#include "rewind.h"
+#include "runner.h"
+#include "sampler.h"
+#include "token.h"
 
 #define DEBUG_PRINT( fmt, ... )  fprintf(stderr, "\t\t%s(...): " fmt, __FUNCTION__,__VA_ARGS__)
 //#define DEBUG_PRINT( fmt, ... )
 
 /* Load values to V registers to be tested */
 static void SetVnToValues(chip8_hw* chip, const unsigned char* values);
+/* Decode opcode to be passed to opcode functions */
+static const decoded_instr* Op(unsigned opcode);
 
 static int test_00E0(chip8_hw*);
 static int test_call_stack(chip8_hw*);
@@ -36,6 +46,7 @@ static int test_Cxnn(chip8_hw*);
 static int test_Dxyn(chip8_hw*);
 static int test_Ex9E(chip8_hw*);
 static int test_ExA1(chip8_hw*);
+static int test_keys_latched(chip8_hw*);
 static int test_Fx07(chip8_hw*);
 static int test_Fx0A(chip8_hw*);
 static int test_Fx15(chip8_hw*);
@@ -44,6 +55,24 @@ static int test_Fx1E(chip8_hw*);
 static int test_Fx29(chip8_hw*);
 static int test_Fx33(chip8_hw*);
 static int test_Fx55_Fx65(chip8_hw*);
+static int test_decode_table(chip8_hw*);
+static int test_icache(chip8_hw*);
+static int test_engine_threaded(chip8_hw*);
+static int test_engine_jit(chip8_hw*);
+static int test_icache_jit(chip8_hw*);
+static int test_idle_loop(chip8_hw*);
+static int test_idle_loop_threaded(chip8_hw*);
+static int test_idle_loop_jit(chip8_hw*);
+static int test_scheduler(chip8_hw*);
+static int test_save_state(chip8_hw*);
+static int test_rewind(chip8_hw*);
+static int test_replay(chip8_hw*);
+static int test_dump(chip8_hw*);
+static int test_profile(chip8_hw*);
+static int test_sampler(chip8_hw*);
+static int test_batch(chip8_hw*);
+static int test_lockstep(chip8_hw*);
+static int test_ram_wrap(chip8_hw*);
 
 typedef int (*test_fptr)(chip8_hw*);
 typedef struct {
@@ -79,6 +108,7 @@ const test_entry tests[] =
     { test_Dxyn, "Opcode Dxyn" },
     { test_Ex9E, "Opcode Ex9E" },
     { test_ExA1, "Opcode ExA1" },
+    { test_keys_latched, "Opcodes Ex9E & ExA1 with latched keys" },
     { test_Fx07, "Opcode Fx07" },
     { test_Fx0A, "Opcode Fx0A" },
     { test_Fx15, "Opcode Fx15" },
@@ -87,6 +117,24 @@ const test_entry tests[] =
     { test_Fx29, "Opcode Fx29" },
     { test_Fx33, "Opcode Fx33" },
     { test_Fx55_Fx65, "Opcode Fx55 & Fx65" },
+    { test_decode_table, "Decode table" },
+    { test_icache, "Self-modifying code" },
+    { test_engine_threaded, "Threaded engine" },
+    { test_engine_jit, "JIT engine" },
+    { test_icache_jit, "Self-modifying code with JIT" },
+    { test_idle_loop, "Idle loop" },
+    { test_idle_loop_threaded, "Idle loop with threaded engine" },
+    { test_idle_loop_jit, "Idle loop with JIT" },
+    { test_scheduler, "Scheduler" },
+    { test_save_state, "Save state" },
+    { test_rewind, "Rewind" },
+    { test_replay, "Input recording & replay" },
+    { test_dump, "Text, binary & diff dumps" },
+    { test_profile, "Instruction profile" },
+    { test_sampler, "Call stack sampling" },
+    { test_batch, "Parallel headless runs & time budget" },
+    { test_lockstep, "Lockstep execution of many chips" },
+    { test_ram_wrap, "Loads & stores wrapping around end of RAM" },
 
     { NULL, NULL },
 };
@@ -155,12 +203,19 @@ void SetVnToValues(chip8_hw* chip, const unsigned char* values)
     }
 }
 
+const decoded_instr* Op(unsigned opcode)
+{
+    static decoded_instr instr;
+    DecodeOperands(opcode, &instr);
+    return &instr;
+}
+
 int test_00E0(chip8_hw* chip)
 {
     memset( chip->gfx, 0xff, CHIP8_GFX_LEN );
 
-    _00E0(chip, 0x00e0);
-    for (unsigned i = 0; i < CHIP8_GFX_LEN; ++i)
+    _00E0(chip, Op(0x00e0));
+    for (unsigned i = 0; i < CHIP8_GFX_H; ++i)
     {
         if (chip->gfx[i] != 0)
         {
@@ -177,7 +232,7 @@ int test_call_stack(chip8_hw* chip)
     for (unsigned i = 0; i < CHIP8_STACK_LEN; ++i)
     {
         calls[i] = (rand() & 0xfff) % CHIP8_RAM_LEN;
-        _2nnn(chip,  0x2000 | calls[i]);
+        _2nnn(chip, Op(0x2000 | calls[i]));
         if (chip->PC != calls[i])
         {
             return -1;
@@ -192,7 +247,7 @@ int test_call_stack(chip8_hw* chip)
             return -2;
         }
 
-        _00EE(chip, 0x00ee);
+        _00EE(chip, Op(0x00ee));
     }
     if (chip->PC != 0) return -3;
 
@@ -204,7 +259,7 @@ int test_1nnn(chip8_hw* chip)
     for (unsigned i = 0; i < 10; ++i)
     {
         unsigned addr = (rand() & 0xfff) % CHIP8_RAM_LEN;
-        _1nnn(chip, 0x1000 | addr);
+        _1nnn(chip, Op(0x1000 | addr));
         if (chip->PC != addr)
         {
             return -1;
@@ -224,7 +279,7 @@ int test_3xnn(chip8_hw* chip)
         {
             unsigned opcode = 0x3000 | values_1[i];
             opcode |= (j << 8);
-            _3xnn(chip, opcode);
+            _3xnn(chip, Op(opcode));
         }
 
         if (chip->PC != expected)
@@ -240,7 +295,7 @@ int test_3xnn(chip8_hw* chip)
     {
         unsigned opcode = 0x3000 | 0x11;
         opcode |= (j << 8);
-        _3xnn(chip, opcode);
+        _3xnn(chip, Op(opcode));
     }
     if (chip->PC != 0)
     {
@@ -262,7 +317,7 @@ int test_4xnn(chip8_hw* chip)
         {
             unsigned opcode = 0x4000 | values_1[i];
             opcode |= (j << 8);
-            _4xnn(chip, opcode);
+            _4xnn(chip, Op(opcode));
         }
 
         if (chip->PC != expected)
@@ -278,7 +333,7 @@ int test_4xnn(chip8_hw* chip)
     {
         unsigned opcode = 0x4000 | 0x11;
         opcode |= (j << 8);
-        _4xnn(chip, opcode);
+        _4xnn(chip, Op(opcode));
     }
     if (chip->PC != REGISTER_V_COUNT * 2)
     {
@@ -301,7 +356,7 @@ int test_5xy0(chip8_hw* chip)
             unsigned opcode = 0x5000;
             opcode |= (j << 8);
             opcode |= (i << 4);
-            _5xy0(chip, opcode);
+            _5xy0(chip, Op(opcode));
         }
 
         if (chip->PC != expected)
@@ -319,7 +374,7 @@ int test_6xnn(chip8_hw* chip)
     for (unsigned i=0; i < REGISTER_V_COUNT; ++i)
     {
         unsigned opcode = 0x6000 | i << 8 | values_1[ i ];
-        _6xnn(chip, opcode);
+        _6xnn(chip, Op(opcode));
         if (chip->V[ i ] != values_1[ i ])
         {
             DEBUG_PRINT("Expect V[ %u ], %u == %u\n", i, chip->V[i], values_1[ i ]);
@@ -339,7 +394,7 @@ int test_7xnn(chip8_hw* chip)
         unsigned opcode = 0x7000 | i << 8 | value;
         for (unsigned j=0; j < 5; ++j)
         {
-            _7xnn(chip, opcode);
+            _7xnn(chip, Op(opcode));
             sum += value;
             if (chip->V[ i ] != (sum & 0xff))
             {
@@ -374,7 +429,7 @@ static int cmp_8xy0(chip8_hw* chip, unsigned x, unsigned y)
 {
     unsigned expected = chip->V[ y ];
     unsigned opcode = 0x8000 | x << 8 | y << 4;
-    _8xy0(chip, opcode);
+    _8xy0(chip, Op(opcode));
     if (chip->V[ x ] != expected)
     {
         DEBUG_PRINT("Expect %u != %u\n", chip->V[ x ], expected);
@@ -387,7 +442,7 @@ static int cmp_8xy1(chip8_hw* chip, unsigned x, unsigned y)
 {
     unsigned expected = chip->V[ x ] | chip->V[ y ] ;
     unsigned opcode = 0x8001 | x << 8 | y << 4;
-    _8xy1(chip, opcode);
+    _8xy1(chip, Op(opcode));
     if (chip->V[ x ] != expected)
     {
         DEBUG_PRINT("Expect %u != %u\n", chip->V[ x ], expected);
@@ -400,7 +455,7 @@ static int cmp_8xy2(chip8_hw* chip, unsigned x, unsigned y)
 {
     unsigned expected = chip->V[ x ] & chip->V[ y ] ;
     unsigned opcode = 0x8002 | x << 8 | y << 4;
-    _8xy2(chip, opcode);
+    _8xy2(chip, Op(opcode));
     if (chip->V[ x ] != expected)
     {
         DEBUG_PRINT("Expect %u != %u\n", chip->V[ x ], expected);
@@ -413,7 +468,7 @@ static int cmp_8xy3(chip8_hw* chip, unsigned x, unsigned y)
 {
     unsigned expected = chip->V[ x ] ^ chip->V[ y ] ;
     unsigned opcode = 0x8003 | x << 8 | y << 4;
-    _8xy3(chip, opcode);
+    _8xy3(chip, Op(opcode));
     if (chip->V[ x ] != expected)
     {
         DEBUG_PRINT("Expect %u != %u\n", chip->V[ x ], expected);
@@ -428,7 +483,7 @@ static int cmp_8xy4(chip8_hw* chip, unsigned x, unsigned y)
 
     unsigned expected = chip->V[ x ] + chip->V[ y ];
     unsigned opcode = 0x8004 | x << 8 | y << 4;
-    _8xy4(chip, opcode);
+    _8xy4(chip, Op(opcode));
     if (chip->V[ x ] != (expected & 0xff))
     {
         DEBUG_PRINT("Expect %u != %u(%u)\n", chip->V[ x ], expected & 0xff, expected);
@@ -459,7 +514,7 @@ static int cmp_8xy5(chip8_hw* chip, unsigned x, unsigned y)
 
     unsigned expected = chip->V[ x ] - chip->V[ y ];
     unsigned opcode = 0x8005 | x << 8 | y << 4;
-    _8xy5(chip, opcode);
+    _8xy5(chip, Op(opcode));
     if (chip->V[ x ] != (expected & 0xff))
     {
         DEBUG_PRINT("Expect %u != %u(%u) opcode: 0x%.2x\n", chip->V[ x ], expected & 0xff, expected, opcode);
@@ -491,7 +546,7 @@ static int cmp_8xy6(chip8_hw* chip, unsigned x, unsigned y)
     unsigned f = chip->V[ x ] & 1;
     unsigned expected = chip->V[ x ] >> 1;
     unsigned opcode = 0x8006 | x << 8 | y << 4;
-    _8xy6(chip, opcode);
+    _8xy6(chip, Op(opcode));
     if (chip->V[ x ] != (expected & 0xff))
     {
         DEBUG_PRINT("Expect %u != %u(%u)\n", chip->V[ x ], expected & 0xff, expected);
@@ -512,7 +567,7 @@ static int cmp_8xy7(chip8_hw* chip, unsigned x, unsigned y)
 
     unsigned expected = chip->V[ y ] - chip->V[ x ];
     unsigned opcode = 0x8007 | x << 8 | y << 4;
-    _8xy7(chip, opcode);
+    _8xy7(chip, Op(opcode));
     if (chip->V[ x ] != (expected & 0xff))
     {
         DEBUG_PRINT("Expect %u != %u(%u) opcode: 0x%.2x\n", chip->V[ x ], expected & 0xff, expected, opcode);
@@ -544,7 +599,7 @@ static int cmp_8xyE(chip8_hw* chip, unsigned x, unsigned y)
     unsigned f = (chip->V[ x ] >> 7) & 1;
     unsigned expected = chip->V[ x ] << 1;
     unsigned opcode = 0x800e | x << 8 | y << 4;
-    _8xyE(chip, opcode);
+    _8xyE(chip, Op(opcode));
     if (chip->V[ x ] != (expected & 0xff))
     {
         DEBUG_PRINT("Expect %u != %u(%u)\n", chip->V[ x ], expected & 0xff, expected);
@@ -568,7 +623,7 @@ static int cmp_9xy0(chip8_hw* chip, unsigned x, unsigned y)
     }
 
     unsigned opcode = 0x900e | x << 8 | y << 4;
-    _9xy0(chip, opcode);
+    _9xy0(chip, Op(opcode));
     if (chip->PC != expected)
     {
         DEBUG_PRINT("Expect PC: %u != %u, x:%u, y:%u\n", chip->PC, expected, x, y);
@@ -635,7 +690,7 @@ int test_Annn(chip8_hw* chip)
     for (unsigned int i = 0; i < 0xfff; ++i)
     {
         unsigned opcode = 0xa000 | i;
-        _Annn(chip, opcode);
+        _Annn(chip, Op(opcode));
         if (chip->I != i)
         {
             DEBUG_PRINT("Expect I: %u != %u\n", chip->I, i);
@@ -653,7 +708,7 @@ int test_Bnnn(chip8_hw* chip)
         unsigned value  = rand() & 0xfff;
         unsigned opcode = 0xb000 | value;
         unsigned expected = value + chip->V[ 0 ];
-        _Bnnn(chip, opcode);
+        _Bnnn(chip, Op(opcode));
         if (chip->PC != expected)
         {
             DEBUG_PRINT("Expect PC: %u != %u, opcode: 0x%.4x\n", chip->PC, expected, opcode);
@@ -671,11 +726,11 @@ int test_Cxnn(chip8_hw* chip)
     {
         unsigned tries = 0;
         unsigned opcode = 0xc000 | (v << 8) | mask[ m ];
-        _Cxnn(chip, opcode);
+        _Cxnn(chip, Op(opcode));
         unsigned last = chip->V[ v ];
         for (; tries < 10; ++tries)
         {
-            _Cxnn(chip, opcode);
+            _Cxnn(chip, Op(opcode));
             if ((chip->V[ v ] & ~mask[ m ]) == 0)
             {
                 if (last != chip->V[ v ])
@@ -695,6 +750,26 @@ int test_Cxnn(chip8_hw* chip)
             return -2;
         }
     }
+
+    // Sequence only depends on the seed of the chip
+    chip8_hw other;
+    Chip8Init( &other );
+    Chip8Seed( chip, 42 );
+    Chip8Seed( &other, 42 );
+    _Cxnn( chip, Op(0xc0ff) );
+    rand();
+    _Cxnn( &other, Op(0xc0ff) );
+    bool same = chip->V[0] == other.V[0];
+    Chip8Seed( &other, 43 );
+    _Cxnn( &other, Op(0xc0ff) );
+    _Cxnn( &other, Op(0xc1ff) );
+    _Cxnn(  chip, Op(0xc1ff) );
+    Chip8Free( &other );
+    if (!same || chip->rng == other.rng)
+    {
+        DEBUG_PRINT("%s\n", same ? "Seeds 42 and 43 give the same sequence" : "Seed 42 gives different sequences");
+        return -3;
+    }
     return 0;
 }
 
@@ -705,7 +780,7 @@ int test_Fx07(chip8_hw* chip)
     {
         chip->DT = i;
         unsigned opcode = 0xf007 | (v << 8);
-        _Fx07(chip, opcode);
+        _Fx07(chip, Op(opcode));
         if(chip->V[v] != i)
         {
             DEBUG_PRINT("Except %u != %u, opcode: 0x%.4x\n", chip->V[v], i, opcode);
@@ -722,7 +797,7 @@ int test_Fx15_Fx18(chip8_hw* chip, unsigned base, instr_fptr op_fun, unsigned ch
     {
         chip->V[v] = i;
         unsigned opcode = base | (v << 8);
-        op_fun(chip, opcode);
+        op_fun(chip, Op(opcode));
         if(*reg != i)
         {
             DEBUG_PRINT("Except %u != %u, opcode: 0x%.4x\n", *reg, i, opcode);
@@ -750,7 +825,7 @@ int test_Fx1E(chip8_hw* chip)
     {
         unsigned expected = (chip->I + chip->V[ v ]) & 0xffff;
         unsigned opcode = 0xf01e | (v << 8);
-        _Fx1E(chip, opcode);
+        _Fx1E(chip, Op(opcode));
         if (chip->I != expected)
         {
             DEBUG_PRINT("Except I: %u != %u, opcode: 0x%.4x\n", chip->I, expected, opcode);
@@ -772,7 +847,7 @@ int test_Fx29(chip8_hw* chip)
     for (unsigned v=0; v < REGISTER_V_COUNT; ++v)
     {
         unsigned opcode = 0xf029 | (v << 8);
-        _Fx29(chip, opcode);
+        _Fx29(chip, Op(opcode));
         if (chip->I != pos[ v ])
         {
             DEBUG_PRINT("Except I: %u != %u, opcode: 0x%.4x\n", chip->I, pos[ v ], opcode);
@@ -793,7 +868,7 @@ int test_Fx33(chip8_hw* chip)
              chip->V[ v ] % 10,
         };
         unsigned opcode = 0xf033 | (v << 8);
-        _Fx33(chip, opcode);
+        _Fx33(chip, Op(opcode));
         if( chip->ram[chip->I +0] != bcd[ 0 ] &&
             chip->ram[chip->I +1] != bcd[ 1 ] &&
             chip->ram[chip->I +2] != bcd[ 2 ]
@@ -822,7 +897,7 @@ int test_Fx55_Fx65(chip8_hw* chip)
     {
         chip->I = pos[ v ];
         unsigned opcode = 0xf055 | (v << 8);
-        _Fx55(chip, opcode);
+        _Fx55(chip, Op(opcode));
         for (unsigned i=0; i <= v; ++i)
         {
             if (chip->ram[ chip->I +i ] != values_1[ i ])
@@ -839,7 +914,7 @@ int test_Fx55_Fx65(chip8_hw* chip)
         SetVnToValues(chip, values_0);
         chip->I = pos[ v ];
         unsigned opcode = 0xf065 | (v << 8);
-        _Fx65(chip, opcode);
+        _Fx65(chip, Op(opcode));
         for (unsigned i=0; i <= v; ++i)
         {
             if (chip->V[ i ] != values_1[ i ])
@@ -854,6 +929,367 @@ int test_Fx55_Fx65(chip8_hw* chip)
     return 0;
 }
 
+int test_decode_table(chip8_hw* chip)
+{
+    for (unsigned opcode = 0; opcode < DECODE_TABLE_LEN; ++opcode)
+    {
+        unsigned expected = DecodeOpcodeScan(opcode);
+        if (DecodeOpcode(opcode) != expected)
+        {
+            DEBUG_PRINT("Except index %u != %u, opcode: 0x%.4x\n",
+                DecodeOpcode(opcode), expected, opcode);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Load program to RAM and set PC to its beginning */
+static void LoadCode(chip8_hw* chip, const unsigned short* code, unsigned len)
+{
+    for (unsigned i = 0; i < len; ++i)
+    {
+        chip->ram[ CHIP8_PROG_START + i*2   ] = code[i] >> 8;
+        chip->ram[ CHIP8_PROG_START + i*2+1 ] = code[i] & 0xff;
+    }
+    Chip8InvalidateCode(chip, CHIP8_PROG_START, len*2);
+    chip->PC = CHIP8_PROG_START;
+}
+
+int test_icache(chip8_hw* chip)
+{
+    static const unsigned short code[] = {
+        0xa208, // MOV I, 0x208
+        0x2208, // CALL 0x208
+        0xf155, // MOV [I], V1 ; Overwrites instruction at 0x208
+        0x2208, // CALL 0x208
+        0x6233, // MOV V2, 0x33
+        0x00ee, // RET
+    };
+    LoadCode(chip, code, sizeof(code)/sizeof(code[0]));
+    chip->V[0] = 0x62;
+    chip->V[1] = 0x44;
+
+    Chip8Execute(chip, 3);
+    if (chip->V[2] != 0x33)
+    {
+        DEBUG_PRINT("Except V[2]: 0x%.2x != 0x33\n", chip->V[2]);
+        return -1;
+    }
+
+    Chip8Execute(chip, 5);
+    if (chip->V[2] != 0x44)
+    {
+        DEBUG_PRINT("Except V[2]: 0x%.2x != 0x44, stale instruction executed\n", chip->V[2]);
+        return -2;
+    }
+    return 0;
+}
+
+/* Program using most of the opcodes, loops forever */
+static const unsigned short engine_test_code[] = {
+    0x6a00, // 0x200: MOV  VA, 0
+    0x6105, // 0x202: MOV  V1, 5
+    0xa300, // 0x204: MOV  I, 0x300
+    0x2240, // 0x206: CALL 0x240
+    0x7a01, // 0x208: ADD  VA, 1
+    0x8db4, // 0x20a: ADD  VD, VB
+    0x88f3, // 0x20c: XOR  V8, VF
+    0x8d16, // 0x20e: SHR  VD, V1
+    0x8b0e, // 0x210: SHL  VB
+    0x8527, // 0x212: SUBN V5, V2
+    0x86b1, // 0x214: OR   V6, VB
+    0x8712, // 0x216: AND  V7, V1
+    0x8215, // 0x218: SUB  V2, V1
+    0x8930, // 0x21a: MOV  V9, V3
+    0xcbff, // 0x21c: RND  VB, 0xff
+    0xfa33, // 0x21e: MOV  B, VA
+    0xf265, // 0x220: MOV  V2, [I]
+    0x5120, // 0x222: SE   V1, V2
+    0x9120, // 0x224: JNE  V1, V2
+    0x3a10, // 0x226: SE   VA, 0x10
+    0x4a20, // 0x228: SNE  VA, 0x20
+    0xfa1e, // 0x22a: ADD  I, VA
+    0xa300, // 0x22c: MOV  I, 0x300
+    0x4a40, // 0x22e: SNE  VA, 0x40
+    0x1200, // 0x230: JMP  0x200
+    0xea9e, // 0x232: KE   VA
+    0xe1a1, // 0x234: KNE  V1
+    0x1206, // 0x236: JMP  0x206
+    0x1206, // 0x238: JMP  0x206
+    0x0000, 0x0000, 0x0000,
+    0xfb29, // 0x240: MOV  F, VB
+    0xd455, // 0x242: DRW  V4, V5, 5
+    0xf815, // 0x244: MOV  DT, V8
+    0xfc07, // 0x246: MOV  VC, DT
+    0xf918, // 0x248: MOV  ST, V9
+    0xa380, // 0x24a: MOV  I, 0x380
+    0xf355, // 0x24c: MOV  [I], V3
+    0x6000, // 0x24e: MOV  V0, 0
+    0xb254, // 0x250: JMP  V0, 0x254
+    0x1252, // 0x252: JMP  0x252
+    0x00ee, // 0x254: RET
+};
+
+/* VF as operand of the flag setting ops, loads wrapping around RAM and an idle loop */
+static const unsigned short engine_flag_code[] = {
+    0xc0ff, // 0x200: RND  V0, 0xff
+    0xc1ff, // 0x202: RND  V1, 0xff
+    0xcfff, // 0x204: RND  VF, 0xff
+    0x8500, // 0x206: MOV  V5, V0
+    0x8f14, // 0x208: ADD  VF, V1
+    0x8f15, // 0x20a: SUB  VF, V1
+    0x8f06, // 0x20c: SHR  VF
+    0x8f17, // 0x20e: SUBN VF, V1
+    0x8f0e, // 0x210: SHL  VF
+    0x82f5, // 0x212: SUB  V2, VF
+    0x83f7, // 0x214: SUBN V3, VF
+    0x8415, // 0x216: SUB  V4, V1
+    0x8517, // 0x218: SUBN V5, V1
+    0x8506, // 0x21a: SHR  V5
+    0x840e, // 0x21c: SHL  V4
+    0xaff8, // 0x21e: MOV  I, 0xff8
+    0xff55, // 0x220: MOV  [I], VF
+    0xaffc, // 0x222: MOV  I, 0xffc
+    0xff65, // 0x224: MOV  VF, [I]
+    0x6303, // 0x226: MOV  V3, 3
+    0xf315, // 0x228: MOV  DT, V3
+    0xf307, // 0x22a: MOV  V3, DT
+    0x3300, // 0x22c: SE   V3, 0
+    0x122a, // 0x22e: JMP  0x22a
+    0x1200, // 0x230: JMP  0x200
+};
+
+/* Compare machine state of two chips */
+static bool StateEquals(chip8_hw* a, chip8_hw* b)
+{
+    return memcmp(a->V, b->V, REGISTER_V_COUNT) == 0 &&
+           a->I  == b->I  &&
+           a->PC == b->PC &&
+           a->DT == b->DT &&
+           a->ST == b->ST &&
+           a->stack_top == b->stack_top &&
+           a->rng == b->rng &&
+           a->cycles == b->cycles &&
+           a->idle_cycles == b->idle_cycles &&
+           memcmp(a->stack, b->stack, sizeof(a->stack)) == 0 &&
+           memcmp(a->gfx  , b->gfx  , sizeof(a->gfx))   == 0 &&
+           memcmp(a->ram  , b->ram  , CHIP8_RAM_LEN)    == 0;
+}
+
+/* Run code with given engine and compare results to the interpreter */
+static int RunEngineCode(chip8_hw* chip, unsigned engine, const unsigned short* code, unsigned len)
+{
+    chip8_hw ref;
+    Chip8Init( &ref );
+    LoadCode( &ref, code, len );
+    LoadCode(  chip, code, len );
+    chip->engine = engine;
+    ref.keys   = chip->keys = 0x0f35;
+    ref.is_key_down = chip->is_key_down = NULL;
+
+    int ret = 0;
+    // Uneven batches to stop in different places of the program
+    for (unsigned i = 1; i < 1000 && ret == 0; ++i)
+    {
+        unsigned batch = (i * 7) % 13 + 1;
+        int ref_ret = Chip8Execute( &ref, batch );
+        int ret_eng = Chip8Execute(  chip, batch );
+        if (ref_ret != ret_eng || !StateEquals(&ref, chip))
+        {
+            DEBUG_PRINT("State differs after batch %u, PC: %u != %u\n", i, chip->PC, ref.PC);
+            ret = -1;
+        }
+        if (i % 5 == 0)
+        {
+            Chip8ProcessTimers( &ref, 1 );
+            Chip8ProcessTimers(  chip, 1 );
+        }
+    }
+    Chip8Free( &ref );
+    return ret;
+}
+
+static int test_engine(chip8_hw* chip, unsigned engine)
+{
+    int ret = RunEngineCode( chip, engine, engine_test_code, sizeof(engine_test_code)/sizeof(engine_test_code[0]) );
+    if (ret != 0) return ret;
+
+    chip8_hw flags;
+    Chip8Init( &flags );
+    ret = RunEngineCode( &flags, engine, engine_flag_code, sizeof(engine_flag_code)/sizeof(engine_flag_code[0]) );
+    Chip8Free( &flags );
+    return ret * 2;
+}
+
+int test_engine_threaded(chip8_hw* chip)
+{
+    return test_engine(chip, CHIP8_ENGINE_THREADED);
+}
+
+int test_engine_jit(chip8_hw* chip)
+{
+    return test_engine(chip, CHIP8_ENGINE_JIT);
+}
+
+int test_icache_jit(chip8_hw* chip)
+{
+    chip->engine = CHIP8_ENGINE_JIT;
+    return test_icache(chip);
+}
+
+int test_idle_loop(chip8_hw* chip)
+{
+    static const unsigned short code[] = {
+        0x6305, // 0x200: MOV V3, 5
+        0xf315, // 0x202: MOV DT, V3
+        0xf307, // 0x204: MOV V3, DT
+        0x3300, // 0x206: SE  V3, 0
+        0x1204, // 0x208: JMP 0x204
+        0x6401, // 0x20a: MOV V4, 1
+        0x120c, // 0x20c: JMP 0x20c
+    };
+    LoadCode(chip, code, sizeof(code)/sizeof(code[0]));
+
+    // 5 instructions to close the loop once, 993 skipped, 2 left
+    Chip8Execute(chip, 1000);
+    if (chip->PC != 0x208 || chip->idle_cycles != 993 || chip->cycles != 1000 || !chip->idle)
+    {
+        DEBUG_PRINT("PC: 0x%.4x, idle cycles: %llu, cycles: %llu\n", chip->PC, chip->idle_cycles, chip->cycles);
+        return -1;
+    }
+
+    // Loop isn't idle anymore when DT changes
+    Chip8ProcessTimers(chip, 5);
+    Chip8Execute(chip, 4);
+    if (chip->PC != 0x20c || chip->V[4] != 1 || chip->idle_cycles != 993 || chip->idle)
+    {
+        DEBUG_PRINT("PC: 0x%.4x, V[4]: %u, idle cycles: %llu\n", chip->PC, chip->V[4], chip->idle_cycles);
+        return -2;
+    }
+
+    // Jump to itself
+    Chip8Execute(chip, 100);
+    if (chip->PC != 0x20c || chip->idle_cycles != 993 + 99 || chip->cycles != 1104)
+    {
+        DEBUG_PRINT("PC: 0x%.4x, idle cycles: %llu, cycles: %llu\n", chip->PC, chip->idle_cycles, chip->cycles);
+        return -3;
+    }
+
+    // Writes to DT, never idle
+    chip->V[3] = 5;
+    LoadCode(chip, code, sizeof(code)/sizeof(code[0]));
+    chip->ram[ 0x209 ] = 0x02;
+    Chip8InvalidateCode(chip, 0x208, 2);
+    Chip8Execute(chip, 1000);
+    if (chip->idle_cycles != 993 + 99)
+    {
+        DEBUG_PRINT("Idle cycles: %llu, loop writing DT was skipped\n", chip->idle_cycles);
+        return -4;
+    }
+    return 0;
+}
+
+int test_idle_loop_threaded(chip8_hw* chip)
+{
+    chip->engine = CHIP8_ENGINE_THREADED;
+    return test_idle_loop(chip);
+}
+
+int test_idle_loop_jit(chip8_hw* chip)
+{
+    chip->engine = CHIP8_ENGINE_JIT;
+    return test_idle_loop(chip);
+}
+
+int test_scheduler(chip8_hw* chip)
+{
+    static const unsigned short code[] = {
+        0x7001, // 0x200: ADD V0, 1
+        0x1200, // 0x202: JMP 0x200
+    };
+    LoadCode(chip, code, sizeof(code)/sizeof(code[0]));
+    chip->DT = 100;
+
+    chip8_scheduler sched;
+    SchedulerInit(&sched, CHIP8_CPU_FREQ, CHIP8_DT_FREQ);
+    for (unsigned i = 0; i < CHIP8_DT_FREQ; ++i)
+    {
+        unsigned long long before = chip->cycles;
+        SchedulerRunTick(&sched, chip);
+
+        unsigned ops = chip->cycles - before;
+        if (ops != CHIP8_CPU_FREQ / CHIP8_DT_FREQ && ops != CHIP8_CPU_FREQ / CHIP8_DT_FREQ + 1)
+        {
+            DEBUG_PRINT("Tick %u ran %u instructions\n", i, ops);
+            return -1;
+        }
+    }
+
+    // One second of emulated time
+    if (chip->cycles != CHIP8_CPU_FREQ || chip->V[0] != CHIP8_CPU_FREQ / 2 % 0x100 || chip->DT != 100 - CHIP8_DT_FREQ)
+    {
+        DEBUG_PRINT("Cycles: %llu, V[0]: %u, DT: %u\n", chip->cycles, chip->V[0], chip->DT);
+        return -2;
+    }
+
+    sched.uncapped = true;
+    if (SchedulerUpdate(&sched, chip) != SCHEDULER_MAX_CATCHUP || sched.ticks != CHIP8_DT_FREQ + SCHEDULER_MAX_CATCHUP)
+    {
+        DEBUG_PRINT("Uncapped update ran %llu ticks\n", sched.ticks - CHIP8_DT_FREQ);
+        return -3;
+    }
+    return 0;
+}
+
+int test_save_state(chip8_hw* chip)
+{
+    static chip8_state saved, other;
+    chip8_hw ref;
+    Chip8Init( &ref );
+    LoadCode( &ref, engine_test_code, sizeof(engine_test_code)/sizeof(engine_test_code[0]) );
+    LoadCode(  chip, engine_test_code, sizeof(engine_test_code)/sizeof(engine_test_code[0]) );
+    chip->engine = CHIP8_ENGINE_JIT;
+
+    int ret = 0;
+    Chip8Execute( &ref, 100 );
+    Chip8SaveState( &ref, &saved );
+    Chip8Execute(  chip, 100 );
+
+    // Restore over a state running different code
+    Chip8Execute(  chip, 1000 );
+    chip->ram[ 0x208 ] = 0x00;
+    Chip8InvalidateCode( chip, 0x208, 1 );
+    Chip8Execute(  chip, 1000 );
+    if (!Chip8LoadState( chip, &saved ) || !StateEquals( &ref, chip ))
+    {
+        DEBUG_PRINT("State differs after loading, PC: %u != %u\n", chip->PC, ref.PC);
+        ret = -1;
+    }
+
+    // Both continue the same way, so stale code was dropped
+    for (unsigned i = 0; i < 10 && ret == 0; ++i)
+    {
+        Chip8Execute( &ref, 97 );
+        Chip8Execute(  chip, 97 );
+        if (!StateEquals( &ref, chip ))
+        {
+            DEBUG_PRINT("State differs after batch %u, PC: %u != %u\n", i, chip->PC, ref.PC);
+            ret = -2;
+        }
+    }
+
+    Chip8SaveState( chip, &other );
+    other.version++;
+    if (ret == 0 && Chip8LoadState( chip, &other ))
+    {
+        DEBUG_PRINT("Loaded state of version %u\n", other.version);
+        ret = -3;
+    }
+    Chip8Free( &ref );
+    return ret;
+}
+
 int test_Ex9E(chip8_hw* chip)
 {
     SetVnToValues(chip, values_ordered);
@@ -862,7 +1298,7 @@ int test_Ex9E(chip8_hw* chip)
         unsigned expected = chip->PC;
         unsigned opcode = 0xe09e | (v << 8);
         key_is_down = false;
-        _Ex9E(chip, opcode);
+        _Ex9E(chip, Op(opcode));
         if (chip->PC != expected)
         {
             DEBUG_PRINT("Except PC: %u != %u, opcode: 0x%.4x\n",
@@ -871,7 +1307,7 @@ int test_Ex9E(chip8_hw* chip)
         }
         expected = chip->PC+2;
         key_is_down = true;
-        _Ex9E(chip, opcode);
+        _Ex9E(chip, Op(opcode));
         if (chip->PC != expected)
         {
             DEBUG_PRINT("Except PC: %u != %u, opcode: 0x%.4x\n",
@@ -890,7 +1326,7 @@ int test_ExA1(chip8_hw* chip)
         unsigned expected = chip->PC;
         unsigned opcode = 0xe0a1 | (v << 8);
         key_is_down = true;
-        _ExA1(chip, opcode);
+        _ExA1(chip, Op(opcode));
         if (chip->PC != expected)
         {
             DEBUG_PRINT("Except PC: %u != %u, opcode: 0x%.4x\n",
@@ -899,7 +1335,7 @@ int test_ExA1(chip8_hw* chip)
         }
         expected = chip->PC+2;
         key_is_down = false;
-        _ExA1(chip, opcode);
+        _ExA1(chip, Op(opcode));
         if (chip->PC != expected)
         {
             DEBUG_PRINT("Except PC: %u != %u, opcode: 0x%.4x\n",
@@ -910,6 +1346,32 @@ int test_ExA1(chip8_hw* chip)
     return 0;
 }
 
+int test_keys_latched(chip8_hw* chip)
+{
+    chip->is_key_down = NULL;
+    chip->keys = 1 << 5;
+    for (unsigned key = 0; key < 0x100; ++key)
+    {
+        bool down = key == 5;
+        chip->V[3] = key;
+        chip->PC = CHIP8_PROG_START;
+        _Ex9E(chip, Op(0xe39e));
+        if (chip->PC != CHIP8_PROG_START + (down ? 2 : 0))
+        {
+            DEBUG_PRINT("Ex9E: except key %u %s\n", key, down ? "down" : "up");
+            return -1;
+        }
+        chip->PC = CHIP8_PROG_START;
+        _ExA1(chip, Op(0xe3a1));
+        if (chip->PC != CHIP8_PROG_START + (down ? 0 : 2))
+        {
+            DEBUG_PRINT("ExA1: except key %u %s\n", key, down ? "down" : "up");
+            return -2;
+        }
+    }
+    return 0;
+}
+
 int test_Fx0A(chip8_hw* chip)
 {
     for (unsigned v=0; v<REGISTER_V_COUNT; ++v)
@@ -918,7 +1380,7 @@ int test_Fx0A(chip8_hw* chip)
         {
             key_down_value = i;
             unsigned opcode = 0xf00a | (v << 8);
-            _Fx0A(chip, opcode);
+            _Fx0A(chip, Op(opcode));
             if (chip->V[ v ] != key_down_value)
             {
                 DEBUG_PRINT("Except V[%u]: %u != %u, opcode: 0x%.4x\n",
@@ -932,20 +1394,19 @@ int test_Fx0A(chip8_hw* chip)
 
 int test_Dxyn(chip8_hw* chip)
 {
-    _Fx1E(chip, 0xf01e); // Point I to mem v[0] (which is 0);
-    _Dxyn(chip, 0xd01f); // Draw sprite to x=v[0], y=v[1]; from mem[I], 0xf rows
+    _Fx1E(chip, Op(0xf01e)); // Point I to mem v[0] (which is 0);
+    _Dxyn(chip, Op(0xd01f)); // Draw sprite to x=v[0], y=v[1]; from mem[I], 0xf rows
     chip->V[0] = 4;
-    _Dxyn(chip, 0xd01f);
+    _Dxyn(chip, Op(0xd01f));
 
     for (unsigned i=0; i < 0xf; i++)
     {
-        unsigned gfx_pos = i * (CHIP8_GFX_W/8);
-        unsigned char cmp = chip->ram[i];
-        cmp = cmp | (cmp >> 4);
-        if (chip->gfx[gfx_pos] != cmp)
+        uint64_t cmp = chip->ram[i];
+        cmp = (cmp << 56) | (cmp << 52);
+        if (chip->gfx[i] != cmp)
         {
-            DEBUG_PRINT("Except gfx[%u]: %u != %u",
-                gfx_pos, chip->gfx[ gfx_pos ], cmp);
+            DEBUG_PRINT("Except gfx[%u]: %.16llx != %.16llx\n",
+                i, (unsigned long long)chip->gfx[ i ], (unsigned long long)cmp);
             return -i;
         }
     }
@@ -957,18 +1418,17 @@ int test_Dxyn(chip8_hw* chip)
 
     // Clear everything
     chip->V[0] = 0;
-    _Fx1E(chip, 0xf01e);
-    _Dxyn(chip, 0xd01f);
+    _Fx1E(chip, Op(0xf01e));
+    _Dxyn(chip, Op(0xd01f));
     chip->V[0] = 4;
-    _Dxyn(chip, 0xd01f);
+    _Dxyn(chip, Op(0xd01f));
 
     for (unsigned i=0; i < 0xf; i++)
     {
-        unsigned gfx_pos = i * (CHIP8_GFX_W/8);
-        if (chip->gfx[gfx_pos] != 0)
+        if (chip->gfx[i] != 0)
         {
-            DEBUG_PRINT("Except gfx[%u]: %u != %u",
-                gfx_pos, chip->gfx[ gfx_pos ], 0);
+            DEBUG_PRINT("Except gfx[%u]: %.16llx != 0\n",
+                i, (unsigned long long)chip->gfx[ i ]);
             return -i;
         }
     }
@@ -979,7 +1439,579 @@ int test_Dxyn(chip8_hw* chip)
         return -18;
     }
 
+    // Wrap around right and bottom edges
+    chip->ram[0x300] = 0x81;
+    chip->ram[0x301] = 0xff;
+    chip->I    = 0x300;
+    chip->V[0] = 62;
+    chip->V[1] = 31;
+    _Dxyn(chip, Op(0xd012));
+    uint64_t row_31 = (1ULL << (63-62)) | (1ULL << (63-5));
+    uint64_t row_0  = 0x3ULL | (0x3fULL << (63-5));
+    if (chip->gfx[31] != row_31 || chip->gfx[0] != row_0 || chip->V[0xf] != 0)
+    {
+        DEBUG_PRINT("Except wrapped rows %.16llx, %.16llx\n",
+            (unsigned long long)chip->gfx[31], (unsigned long long)chip->gfx[0]);
+        return -19;
+    }
+
 #warning  More tests should be made for this opcode
 
     return 0;
 }
+
+int test_rewind(chip8_hw* chip)
+{
+    #define REWIND_TEST_FRAMES 40
+    static chip8_state frames[ REWIND_TEST_FRAMES ], cur;
+    static rewind_buffer rw;
+    LoadCode( chip, engine_test_code, sizeof(engine_test_code)/sizeof(engine_test_code[0]) );
+
+    // Only part of the frames fit, so the oldest ones get dropped
+    int ret = 0;
+    const unsigned kept = REWIND_TEST_FRAMES / 2;
+    RewindInit( &rw, kept );
+    for (unsigned i = 0; i < REWIND_TEST_FRAMES; ++i)
+    {
+        Chip8Execute( chip, 37 );
+        chip->ram[ 0x400 + i ] = i;
+        Chip8SaveState( chip, &frames[i] );
+        RewindCapture( &rw, chip );
+    }
+
+    for (unsigned i = REWIND_TEST_FRAMES - 1; i > REWIND_TEST_FRAMES - 1 - kept && ret == 0; --i)
+    {
+        if (!RewindStep( &rw, chip ))
+        {
+            DEBUG_PRINT("No frame before %u\n", i);
+            ret = -1;
+            break;
+        }
+        Chip8SaveState( chip, &cur );
+        if (memcmp( &cur, &frames[i-1], sizeof(cur) ) != 0)
+        {
+            DEBUG_PRINT("Frame %u differs after stepping back\n", i-1);
+            ret = -2;
+        }
+    }
+    if (ret == 0 && RewindStep( &rw, chip ))
+    {
+        DEBUG_PRINT("Stepped past %u kept frames\n", kept);
+        ret = -3;
+    }
+    RewindFree( &rw );
+    return ret;
+    #undef REWIND_TEST_FRAMES
+}
+
+static input_log replay_log;
+
+static unsigned RecordKey()
+{
+    InputLogAdd( &replay_log, 0, 7, true );
+    return 7;
+}
+
+int test_replay(chip8_hw* chip)
+{
+    static const unsigned short code[] = {
+        0xf40a, // 0x200: MOV V4, K
+        0x6005, // 0x202: MOV V0, 5
+        0xe0a1, // 0x204: KNE V0
+        0x8130, // 0x206: MOV V1, V3
+        0xc2ff, // 0x208: RND V2, 0xff
+        0x8324, // 0x20a: ADD V3, V2
+        0x1204, // 0x20c: JMP 0x204
+    };
+    const char* log_path = "opcode_test_input.log";
+    LoadCode(chip, code, sizeof(code)/sizeof(code[0]));
+    chip->is_key_down      = NULL;
+    chip->get_key_blocking = RecordKey;
+
+    // Record a session with key 5 held for a while
+    InputLogInit( &replay_log, 1234 );
+    Chip8Seed( chip, replay_log.seed );
+    chip8_scheduler sched;
+    SchedulerInit(&sched, CHIP8_CPU_FREQ, CHIP8_DT_FREQ);
+    for (unsigned tick = 0; tick < 200; ++tick)
+    {
+        InputLogLatch( &replay_log, chip, (tick >= 50 && tick < 120) ? 1 << 5 : tick >= 150 ? 1 << 2 : 0 );
+        SchedulerRunTick( &sched, chip );
+    }
+    replay_log.end_cycle = chip->cycles;
+
+    int ret = 0;
+    input_log loaded;
+    if (!InputLogSave( &replay_log, log_path ) || !InputLogLoad( &loaded, log_path ))
+    {
+        DEBUG_PRINT("Failed to save and load %s\n", log_path);
+        ret = -1;
+    }
+    else if (loaded.count != 4 || loaded.seed != replay_log.seed || loaded.end_cycle != replay_log.end_cycle)
+    {
+        DEBUG_PRINT("Loaded %u events, seed %u, end %llu\n", loaded.count, loaded.seed, loaded.end_cycle);
+        ret = -2;
+    }
+    remove( log_path );
+
+    // Other engine gives the same result
+    for (unsigned engine = CHIP8_ENGINE_INTERPRETER; engine <= CHIP8_ENGINE_JIT && ret == 0; ++engine)
+    {
+        chip8_hw replay;
+        Chip8Init( &replay );
+        LoadCode( &replay, code, sizeof(code)/sizeof(code[0]) );
+        replay.engine = engine;
+
+        run_config config = { loaded.end_cycle, 0, NULL, &loaded, NULL, 0 };
+        run_result result;
+        RunHeadless( &replay, &config, &result );
+        if (result.status != 0 || !StateEquals( chip, &replay ) || replay.V[4] != 7)
+        {
+            DEBUG_PRINT("Engine %u replay differs, V1: %u != %u, V3: %u != %u\n", engine, replay.V[1], chip->V[1], replay.V[3], chip->V[3]);
+            ret = -3;
+        }
+        Chip8Free( &replay );
+    }
+    InputLogFree( &loaded );
+    InputLogFree( &replay_log );
+    return ret;
+}
+
+/* Read what was written to f as a string */
+static char* ReadBack(FILE* f)
+{
+    long len = ftell(f);
+    char* text = calloc(len + 1, 1);
+    rewind(f);
+    if (text && fread(text, 1, len, f) != (size_t)len) text[0] = '\0';
+    rewind(f);
+    return text;
+}
+
+int test_dump(chip8_hw* chip)
+{
+    static chip8_state saved, dumped;
+    LoadCode( chip, engine_test_code, sizeof(engine_test_code)/sizeof(engine_test_code[0]) );
+    Chip8Execute( chip, 100 );
+    chip->PC = 0x20e;
+
+    FILE* f = tmpfile();
+    if (!f) return -1;
+
+    int ret = 0;
+    Chip8Dump( chip, f );
+    char* text = ReadBack(f);
+    if (!text || !strstr(text, "PC: 0x020e (526)\n") || !strstr(text, "\n0200  6a 00 61 05 a3 00 22 40 7a 01 8d b4 88 f3 8d 16 \n"))
+    {
+        DEBUG_PRINT("Unexpected text dump:\n%s\n", text ? text : "");
+        ret = -2;
+    }
+    free(text);
+
+    Chip8SaveState( chip, &saved );
+    bool written = Chip8DumpBinary( chip, f ) && ftell(f) == sizeof(dumped);
+    rewind(f);
+    if (ret == 0 && (!written || fread( &dumped, sizeof(dumped), 1, f ) != 1 || memcmp( &saved, &dumped, sizeof(saved) ) != 0))
+    {
+        DEBUG_PRINT("Binary dump differs from state%s\n", written ? "" : ", write failed");
+        ret = -3;
+    }
+    fclose(f);
+
+    // Only changed things are listed
+    chip->V[3] = 0x44;
+    chip->ram[ 0x305 ] ^= 0xff;
+    f = tmpfile();
+    if (!f) return -1;
+    if (ret == 0)
+    {
+        Chip8DumpDiff( chip, &saved, f );
+        text = ReadBack(f);
+        if (!text || !strstr(text, "V3: ") || !strstr(text, "-> 0x44 (68)\n") || !strstr(text, "RAM 0300\n") ||
+            strstr(text, "PC") || strstr(text, "GFX") || strstr(text, "RAM 0200"))
+        {
+            DEBUG_PRINT("Unexpected diff dump:\n%s\n", text ? text : "");
+            ret = -4;
+        }
+        free(text);
+    }
+    saved.version++;
+    if (ret == 0 && Chip8DumpDiff( chip, &saved, f ))
+    {
+        DEBUG_PRINT("Compared to state of version %u\n", saved.version);
+        ret = -5;
+    }
+    fclose(f);
+    return ret;
+}
+
+int test_profile(chip8_hw* chip)
+{
+    LoadCode( chip, engine_test_code, sizeof(engine_test_code)/sizeof(engine_test_code[0]) );
+    chip->engine = CHIP8_ENGINE_JIT;
+    Chip8Execute( chip, 1000 );
+
+    const chip8_profile* profile = Chip8GetProfile( chip );
+#ifdef CHIP8_PROFILE
+    unsigned long long by_mnemonic = 0, by_pc = 0;
+    for (unsigned i = 0; i < CHIP8_PROFILE_MNEMONICS; ++i) by_mnemonic += profile->mnemonic[i];
+    for (unsigned i = 0; i < CHIP8_RAM_LEN; ++i) by_pc += profile->pc[i];
+
+    // Skipped idle loops aren't executed
+    unsigned long long executed = chip->cycles - chip->idle_cycles;
+    if (by_mnemonic != executed || by_pc != executed || profile->pc[ 0x200 ] == 0)
+    {
+        DEBUG_PRINT("Counted %llu by mnemonic and %llu by PC, executed %llu\n", by_mnemonic, by_pc, executed);
+        return -1;
+    }
+#else
+    if (profile != NULL || Chip8WriteProfile( chip, stdout, true ))
+    {
+        DEBUG_PRINT("Profile without CHIP8_PROFILE: %p\n", (const void*)profile);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+int test_sampler(chip8_hw* chip)
+{
+    static const char* source =
+        "start:\n"
+        "CALL draw\n"
+        "JMP start\n"
+        "draw:\n"
+        "CALL clear\n"
+        "ADD V1, 1\n"
+        "RET\n"
+        "clear:\n"
+        "CLS\n"
+        "RET\n";
+
+    unsigned char* code = NULL;
+    char* map = NULL;
+    unsigned len = 0;
+    if (!CompileSourceLabels(source, &code, &len, &map) || !map || strcmp(map, "0x0200 start\n0x0204 draw\n0x020a clear\n") != 0)
+    {
+        DEBUG_PRINT("Label map:\n%s\n", map ? map : "");
+        free(code);
+        free(map);
+        return -1;
+    }
+    memcpy(chip->ram + CHIP8_PROG_START, code, len);
+    chip->PC = CHIP8_PROG_START;
+    free(code);
+
+    // Every instruction is sampled, 7 instructions per round
+    guest_sampler sampler;
+    int ret = 0;
+    SamplerInit(&sampler, 1);
+    SamplerAddLabels(&sampler, map);
+    free(map);
+    SamplerExecute(&sampler, chip, 70);
+
+    FILE* f = tmpfile();
+    if (!f || !SamplerWriteFolded(&sampler, f))
+    {
+        ret = -2;
+    }
+    else
+    {
+        char* text = ReadBack(f);
+        if (!text || sampler.samples != 70 || chip->cycles != 70 ||
+            !strstr(text, "start 20\n") || !strstr(text, "start;draw 30\n") || !strstr(text, "start;draw;clear 20\n"))
+        {
+            DEBUG_PRINT("%llu samples:\n%s\n", sampler.samples, text ? text : "");
+            ret = -3;
+        }
+        free(text);
+    }
+    if (f) fclose(f);
+    SamplerFree(&sampler);
+    return ret;
+}
+
+#define BATCH_TEST_JOBS  24
+
+typedef struct {
+    const unsigned short* code;
+    unsigned              len;
+    const key_script*     script;
+    unsigned long long    hashes[ BATCH_TEST_JOBS ];
+    unsigned              runs[ BATCH_TEST_JOBS ];
+} batch_test;
+
+/* Each job runs a different number of instructions with one of the engines */
+static unsigned long long RunBatchJob(const batch_test* test, unsigned job)
+{
+    chip8_hw chip;
+    Chip8Init( &chip );
+    LoadCode( &chip, test->code, test->len );
+    chip.engine = job % (CHIP8_ENGINE_JIT + 1);
+
+    run_config config = { 400000 + job * 3701, 0, test->script, NULL, NULL, 0 };
+    run_result result;
+    RunHeadless( &chip, &config, &result );
+    unsigned long long hash = result.status == 0 ? RunStateHash( &chip ) : 0;
+    Chip8Free( &chip );
+    return hash;
+}
+
+static void BatchTestJob(void* context, unsigned job, unsigned worker)
+{
+    batch_test* test = context;
+    test->hashes[ job ] = RunBatchJob( test, job );
+    test->runs[ job ]++;
+}
+
+int test_batch(chip8_hw* chip)
+{
+    static const unsigned short code[] = {
+        0xf40a, // 0x200: MOV V4, K
+        0x6005, // 0x202: MOV V0, 5
+        0xe0a1, // 0x204: KNE V0
+        0x8130, // 0x206: MOV V1, V3
+        0xc2ff, // 0x208: RND V2, 0xff
+        0x8324, // 0x20a: ADD V3, V2
+        0x1204, // 0x20c: JMP 0x204
+    };
+    // Key 5 toggles all through the runs
+    static key_event events[ 64 ];
+    for (unsigned i = 0; i < sizeof(events)/sizeof(events[0]); ++i)
+    {
+        events[i].frame = 10 + i * 997;
+        events[i].keys  = (i & 1) ? 0 : 1 << 5;
+    }
+    const key_script script = { events, sizeof(events)/sizeof(events[0]) };
+    static batch_test test;
+    test = (batch_test){ code, sizeof(code)/sizeof(code[0]), &script, { 0 }, { 0 } };
+
+    // Key callbacks of each thread see only their own chip and script
+    int ret = 0;
+    unsigned stolen = 0;
+    if (!PoolRun( BATCH_TEST_JOBS, 4, BatchTestJob, &test, &stolen ))
+    {
+        DEBUG_PRINT("%s\n", "Failed to run pool");
+        return -1;
+    }
+    for (unsigned job = 0; job < BATCH_TEST_JOBS && ret == 0; ++job)
+    {
+        unsigned long long expected = RunBatchJob( &test, job );
+        if (test.runs[ job ] != 1 || test.hashes[ job ] != expected || expected == 0)
+        {
+            DEBUG_PRINT("Job %u run %u times, hash %.16llx != %.16llx\n", job, test.runs[ job ], test.hashes[ job ], expected);
+            ret = -2;
+        }
+    }
+
+    // Endless loop stops at the time budget
+    static const unsigned short loop[] = { 0x1200 }; // 0x200: JMP 0x200
+    LoadCode( chip, loop, 1 );
+    run_config config = { 0, 0, NULL, NULL, NULL, 0.01 };
+    run_result result;
+    RunHeadless( chip, &config, &result );
+    if (ret == 0 && (!result.timed_out || result.seconds < 0.01 || result.status != 0))
+    {
+        DEBUG_PRINT("Run of %f s timed out: %d\n", result.seconds, result.timed_out);
+        ret = -3;
+    }
+
+    // Hash leaves out counters and keys, they differ between engines and idle loop detection
+    unsigned long long hash = RunStateHash( chip );
+    chip->cycles      += 1000;
+    chip->idle_cycles += 1000;
+    chip->keys        ^= 0xffff;
+    bool same = RunStateHash( chip ) == hash;
+    chip->ram[ 0x300 ] ^= 1;
+    if (ret == 0 && (!same || RunStateHash( chip ) == hash))
+    {
+        DEBUG_PRINT("State hash %.16llx, same after counters changed: %d\n", hash, same);
+        ret = -4;
+    }
+    return ret;
+}
+
+/* Run code on all lanes, with and without AVX2, and compare each lane with Chip8Execute() */
+static int RunLockstepCode(const unsigned short* code, unsigned len, bool idles)
+{
+    static chip8_hw chips[ LOCKSTEP_LANES ];
+    static chip8_hw expected[ LOCKSTEP_LANES ];
+    static chip8_lockstep ls;
+
+    int ret = 0;
+    for (unsigned avx2 = 0; avx2 < 2 && ret == 0; ++avx2)
+    {
+        chip8_hw* lanes[ LOCKSTEP_LANES ];
+        for (unsigned lane = 0; lane < LOCKSTEP_LANES; ++lane)
+        {
+            Chip8Init( &chips[ lane ] );
+            Chip8Init( &expected[ lane ] );
+            LoadCode( &chips[ lane ], code, len );
+            LoadCode( &expected[ lane ], code, len );
+            Chip8Seed( &chips[ lane ], lane + 1 );
+            Chip8Seed( &expected[ lane ], lane + 1 );
+            lanes[ lane ] = &chips[ lane ];
+        }
+        LockstepInit( &ls, lanes, LOCKSTEP_LANES );
+        bool has_avx2 = ls.avx2;
+        ls.avx2 = ls.avx2 && avx2;
+
+        unsigned long long idle_cycles = 0;
+        for (unsigned round = 0; round < 20 && ret == 0; ++round)
+        {
+            ret = LockstepExecute( &ls, 97 + round ) == 0 ? 0 : -1;
+            for (unsigned lane = 0; lane < LOCKSTEP_LANES && ret == 0; ++lane)
+            {
+                Chip8Execute( &expected[ lane ], 97 + round );
+                if (!StateEquals( &chips[ lane ], &expected[ lane ] ) || chips[ lane ].idle != expected[ lane ].idle)
+                {
+                    DEBUG_PRINT("AVX2 %u, round %u: lane %u differs, PC 0x%.4x != 0x%.4x, idle %llu != %llu\n", ls.avx2, round, lane,
+                                chips[ lane ].PC, expected[ lane ].PC, chips[ lane ].idle_cycles, expected[ lane ].idle_cycles);
+                    ret = -2;
+                }
+
+                // A frame passes, and some lanes hold key 2
+                idle_cycles += chips[ lane ].idle_cycles;
+                Chip8ProcessTimers( &chips[ lane ], 1 );
+                Chip8ProcessTimers( &expected[ lane ], 1 );
+                chips[ lane ].keys = expected[ lane ].keys = (round + lane) % 3 == 0 ? 1 << 2 : 0;
+            }
+        }
+        if (ret == 0 && (ls.avx2 != (ls.vector_ops > 0) || idles != (idle_cycles > 0)))
+        {
+            DEBUG_PRINT("AVX2 %u, %llu vector and %llu scalar instructions, %llu idle\n", ls.avx2, ls.vector_ops, ls.scalar_ops, idle_cycles);
+            ret = -3;
+        }
+        if (!has_avx2) DEBUG_PRINT("%s\n", "No AVX2, only the scalar path is tested");
+
+        for (unsigned lane = 0; lane < LOCKSTEP_LANES; ++lane)
+        {
+            Chip8Free( &chips[ lane ] );
+            Chip8Free( &expected[ lane ] );
+        }
+    }
+    return ret;
+}
+
+/* Lanes split at skips and at code patched with a random value, and meet again */
+int test_lockstep(chip8_hw* chip)
+{
+    static const unsigned short code[] = {
+        0x6103, // 0x200: MOV  V1, 3
+        0x8014, // 0x202: ADD  V0, V1
+        0x8215, // 0x204: SUB  V2, V1
+        0x8300, // 0x206: MOV  V3, V0
+        0x8306, // 0x208: SHR  V3
+        0x8400, // 0x20a: MOV  V4, V0
+        0x840e, // 0x20c: SHL  V4
+        0x3080, // 0x20e: SE   V0, 0x80
+        0x7601, // 0x210: ADD  V6, 1
+        0x2226, // 0x212: CALL 0x226
+        0xf41e, // 0x214: ADD  I, V4
+        0x8537, // 0x216: SUBN V5, V3
+        0x5230, // 0x218: SE   V2, V3
+        0xc0ff, // 0x21a: RND  V0, 0xff
+        0xa223, // 0x21c: MOV  I, 0x223
+        0xf055, // 0x21e: MOV  [I], V0
+        0x7001, // 0x220: ADD  V0, 1
+        0x7500, // 0x222: ADD  V5, <V0 stored at 0x21e>
+        0x1200, // 0x224: JMP  0x200
+        0xd125, // 0x226: DRW  V1, V2, 5
+        0x00ee, // 0x228: RET
+    };
+    // Waits for DT like chip8_res/bench/idle, then while key 2 is held,
+    // lanes run on their own after patching code with a random value
+    static const unsigned short idle[] = {
+        0x6402, // 0x200: MOV  V4, 2
+        0xc1ff, // 0x202: RND  V1, 0xff
+        0xf415, // 0x204: MOV  DT, V4
+        0xf007, // 0x206: MOV  V0, DT
+        0x3000, // 0x208: SE   V0, 0
+        0x1206, // 0x20a: JMP  0x206
+        0x7101, // 0x20c: ADD  V1, 1
+        0xf129, // 0x20e: MOV  F, V1
+        0xd335, // 0x210: DRW  V3, V3, 5
+        0x8010, // 0x212: MOV  V0, V1
+        0xa21f, // 0x214: MOV  I, 0x21f
+        0xf055, // 0x216: MOV  [I], V0
+        0x6202, // 0x218: MOV  V2, 2
+        0xe2a1, // 0x21a: SKNP V2
+        0x121a, // 0x21c: JMP  0x21a
+        0x7500, // 0x21e: ADD  V5, <V1 stored at 0x216>
+        0x1204, // 0x220: JMP  0x204
+    };
+
+    int ret = RunLockstepCode( code, sizeof(code)/sizeof(code[0]), false );
+    if (ret == 0) ret = RunLockstepCode( idle, sizeof(idle)/sizeof(idle[0]), true );
+    return ret;
+}
+
+int test_ram_wrap(chip8_hw* chip)
+{
+    static const unsigned short code[] = {
+        0xaff8, // 0x200: MOV  I, 0xff8
+        0xff55, // 0x202: MOV  [I], V15   ; 0xff8..0xfff, 0x000..0x007
+        0xaffc, // 0x204: MOV  I, 0xffc
+        0xf765, // 0x206: MOV  V7, [I]    ; 0xffc..0xfff, 0x000..0x003
+        0xafff, // 0x208: MOV  I, 0xfff
+        0xf033, // 0x20a: BCD  V0         ; 0xfff, 0x000, 0x001
+        0xf01e, // 0x20c: ADD  I, V0      ; I above 12 bits
+        0xf155, // 0x20e: MOV  [I], V1
+        0xaffe, // 0x210: MOV  I, 0xffe
+        0xd013, // 0x212: DRW  V0, V1, 3  ; 0xffe, 0xfff, 0x000
+        0x1214, // 0x214: JMP  0x214
+    };
+    const unsigned engines[] = { CHIP8_ENGINE_INTERPRETER, CHIP8_ENGINE_THREADED, CHIP8_ENGINE_JIT };
+    static chip8_hw chips[ 3 ];
+    for (unsigned e = 0; e < 3; ++e) Chip8Init( &chips[e] );
+
+    int ret = 0;
+    for (unsigned e = 0; e < 3 && ret == 0; ++e)
+    {
+        chip8_hw* c = &chips[e];
+        LoadCode( c, code, sizeof(code)/sizeof(code[0]) );
+        c->engine = engines[e];
+        c->draw_screen = chip->draw_screen;
+        for (unsigned i = 0; i < REGISTER_V_COUNT; ++i) c->V[i] = 0x41 + i;
+
+        // Hooks follow RAM in chip8_hw and must stay out of reach of the program
+        Chip8Execute( c, 11 );
+        if (c->PC != 0x214 || c->I != 0xffe || c->draw_screen != chip->draw_screen ||
+            c->is_key_down != NULL || c->play_sound != NULL)
+        {
+            DEBUG_PRINT("Engine %u, PC: 0x%.4x, I: 0x%.4x\n", engines[e], c->PC, c->I);
+            ret = -1;
+        }
+        for (unsigned i = 0; i < 8 && ret == 0; ++i)
+        {
+            if (c->V[i] != 0x45 + i || c->ram[ 0xff8 + i ] != (i == 7 ? 0 : 0x41 + i))
+            {
+                DEBUG_PRINT("Engine %u, V[%u]: 0x%.2x, RAM[0x%.3x]: 0x%.2x\n",
+                    engines[e], i, c->V[i], 0xff8 + i, c->ram[ 0xff8 + i ]);
+                ret = -2;
+            }
+        }
+        // BCD of 69 over the end, then V0 and V1 stored at 0xfff + 0x45 - 0x1000
+        if (ret == 0 && (c->ram[0] != 6 || c->ram[1] != 9 || c->ram[2] != 0x4b ||
+                         c->ram[0x44] != 0x45 || c->ram[0x45] != 0x46))
+        {
+            DEBUG_PRINT("Engine %u, RAM: 0x%.2x 0x%.2x 0x%.2x, 0x%.2x 0x%.2x\n",
+                engines[e], c->ram[0], c->ram[1], c->ram[2], c->ram[0x44], c->ram[0x45]);
+            ret = -3;
+        }
+        // Rows 0x47, 0, 6 at (0x45 % 64, 0x46 % 32)
+        const unsigned shift = CHIP8_GFX_W - 8 - 5;
+        if (ret == 0 && (c->gfx[6] != (uint64_t)0x47 << shift || c->gfx[7] != 0 || c->gfx[8] != (uint64_t)6 << shift))
+        {
+            DEBUG_PRINT("Engine %u, gfx[6]: 0x%.16llx\n", engines[e], (unsigned long long)c->gfx[6]);
+            ret = -4;
+        }
+        if (ret == 0 && e > 0 && !StateEquals(&chips[0], c))
+        {
+            DEBUG_PRINT("Engine %u differs from interpreter\n", engines[e]);
+            ret = -5;
+        }
+    }
+    for (unsigned e = 0; e < 3; ++e) Chip8Free( &chips[e] );
+    return ret;
+}
@@ -2,144 +2,98 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <endian.h>
-#include <assert.h>
 
 #include "chip8.h"
 #include "opcodes.h"
 
-static void GetNibbles(unsigned opc, unsigned char* arr)
+void _0nnn(chip8_hw* chip, const decoded_instr* in)
 {
-    *arr     = opc & 0xf;
-    opc >>= 4;
-    *(arr+1) = opc & 0xf;
-    opc >>= 4;
-    *(arr+2) = opc & 0xf;
+    _invalid_op(chip, in);
 }
 
-/* For opcodes 0xnXYn */
-static void GetXY(chip8_hw* chip, unsigned op, unsigned char** x, unsigned char** y)
-{
-    unsigned char nibbles[3] = {0};
-    GetNibbles(op, nibbles);
-    *x = &(chip->V[ nibbles[2] ]);
-    *y = &(chip->V[ nibbles[1] ]);
-}
-
-void _0nnn(chip8_hw* chip, unsigned opcode)
-{
-    _invalid_op(chip, opcode);
-}
-
-void _00E0(chip8_hw* chip, unsigned opcode)
+void _00E0(chip8_hw* chip, const decoded_instr* in)
 {
     memset( chip->gfx, 0, CHIP8_GFX_LEN );
 }
 
-void _00EE(chip8_hw* chip, unsigned opcode)
+void _00EE(chip8_hw* chip, const decoded_instr* in)
 {
     /* TODO: Check for stack_top == 0? */
     chip->stack_top--;
     chip->PC = chip->stack[ chip->stack_top ];
 }
 
-void _1nnn(chip8_hw* chip, unsigned opcode)
+void _1nnn(chip8_hw* chip, const decoded_instr* in)
 {
-    chip->PC = opcode & 0xfff;
+    chip->PC = in->nnn;
 }
 
-void _2nnn(chip8_hw* chip, unsigned opcode)
+void _2nnn(chip8_hw* chip, const decoded_instr* in)
 {
     chip->stack[ chip->stack_top ] = chip->PC;
     chip->stack_top++;
 
-    chip->PC = opcode & 0xfff;
+    chip->PC = in->nnn;
 }
 
-void _3xnn(chip8_hw* chip, unsigned opcode)
+void _3xnn(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned reg = GET_NIBBLE(opcode, 2);
-    unsigned cmp = opcode & 0xff;
-    if ( chip->V[reg] == cmp )
+    if ( chip->V[ in->x ] == in->nn )
     {
         chip->PC += 2;
     }
 }
 
-void _4xnn(chip8_hw* chip, unsigned opcode)
+void _4xnn(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned reg = GET_NIBBLE(opcode, 2);
-    unsigned cmp = opcode & 0xff;
-    if ( chip->V[reg] != cmp )
+    if ( chip->V[ in->x ] != in->nn )
     {
         chip->PC += 2;
     }
 }
 
-void _5xy0(chip8_hw* chip, unsigned opcode)
+void _5xy0(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned char nibbles[3] = {0};
-    GetNibbles(opcode, nibbles);
-    if (chip->V[ nibbles[1] ] == chip->V[ nibbles[2] ])
+    if (chip->V[ in->y ] == chip->V[ in->x ])
     {
         chip->PC += 2;
     }
 }
 
-void _6xnn(chip8_hw* chip, unsigned opcode)
+void _6xnn(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned reg = GET_NIBBLE(opcode, 2);
-    chip->V[ reg ] = opcode & 0xff;
+    chip->V[ in->x ] = in->nn;
 }
 
-void _7xnn(chip8_hw* chip, unsigned opcode)
+void _7xnn(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned reg = GET_NIBBLE(opcode, 2);
-    chip->V[ reg ] += opcode & 0xff;
+    chip->V[ in->x ] += in->nn;
 }
 
-void _8xy0(chip8_hw* chip, unsigned opcode)
+void _8xy0(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned char* x = NULL;
-    unsigned char* y = NULL;
-
-    GetXY(chip, opcode, &x, &y);
-    *x = *y;
+    chip->V[ in->x ] = chip->V[ in->y ];
 }
 
-void _8xy1(chip8_hw* chip, unsigned opcode)
+void _8xy1(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned char* x = NULL;
-    unsigned char* y = NULL;
-
-    GetXY(chip, opcode, &x, &y);
-    *x = *x | *y;
+    chip->V[ in->x ] |= chip->V[ in->y ];
 }
 
-void _8xy2(chip8_hw* chip, unsigned opcode)
+void _8xy2(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned char* x = NULL;
-    unsigned char* y = NULL;
-
-    GetXY(chip, opcode, &x, &y);
-    *x = *x & *y;
+    chip->V[ in->x ] &= chip->V[ in->y ];
 }
 
-void _8xy3(chip8_hw* chip, unsigned opcode)
+void _8xy3(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned char* x = NULL;
-    unsigned char* y = NULL;
-
-    GetXY(chip, opcode, &x, &y);
-    *x = *x ^ *y;
+    chip->V[ in->x ] ^= chip->V[ in->y ];
 }
 
-void _8xy4(chip8_hw* chip, unsigned opcode)
+void _8xy4(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned char* x = NULL;
-    unsigned char* y = NULL;
-
-    GetXY(chip, opcode, &x, &y);
-    unsigned tmp = *y;
+    unsigned char* x = &(chip->V[ in->x ]);
+    unsigned tmp = chip->V[ in->y ];
     *x += tmp;
 
     if (*x < tmp) // Overflow
@@ -152,13 +106,10 @@ void _8xy4(chip8_hw* chip, unsigned opcode)
     }
 }
 
-void _8xy5(chip8_hw* chip, unsigned opcode)
+void _8xy5(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned char* x = NULL;
-    unsigned char* y = NULL;
-
-    GetXY(chip, opcode, &x, &y);
-    unsigned char tmp = *y;
+    unsigned char* x = &(chip->V[ in->x ]);
+    unsigned char tmp = chip->V[ in->y ];
     if (*x < tmp) // Underflow
     {
         chip->V[0xf] = 0; // Borrow
@@ -170,23 +121,17 @@ void _8xy5(chip8_hw* chip, unsigned opcode)
     *x -= tmp;
 }
 
-void _8xy6(chip8_hw* chip, unsigned opcode)
+void _8xy6(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned char* x = NULL;
-    unsigned char* y = NULL;
-
-    GetXY(chip, opcode, &x, &y);
+    unsigned char* x = &(chip->V[ in->x ]);
     chip->V[0xf] = *x & 1;
     *x = *x >> 1;
 }
 
-void _8xy7(chip8_hw* chip, unsigned opcode)
+void _8xy7(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned char* x = NULL;
-    unsigned char* y = NULL;
-
-    GetXY(chip, opcode, &x, &y);
-    unsigned char tmp = *y;
+    unsigned char* x = &(chip->V[ in->x ]);
+    unsigned char tmp = chip->V[ in->y ];
     if (tmp < *x) // Underflow
     {
         chip->V[0xf] = 0; // Borrow
@@ -198,12 +143,9 @@ void _8xy7(chip8_hw* chip, unsigned opcode)
     *x = tmp - *x;
 }
 
-void _8xyE(chip8_hw* chip, unsigned opcode)
+void _8xyE(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned char* x = NULL;
-    unsigned char* y = NULL;
-
-    GetXY(chip, opcode, &x, &y);
+    unsigned char* x = &(chip->V[ in->x ]);
     if ((*x & 0x80) == 0)
     {
         chip->V[0xf] = 0;
@@ -216,165 +158,136 @@ void _8xyE(chip8_hw* chip, unsigned opcode)
     *x = *x << 1;
 }
 
-void _9xy0(chip8_hw* chip, unsigned opcode)
+void _9xy0(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned char* x = NULL;
-    unsigned char* y = NULL;
-
-    GetXY(chip, opcode, &x, &y);
-    if (*x != *y)
+    if (chip->V[ in->x ] != chip->V[ in->y ])
     {
         chip->PC += 2;
     }
 }
 
-void _Annn(chip8_hw* chip, unsigned opcode)
+void _Annn(chip8_hw* chip, const decoded_instr* in)
 {
-    chip->I = opcode & 0xfff;
+    chip->I = in->nnn;
 }
 
-void _Bnnn(chip8_hw* chip, unsigned opcode)
+void _Bnnn(chip8_hw* chip, const decoded_instr* in)
 {
-    chip->PC= chip->V[0] + (opcode & 0xfff);
+    chip->PC= chip->V[0] + in->nnn;
 }
 
-void _Cxnn(chip8_hw* chip, unsigned opcode)
+void _Cxnn(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned x = GET_NIBBLE(opcode, 2);
-    chip->V[x] = rand() & (opcode & 0xff);
+    chip->V[ in->x ] = Chip8Random(chip) & in->nn;
 }
 
-void _Dxyn(chip8_hw* chip, unsigned opcode)
+void _Dxyn(chip8_hw* chip, const decoded_instr* in)
 {
     unsigned pos = chip->I;
-    unsigned char nibbles[3] = {0};
-    GetNibbles(opcode, nibbles);
-
-    unsigned y = chip->V[ nibbles[1] ];
+    unsigned x = chip->V[ in->x ] % CHIP8_GFX_W;
+    unsigned y = chip->V[ in->y ];
+    uint64_t collision = 0;
 
-    chip->V[0xf] = 0;
-    for (unsigned i = 0; i < nibbles[0]; i++, y++)
+    for (unsigned i = 0; i < in->n; i++, y++)
     {
-        unsigned char sprite = chip->ram[ pos+i ];
-
-        unsigned x = chip->V[ nibbles[2] ];
-        y %= CHIP8_GFX_H;
-        for (unsigned j = 0; j < 8; j++, x++)
-        {
-            x %= CHIP8_GFX_W;
-
-            unsigned sprite_bit  = 0x80 >> (j%8); // Current bit in sprite space
-            unsigned bit  = 0x80 >> (x%8);        // Current bit in framebuffer space
-            unsigned byte = (x / 8) + (y * CHIP8_GFX_W / 8); // Byte in framebuffer where current pixel lies
-
-            if ((sprite & sprite_bit) == 0) continue;
-
-            // If pixel is unset: VF -> 1
-            if (chip->gfx[ byte ] & bit)
-            {
-                chip->V[0xf] = 1;
-            }
-            chip->gfx[ byte ] ^= bit;
-        }
+        // Sprite row to the left edge and then rotated to x, so that it wraps around
+        uint64_t sprite = (uint64_t)chip->ram[ (pos+i) & CHIP8_ADDR_MASK ] << (CHIP8_GFX_W - 8);
+        sprite = (sprite >> x) | (sprite << ((CHIP8_GFX_W - x) % CHIP8_GFX_W));
+
+        uint64_t* row = &(chip->gfx[ y % CHIP8_GFX_H ]);
+        collision |= *row & sprite;
+        *row ^= sprite;
     }
+
+    // If any pixel is unset: VF -> 1
+    chip->V[0xf] = collision != 0;
 }
 
-void _Ex9E(chip8_hw* chip, unsigned opcode)
+void _Ex9E(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned x = GET_NIBBLE(opcode, 2);
-    if (chip->is_key_down(chip->V[x]))
+    if (Chip8IsKeyDown(chip, chip->V[ in->x ]))
     {
         chip->PC += 2;
     }
 }
 
-void _ExA1(chip8_hw* chip, unsigned opcode)
+void _ExA1(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned x = GET_NIBBLE(opcode, 2);
-    if (!chip->is_key_down(chip->V[x]))
+    if (!Chip8IsKeyDown(chip, chip->V[ in->x ]))
     {
         chip->PC += 2;
     }
 }
 
-void _Fx07(chip8_hw* chip, unsigned opcode)
+void _Fx07(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned x = GET_NIBBLE(opcode, 2);
-    chip->V[x] = chip->DT;
+    chip->V[ in->x ] = chip->DT;
 }
 
-void _Fx0A(chip8_hw* chip, unsigned opcode)
+void _Fx0A(chip8_hw* chip, const decoded_instr* in)
 {
     // Make sure screen is up to date before blocking
     if (chip->draw_screen) chip->draw_screen(chip);
 
-    unsigned x = GET_NIBBLE(opcode, 2);
     unsigned key = chip->get_key_blocking();
-    chip->V[x] = key;
+    chip->V[ in->x ] = key;
     chip->was_blocking = true;
 }
 
-void _Fx15(chip8_hw* chip, unsigned opcode)
+void _Fx15(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned x = GET_NIBBLE(opcode, 2);
-    chip->DT = chip->V[x];
+    chip->DT = chip->V[ in->x ];
 }
 
-void _Fx18(chip8_hw* chip, unsigned opcode)
+void _Fx18(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned x = GET_NIBBLE(opcode, 2);
-    chip->ST = chip->V[x];
+    chip->ST = chip->V[ in->x ];
+    if (chip->play_sound) chip->play_sound(chip->ST);
 }
 
-void _Fx1E(chip8_hw* chip, unsigned opcode)
+void _Fx1E(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned char* x = NULL;
-    unsigned char* y = NULL;
-
-    GetXY(chip, opcode, &x, &y);
-    chip->I += *x;
+    chip->I += chip->V[ in->x ];
 }
 
-void _Fx29(chip8_hw* chip, unsigned opcode)
+void _Fx29(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned char* x = NULL;
-    unsigned char* y = NULL;
-    GetXY(chip, opcode, &x, &y);
-    chip->I = CHIP8_RAM_CHARSET_BEGIN + CHIP8_CHAR_LEN * (*x);
+    chip->I = CHIP8_RAM_CHARSET_BEGIN + CHIP8_CHAR_LEN * chip->V[ in->x ];
 }
 
-void _Fx33(chip8_hw* chip, unsigned opcode)
+void _Fx33(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned val = chip->V[ GET_NIBBLE(opcode, 2) ];
-    unsigned pos = chip->I;
-    assert(pos < CHIP8_RAM_LEN-2);
+    unsigned val = chip->V[ in->x ];
+    unsigned pos = chip->I & CHIP8_ADDR_MASK;
 
-    chip->ram[ pos   ] = val / 100;
-    chip->ram[ pos+1 ] = (val % 100) / 10;
-    chip->ram[ pos+2 ] = (val % 10);
+    chip->ram[ pos ] = val / 100;
+    chip->ram[ (pos+1) & CHIP8_ADDR_MASK ] = (val % 100) / 10;
+    chip->ram[ (pos+2) & CHIP8_ADDR_MASK ] = (val % 10);
+    Chip8InvalidateCode(chip, pos, 3);
 }
 
-void _Fx55(chip8_hw* chip, unsigned opcode)
+void _Fx55(chip8_hw* chip, const decoded_instr* in)
 {
-    unsigned pos = chip->I;
-    unsigned last = GET_NIBBLE(opcode, 2);
+    unsigned pos = chip->I & CHIP8_ADDR_MASK;
+    unsigned last = in->x;
     for (unsigned i = 0; i <= last; i++)
     {
-        chip->ram[ pos+i ] = chip->V[ i ];
+        chip->ram[ (pos+i) & CHIP8_ADDR_MASK ] = chip->V[ i ];
     }
+    Chip8InvalidateCode(chip, pos, last+1);
 }
 
-void _Fx65(chip8_hw* chip, unsigned opcode)
+void _Fx65(chip8_hw* chip, const decoded_instr* in)
 {
     unsigned pos = chip->I;
-    unsigned last = GET_NIBBLE(opcode, 2);
+    unsigned last = in->x;
     for (unsigned i = 0; i <= last; i++)
     {
-        chip->V[ i ] = chip->ram[ pos+i ];
+        chip->V[ i ] = chip->ram[ (pos+i) & CHIP8_ADDR_MASK ];
     }
 }
 
-void _invalid_op(chip8_hw* chip, unsigned opcode)
+void _invalid_op(chip8_hw* chip, const decoded_instr* in)
 {
 }
 
@@ -6,45 +6,59 @@
 
 #define GET_NIBBLE(val, nib)  ((val >> (nib*4)) & 0xf)
 
-typedef void (*instr_fptr)(chip8_hw* chip, unsigned opcode);
+typedef struct decoded_instr decoded_instr;
+typedef void (*instr_fptr)(chip8_hw* chip, const decoded_instr* instr);
+
+/* Opcode with its operands extracted, see DecodeOperands() */
+struct decoded_instr {
+    instr_fptr     fun;    /**< Handler, NULL if not decoded */
+    unsigned short opcode;
+    unsigned short nnn;
+    unsigned char  x;
+    unsigned char  y;
+    unsigned char  n;
+    unsigned char  nn;
+    unsigned char  index;  /**< Index in mnemonic_list */
+    bool           busy;   /**< 1nnn: doesn't close an idle loop */
+};
 
 /* Opcodes */
-void _0nnn(chip8_hw*, unsigned);
-void _00E0(chip8_hw*, unsigned);
-void _00EE(chip8_hw*, unsigned);
-void _1nnn(chip8_hw*, unsigned);
-void _2nnn(chip8_hw*, unsigned);
-void _3xnn(chip8_hw*, unsigned);
-void _4xnn(chip8_hw*, unsigned);
-void _5xy0(chip8_hw*, unsigned);
-void _6xnn(chip8_hw*, unsigned);
-void _7xnn(chip8_hw*, unsigned);
-void _8xy0(chip8_hw*, unsigned);
-void _8xy1(chip8_hw*, unsigned);
-void _8xy2(chip8_hw*, unsigned);
-void _8xy3(chip8_hw*, unsigned);
-void _8xy4(chip8_hw*, unsigned);
-void _8xy5(chip8_hw*, unsigned);
-void _8xy6(chip8_hw*, unsigned);
-void _8xy7(chip8_hw*, unsigned);
-void _8xyE(chip8_hw*, unsigned);
-void _9xy0(chip8_hw*, unsigned);
-void _Annn(chip8_hw*, unsigned);
-void _Bnnn(chip8_hw*, unsigned);
-void _Cxnn(chip8_hw*, unsigned);
-void _Dxyn(chip8_hw*, unsigned);
-void _Ex9E(chip8_hw*, unsigned);
-void _ExA1(chip8_hw*, unsigned);
-void _Fx07(chip8_hw*, unsigned);
-void _Fx0A(chip8_hw*, unsigned);
-void _Fx15(chip8_hw*, unsigned);
-void _Fx18(chip8_hw*, unsigned);
-void _Fx1E(chip8_hw*, unsigned);
-void _Fx29(chip8_hw*, unsigned);
-void _Fx33(chip8_hw*, unsigned);
-void _Fx55(chip8_hw*, unsigned);
-void _Fx65(chip8_hw*, unsigned);
-void _invalid_op(chip8_hw*, unsigned);
+void _0nnn(chip8_hw*, const decoded_instr*);
+void _00E0(chip8_hw*, const decoded_instr*);
+void _00EE(chip8_hw*, const decoded_instr*);
+void _1nnn(chip8_hw*, const decoded_instr*);
+void _2nnn(chip8_hw*, const decoded_instr*);
+void _3xnn(chip8_hw*, const decoded_instr*);
+void _4xnn(chip8_hw*, const decoded_instr*);
+void _5xy0(chip8_hw*, const decoded_instr*);
+void _6xnn(chip8_hw*, const decoded_instr*);
+void _7xnn(chip8_hw*, const decoded_instr*);
+void _8xy0(chip8_hw*, const decoded_instr*);
+void _8xy1(chip8_hw*, const decoded_instr*);
+void _8xy2(chip8_hw*, const decoded_instr*);
+void _8xy3(chip8_hw*, const decoded_instr*);
+void _8xy4(chip8_hw*, const decoded_instr*);
+void _8xy5(chip8_hw*, const decoded_instr*);
+void _8xy6(chip8_hw*, const decoded_instr*);
+void _8xy7(chip8_hw*, const decoded_instr*);
+void _8xyE(chip8_hw*, const decoded_instr*);
+void _9xy0(chip8_hw*, const decoded_instr*);
+void _Annn(chip8_hw*, const decoded_instr*);
+void _Bnnn(chip8_hw*, const decoded_instr*);
+void _Cxnn(chip8_hw*, const decoded_instr*);
+void _Dxyn(chip8_hw*, const decoded_instr*);
+void _Ex9E(chip8_hw*, const decoded_instr*);
+void _ExA1(chip8_hw*, const decoded_instr*);
+void _Fx07(chip8_hw*, const decoded_instr*);
+void _Fx0A(chip8_hw*, const decoded_instr*);
+void _Fx15(chip8_hw*, const decoded_instr*);
+void _Fx18(chip8_hw*, const decoded_instr*);
+void _Fx1E(chip8_hw*, const decoded_instr*);
+void _Fx29(chip8_hw*, const decoded_instr*);
+void _Fx33(chip8_hw*, const decoded_instr*);
+void _Fx55(chip8_hw*, const decoded_instr*);
+void _Fx65(chip8_hw*, const decoded_instr*);
+void _invalid_op(chip8_hw*, const decoded_instr*);
 
 typedef struct {
     unsigned mask;
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "chip8.h"
+#include "pool.h"
+
+/* Jobs dealt to a worker, the owner takes from bottom and thieves from top */
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned*       jobs;
+    unsigned        top;
+    unsigned        bottom;
+} __attribute__((aligned(CHIP8_CACHE_LINE))) pool_deque;
+
+typedef struct {
+    pool_deque*   deques;  /* One per worker */
+    unsigned      workers;
+    pool_job_fptr fun;
+    void*         context;
+    atomic_uint   stolen;
+} work_pool;
+
+typedef struct {
+    work_pool* pool;
+    unsigned   worker;
+} pool_worker;
+
+static bool TakeOwn(pool_deque* deque, unsigned* job)
+{
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->bottom > deque->top;
+    if (found) *job = deque->jobs[ --deque->bottom ];
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool Steal(pool_deque* deque, unsigned* job)
+{
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->bottom > deque->top;
+    if (found) *job = deque->jobs[ deque->top++ ];
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static void* WorkerMain(void* arg)
+{
+    const pool_worker* self = arg;
+    work_pool* pool = self->pool;
+
+    unsigned job = 0;
+    for (;;)
+    {
+        if (TakeOwn(&(pool->deques[ self->worker ]), &job))
+        {
+            pool->fun(pool->context, job, self->worker);
+            continue;
+        }
+
+        // Jobs are only dealt before start, so when no one has any left all are taken
+        bool found = false;
+        for (unsigned i = 1; i < pool->workers && !found; i++)
+        {
+            found = Steal(&(pool->deques[ (self->worker + i) % pool->workers ]), &job);
+        }
+        if (!found) break;
+
+        atomic_fetch_add_explicit(&pool->stolen, 1, memory_order_relaxed);
+        pool->fun(pool->context, job, self->worker);
+    }
+    return NULL;
+}
+
+bool PoolRun(unsigned job_count, unsigned workers, pool_job_fptr fun, void* context, unsigned* stolen)
+{
+    if (workers == 0) workers = 1;
+
+    work_pool pool = { NULL, workers, fun, context, 0 };
+    pool.deques = aligned_alloc(CHIP8_CACHE_LINE, workers * sizeof(pool_deque));
+    unsigned* jobs = malloc((job_count + 1) * sizeof(unsigned));
+    pthread_t* threads = malloc(workers * sizeof(pthread_t));
+    pool_worker* args = malloc(workers * sizeof(pool_worker));
+    bool* started = calloc(workers, sizeof(bool));
+    bool ok = pool.deques && jobs && threads && args && started;
+
+    // Dealt round-robin, the deque of each worker is a slice of jobs
+    unsigned pos = 0;
+    for (unsigned w = 0; w < workers && ok; w++)
+    {
+        pool_deque* deque = &(pool.deques[w]);
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->jobs   = jobs + pos;
+        deque->top    = 0;
+        deque->bottom = 0;
+        // Owner takes from bottom, so the first job dealt is pushed last
+        unsigned count = job_count / workers + (w < job_count % workers);
+        for (unsigned i = 0; i < count; i++)
+        {
+            deque->jobs[ deque->bottom++ ] = w + (count - 1 - i) * workers;
+        }
+        pos += count;
+    }
+
+    // Calling thread is worker 0. Jobs of workers that fail to start are stolen
+    for (unsigned w = 1; w < workers && ok; w++)
+    {
+        args[w].pool   = &pool;
+        args[w].worker = w;
+        started[w] = pthread_create(&threads[w], NULL, WorkerMain, &args[w]) == 0;
+        if (!started[w]) fprintf(stderr, "ERROR: Failed to start worker %u\n", w);
+    }
+    if (ok)
+    {
+        args[0].pool   = &pool;
+        args[0].worker = 0;
+        WorkerMain(&args[0]);
+    }
+
+    for (unsigned w = 1; w < workers && ok; w++)
+    {
+        if (started[w]) pthread_join(threads[w], NULL);
+    }
+    for (unsigned w = 0; w < workers && ok; w++)
+    {
+        pthread_mutex_destroy(&(pool.deques[w].lock));
+    }
+
+    if (stolen) *stolen = atomic_load(&pool.stolen);
+    free(started);
+    free(pool.deques);
+    free(jobs);
+    free(threads);
+    free(args);
+    return ok;
+}
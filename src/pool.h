@@ -0,0 +1,18 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+
+/* Runs job number job on given worker, jobs must not depend on each other */
+typedef void (*pool_job_fptr)(void* context, unsigned job, unsigned worker);
+
+/**
+ *  \brief  Run jobs 0..job_count-1 on workers threads and wait for them to finish
+ *  \note   Jobs are dealt round-robin to the workers, which steal from the
+ *          others once they run out, so long jobs don't leave threads idle.
+ *  \param[out] stolen  Jobs run by another worker than they were dealt to, NULL if not wanted
+ *  \return false if out of memory, no job is run then
+ */
+bool PoolRun(unsigned job_count, unsigned workers, pool_job_fptr fun, void* context, unsigned* stolen);
+
+#endif // POOL_H
@@ -1,7 +1,8 @@
 #include <stdlib.h>
-#include <assert.h>
 #include <math.h>
 #include <string.h>
+#include <time.h>
+#include <stdatomic.h>
 #include "raylib.h"
 
 #include "raylib_ui.h"
@@ -32,19 +33,114 @@ static int keymap[ MAX_KEY ] = {
     KEY_V,
 };
 
-#define MAX_SAMPLES  512
-#define MAX_SAMPLES_PER_UPDATE  4096
 #define AUDIO_SAMPLE_RATE 44100
 #define AUDIO_TONE_FREQ  220
 #define AUDIO_VOLUME     3000
+#define AUDIO_WAVE_LEN   0x100 /* Samples in one period of wave table */
+#define SECOND_IN_NSEC   1000000000ULL
+
+/*
+ *  Sound is generated by the audio device thread in GenerateAudio(). The
+ *  emulator only sets how many samples are left to play, so the tone
+ *  length is exact to a sample no matter when frames are presented.
+ */
 static struct {
     AudioStream stream;
-    short* wave;
-    short* buffer;
-    unsigned wave_length;
-    unsigned last_position;
-} audio;
+    unsigned    buffer_frames;
+    short       wave[ AUDIO_WAVE_LEN ];
+    unsigned    phase;          /* Position in wave, 8.24 fixed point */
+    unsigned    phase_step;
+
+    atomic_uint        samples_left;
+    atomic_ullong      change_time;   /* When tone was started or stopped, 0 if heard */
+    bool               tone;          /* Tone was on in last callback */
+    unsigned long long last_callback;
+
+    atomic_ullong callbacks;
+    atomic_ullong underruns;
+    atomic_ullong changes;
+    atomic_ullong latency_sum;   /* ns */
+    atomic_ullong latency_max;
+} audio = { .buffer_frames = RL_AUDIO_BUFFER_DEFAULT };
+
+#define KEY_POLL_INTERVAL_NSEC  1000000
+
+static struct {
+    unsigned short keys;        /* Key state in last poll */
+    double input_time;          /* Key state change waiting to be shown, 0 if none */
+    double last_present;
+    double frame_time_sum;
+    double latency_sum;
+    rl_stats stats;
+} frame;
+
+#define SCREEN_BG  SKYBLUE
+#define SCREEN_FG  RED
+static struct {
+    Texture2D texture;
+    Color     lut[ 0x100 ][ 8 ];                 /* Pixels of a gfx byte */
+    Color     pixels[ CHIP8_GFX_H ][ CHIP8_GFX_W ];
+    uint64_t  shown[ CHIP8_GFX_H ];              /* gfx in texture */
+} screen;
+
+
+static unsigned long long GetNanoseconds()
+{
+    struct timespec ts = {0};
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * SECOND_IN_NSEC + ts.tv_nsec;
+}
+
+static void AtomicMax(atomic_ullong* value, unsigned long long candidate)
+{
+    unsigned long long cur = atomic_load_explicit(value, memory_order_relaxed);
+    while (candidate > cur && !atomic_compare_exchange_weak(value, &cur, candidate));
+}
+
+/* Runs on audio device thread, must not block */
+static void GenerateAudio(void* buffer, unsigned int frames)
+{
+    short* out = (short*)buffer;
+    unsigned long long now = GetNanoseconds();
+
+    // Device asked for data later than two buffers, so it ran dry
+    unsigned long long buffer_nsec = audio.buffer_frames * SECOND_IN_NSEC / AUDIO_SAMPLE_RATE;
+    if (audio.last_callback > 0 && now - audio.last_callback > 2 * buffer_nsec)
+    {
+        atomic_fetch_add_explicit(&audio.underruns, 1, memory_order_relaxed);
+    }
+    audio.last_callback = now;
+    atomic_fetch_add_explicit(&audio.callbacks, 1, memory_order_relaxed);
+
+    unsigned left = atomic_load_explicit(&audio.samples_left, memory_order_acquire);
+    unsigned count = left;
+    bool tone = left > 0;
+    for (unsigned i = 0; i < frames; i++)
+    {
+        if (left > 0)
+        {
+            out[i] = audio.wave[ audio.phase >> 24 ];
+            audio.phase += audio.phase_step;
+            left--;
+        }
+        else
+        {
+            out[i] = 0;
+        }
+    }
+    // Keep a new tone started while generating this buffer
+    atomic_compare_exchange_strong(&audio.samples_left, &count, left);
 
+    unsigned long long changed = atomic_load_explicit(&audio.change_time, memory_order_relaxed);
+    if (tone != audio.tone && changed > 0 && now >= changed)
+    {
+        atomic_store_explicit(&audio.change_time, 0, memory_order_relaxed);
+        atomic_fetch_add_explicit(&audio.changes, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&audio.latency_sum, now - changed, memory_order_relaxed);
+        AtomicMax(&audio.latency_max, now - changed);
+    }
+    audio.tone = tone;
+}
 
 void RlInitializeWindow(float scale, const char* title)
 {
@@ -52,27 +148,63 @@ void RlInitializeWindow(float scale, const char* title)
     InitWindow(CHIP8_GFX_W*scale, CHIP8_GFX_H*scale, title);
     SetTargetFPS(60);
 
+    for (unsigned byte = 0; byte < 0x100; byte++)
+    {
+        for (unsigned bit = 0; bit < 8; bit++)
+        {
+            screen.lut[ byte ][ bit ] = (byte & (0x80 >> bit)) ? SCREEN_FG : SCREEN_BG;
+        }
+    }
+    Image image = GenImageColor(CHIP8_GFX_W, CHIP8_GFX_H, SCREEN_BG);
+    screen.texture = LoadTextureFromImage(image);
+    UnloadImage(image);
+    memset(screen.shown, 0, sizeof(screen.shown));
+    memset(&frame, 0, sizeof(frame));
+
+    for (unsigned i = 0; i < AUDIO_WAVE_LEN; i++)
+    {
+        audio.wave[i] = (short)(sinf(2*PI*((float)i)/AUDIO_WAVE_LEN) * AUDIO_VOLUME);
+    }
+    audio.phase      = 0;
+    audio.phase_step = (unsigned)((double)AUDIO_TONE_FREQ * AUDIO_WAVE_LEN * (1 << 24) / AUDIO_SAMPLE_RATE);
+    audio.tone          = false;
+    audio.last_callback = 0;
+    atomic_store(&audio.samples_left, 0);
+    atomic_store(&audio.change_time, 0);
+
     InitAudioDevice();
-    SetAudioStreamBufferSizeDefault(MAX_SAMPLES_PER_UPDATE);
+    SetAudioStreamBufferSizeDefault(audio.buffer_frames);
     audio.stream = LoadAudioStream(AUDIO_SAMPLE_RATE, 16, 1);
-
+    SetAudioStreamCallback(audio.stream, GenerateAudio);
     PlayAudioStream(audio.stream);
-    audio.wave   = (short*)malloc(sizeof(short) * MAX_SAMPLES);
-    audio.buffer = (short*)malloc(sizeof(short) * MAX_SAMPLES_PER_UPDATE);
-    audio.last_position = 0;
+}
+
+static unsigned short GetKeyMask()
+{
+    unsigned short keys = 0;
+    for (unsigned i = 0; i < MAX_KEY; i++)
+    {
+        if (IsKeyDown(keymap[i])) keys |= 1 << i;
+    }
+    return keys;
+}
+
+/* Read input without presenting a frame */
+static void PollEvents()
+{
+    PollInputEvents();
 
-    audio.wave_length = AUDIO_SAMPLE_RATE/AUDIO_TONE_FREQ;
-    for (unsigned i = 0; i < audio.wave_length * 2; i++)
+    unsigned short keys = GetKeyMask();
+    if (keys != frame.keys && frame.input_time == 0)
     {
-        audio.wave[i] = (short)(sinf(2*PI*((float)i)/audio.wave_length) * AUDIO_VOLUME);
+        frame.input_time = GetTime();
     }
+    frame.keys = keys;
 }
 
 bool RlShouldQuit()
 {
-    // Poll events
-    BeginDrawing();
-    EndDrawing();
+    PollEvents();
 
     if (WindowShouldClose()) quit = true;
     return quit;
@@ -80,88 +212,117 @@ bool RlShouldQuit()
 
 void RlDrawScreen(chip8_hw* hw)
 {
-    if (hw->ST > 0)
-    {
-        RlAudioPlay();
-    }
-
-    BeginDrawing();
-        ClearBackground(SKYBLUE);
+    RlDrawFrame(hw->gfx);
+}
 
-        for (unsigned i = 0; i < CHIP8_GFX_LEN; i++)
+void RlDrawFrame(const uint64_t* gfx)
+{
+    // Expand 1-bpp rows to texture only when something was drawn
+    if (memcmp(screen.shown, gfx, sizeof(screen.shown)) != 0)
+    {
+        memcpy(screen.shown, gfx, sizeof(screen.shown));
+        for (unsigned y = 0; y < CHIP8_GFX_H; y++)
         {
-            unsigned char byte = hw->gfx[i];
-
-            unsigned y = i * 8 / CHIP8_GFX_W,
-                     x = i * 8 % CHIP8_GFX_W;
-            for (unsigned char bit = 0x80; bit > 0; bit >>= 1, x++)
+            for (unsigned x = 0; x < CHIP8_GFX_W; x += 8)
             {
-                if (byte & bit)
-                {
-                    DrawRectangle(x * win_scale, y * win_scale,
-                                  1 * win_scale, 1 * win_scale,
-                                  RED);
-                }
+                unsigned byte = (screen.shown[y] >> (CHIP8_GFX_W - 8 - x)) & 0xff;
+                memcpy(&(screen.pixels[y][x]), screen.lut[ byte ], sizeof(screen.lut[0]));
             }
         }
+        UpdateTexture(screen.texture, screen.pixels);
+    }
+
+    // Waits for the next frame, see SetTargetFPS()
+    BeginDrawing();
+        DrawTextureEx(screen.texture, (Vector2){ 0, 0 }, 0, win_scale, WHITE);
     EndDrawing();
+
+    double now = GetTime();
+    rl_stats* stats = &(frame.stats);
+    if (frame.last_present > 0)
+    {
+        double frame_time = now - frame.last_present;
+        frame.frame_time_sum += frame_time;
+        stats->frames++;
+        stats->frame_time_avg = frame.frame_time_sum / stats->frames;
+        if (frame_time > stats->frame_time_max) stats->frame_time_max = frame_time;
+    }
+    frame.last_present = now;
+
+    if (frame.input_time > 0)
+    {
+        double latency = now - frame.input_time;
+        frame.latency_sum += latency;
+        stats->inputs++;
+        stats->latency_avg = frame.latency_sum / stats->inputs;
+        if (latency > stats->latency_max) stats->latency_max = latency;
+        frame.input_time = 0;
+    }
+}
+
+unsigned short RlGetKeys()
+{
+    return frame.keys;
+}
+
+void RlGetStats(rl_stats* stats)
+{
+    *stats = frame.stats;
+
+    stats->audio_callbacks = atomic_load(&audio.callbacks);
+    stats->audio_underruns = atomic_load(&audio.underruns);
+    stats->tone_changes    = atomic_load(&audio.changes);
+    stats->tone_latency_avg = stats->tone_changes ? (double)atomic_load(&audio.latency_sum) / stats->tone_changes / SECOND_IN_NSEC : 0;
+    stats->tone_latency_max = (double)atomic_load(&audio.latency_max) / SECOND_IN_NSEC;
 }
 
 bool RlIsKeyDown(unsigned key)
 {
-    assert(key > 0x10);
-    return IsKeyDown(keymap[key]);
+    return key < MAX_KEY && IsKeyDown(keymap[key]);
+}
+
+bool RlIsRewindDown()
+{
+    return IsKeyDown(KEY_BACKSPACE);
 }
 
 unsigned RlGetKeyBlocking()
 {
+    // Screen doesn't change while waiting, so don't present frames
+    const struct timespec interval = { 0, KEY_POLL_INTERVAL_NSEC };
     while (!RlShouldQuit())
     {
         for (unsigned i=0; i < MAX_KEY; i++)
         {
-            if (IsKeyDown(keymap[i]))
+            if (frame.keys & (1 << i))
             {
                 return i;
             }
         }
+        nanosleep(&interval, NULL);
     }
     return 0;
 }
 
 void RlClose()
 {
+    UnloadTexture(screen.texture);
     UnloadAudioStream(audio.stream);
-    free(audio.wave);
-    free(audio.buffer);
     CloseAudioDevice();
     CloseWindow();
 }
 
-void RlAudioPlay()
+void RlSetAudioBufferSize(unsigned frames)
 {
-    if (IsAudioStreamProcessed(audio.stream))
-    {
-        unsigned offset = audio.last_position;
-        unsigned w_len = audio.wave_length - offset;
-        if (w_len == 0)  w_len = audio.wave_length;
-
-        for (unsigned pos = 0; pos < MAX_SAMPLES_PER_UPDATE; offset = 0, pos += w_len)
-        {
-            if (pos > 0)
-            {
-                w_len = audio.wave_length;
-            }
-            if ((pos+w_len) > MAX_SAMPLES_PER_UPDATE)
-            {
-                w_len = MAX_SAMPLES_PER_UPDATE - pos;
-            }
-
-            memcpy(audio.buffer + pos,
-                   audio.wave + offset,
-                   w_len * sizeof(short));
-        }
-        audio.last_position = w_len;
+    audio.buffer_frames = frames;
+}
 
-        UpdateAudioStream(audio.stream, audio.buffer, MAX_SAMPLES_PER_UPDATE);
+void RlPlaySound(unsigned ticks)
+{
+    unsigned samples = ticks * AUDIO_SAMPLE_RATE / CHIP8_DT_FREQ;
+    unsigned prev = atomic_exchange_explicit(&audio.samples_left, samples, memory_order_release);
+    if ((prev > 0) != (samples > 0))
+    {
+        atomic_store_explicit(&audio.change_time, GetNanoseconds(), memory_order_relaxed);
     }
 }
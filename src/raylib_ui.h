@@ -1,10 +1,35 @@
 #include "chip8.h"
 
+#define RL_AUDIO_BUFFER_DEFAULT  1024 /* Samples per audio callback */
+
+/* Frame pacing measured by RlDrawScreen(), times in seconds */
+typedef struct {
+    unsigned long long frames;
+    double frame_time_avg;
+    double frame_time_max;
+    unsigned long long inputs;  /* Key state changes shown */
+    double latency_avg;         /* From polling a key change to presenting the frame */
+    double latency_max;
+
+    unsigned long long audio_callbacks;
+    unsigned long long audio_underruns;  /* Callbacks late by more than a buffer */
+    unsigned long long tone_changes;     /* Tone starts and stops heard */
+    double tone_latency_avg;             /* From RlPlaySound() to the audio callback */
+    double tone_latency_max;
+} rl_stats;
+
 void RlInitializeWindow(float scale, const char* title);
 bool RlShouldQuit();
 void RlDrawScreen(chip8_hw* hw);
+void RlDrawFrame(const uint64_t* gfx);
+unsigned short RlGetKeys(); /* Keys down in last poll, one bit per key */
 bool RlIsKeyDown(unsigned key);
+bool RlIsRewindDown(); /* Rewind hotkey, backspace */
 unsigned RlGetKeyBlocking();
 void RlClose();
+void RlGetStats(rl_stats* stats);
 
-void RlAudioPlay();
+/* Samples per audio callback, smaller is faster but may underrun. Call before RlInitializeWindow() */
+void RlSetAudioBufferSize(unsigned frames);
+/* Play tone for ticks of sound timer, 0 stops it. Safe to call from any thread */
+void RlPlaySound(unsigned ticks);
@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "rewind.h"
+
+/*
+ *  Frame in ring: [u32 len][len bytes of runs][u32 len]. Length is at both
+ *  ends, so frames can be dropped from the tail and popped from the head.
+ *  A run is varint count of unchanged bytes, varint count of changed
+ *  bytes and the changed bytes XORed with the previous frame.
+ */
+#define LEN_BYTES  sizeof(uint32_t)
+
+static void RingWrite(rewind_buffer* rw, unsigned pos, const void* src, unsigned len)
+{
+    unsigned first = rw->capacity - pos < len ? rw->capacity - pos : len;
+    memcpy(rw->data + pos, src, first);
+    memcpy(rw->data, (const unsigned char*)src + first, len - first);
+}
+
+static void RingRead(const rewind_buffer* rw, unsigned pos, void* dst, unsigned len)
+{
+    unsigned first = rw->capacity - pos < len ? rw->capacity - pos : len;
+    memcpy(dst, rw->data + pos, first);
+    memcpy((unsigned char*)dst + first, rw->data, len - first);
+}
+
+static unsigned PutVarint(unsigned char* out, unsigned value)
+{
+    unsigned len = 0;
+    while (value >= 0x80)
+    {
+        out[len++] = value | 0x80;
+        value >>= 7;
+    }
+    out[len++] = value;
+    return len;
+}
+
+static unsigned GetVarint(const unsigned char* in, unsigned* value)
+{
+    unsigned len = 0, shift = 0;
+    *value = 0;
+    do
+    {
+        *value |= (in[len] & 0x7f) << shift;
+        shift += 7;
+    } while (in[len++] & 0x80);
+    return len;
+}
+
+/* Length of equal prefix, compared a word at a time */
+static unsigned SameLength(const unsigned char* a, const unsigned char* b, unsigned len)
+{
+    unsigned i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        if (x != y) break;
+    }
+    while (i < len && a[i] == b[i]) i++;
+    return i;
+}
+
+static unsigned Encode(const unsigned char* cur, const unsigned char* prev, unsigned len, unsigned char* out)
+{
+    unsigned pos = 0, out_len = 0;
+    while (pos < len)
+    {
+        unsigned same = SameLength(cur + pos, prev + pos, len - pos);
+        pos += same;
+
+        unsigned diff = 0;
+        while (pos + diff < len && cur[pos + diff] != prev[pos + diff]) diff++;
+
+        out_len += PutVarint(out + out_len, same);
+        out_len += PutVarint(out + out_len, diff);
+        for (unsigned i = 0; i < diff; i++)
+        {
+            out[out_len++] = cur[pos + i] ^ prev[pos + i];
+        }
+        pos += diff;
+    }
+    return out_len;
+}
+
+static void Decode(const unsigned char* in, unsigned in_len, unsigned char* state)
+{
+    unsigned in_pos = 0, pos = 0;
+    while (in_pos < in_len)
+    {
+        unsigned same, diff;
+        in_pos += GetVarint(in + in_pos, &same);
+        in_pos += GetVarint(in + in_pos, &diff);
+        pos += same;
+        for (unsigned i = 0; i < diff; i++)
+        {
+            state[pos++] ^= in[in_pos++];
+        }
+    }
+}
+
+static void DropOldest(rewind_buffer* rw)
+{
+    uint32_t len = 0;
+    RingRead(rw, rw->tail, &len, LEN_BYTES);
+    rw->tail  = (rw->tail + len + 2 * LEN_BYTES) % rw->capacity;
+    rw->used -= len + 2 * LEN_BYTES;
+    rw->count--;
+}
+
+bool RewindInit(rewind_buffer* rw, unsigned max_frames)
+{
+    rw->capacity  = max_frames * REWIND_FRAME_BYTES + sizeof(rw->scratch);
+    rw->data      = (unsigned char*)malloc(rw->capacity);
+    rw->head      = 0;
+    rw->tail      = 0;
+    rw->used      = 0;
+    rw->count     = 0;
+    rw->max_count = max_frames;
+    rw->has_last  = false;
+    return rw->data != NULL;
+}
+
+void RewindFree(rewind_buffer* rw)
+{
+    free(rw->data);
+    rw->data = NULL;
+}
+
+void RewindCapture(rewind_buffer* rw, const chip8_hw* chip)
+{
+    chip8_state cur;
+    Chip8SaveState(chip, &cur);
+    if (!rw->has_last || rw->max_count == 0)
+    {
+        rw->last     = cur;
+        rw->has_last = true;
+        return;
+    }
+
+    uint32_t len = Encode((const unsigned char*)&cur, (const unsigned char*)&(rw->last), sizeof(cur), rw->scratch);
+    unsigned total = len + 2 * LEN_BYTES;
+    while (rw->count > 0 && (rw->count >= rw->max_count || rw->used + total > rw->capacity))
+    {
+        DropOldest(rw);
+    }
+
+    RingWrite(rw, rw->head, &len, LEN_BYTES);
+    RingWrite(rw, (rw->head + LEN_BYTES) % rw->capacity, rw->scratch, len);
+    RingWrite(rw, (rw->head + LEN_BYTES + len) % rw->capacity, &len, LEN_BYTES);
+    rw->head  = (rw->head + total) % rw->capacity;
+    rw->used += total;
+    rw->count++;
+    rw->last  = cur;
+}
+
+bool RewindStep(rewind_buffer* rw, chip8_hw* chip)
+{
+    if (rw->count == 0) return false;
+
+    uint32_t len = 0;
+    unsigned end = (rw->head + rw->capacity - LEN_BYTES) % rw->capacity;
+    RingRead(rw, end, &len, LEN_BYTES);
+    unsigned begin = (end + rw->capacity - len) % rw->capacity;
+    RingRead(rw, begin, rw->scratch, len);
+    Decode(rw->scratch, len, (unsigned char*)&(rw->last));
+
+    rw->head  = (begin + rw->capacity - LEN_BYTES) % rw->capacity;
+    rw->used -= len + 2 * LEN_BYTES;
+    rw->count--;
+    return Chip8LoadState(chip, &(rw->last));
+}
@@ -0,0 +1,41 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include "chip8.h"
+
+#define REWIND_FRAME_BYTES  1024 /* Average compressed frame the buffer is sized for */
+
+/*
+ *  Ring of frames stored as XOR of the frame and the one before it,
+ *  run-length encoded. Only the newest frame is kept whole, older ones are
+ *  reached by applying deltas backwards. The oldest frames are dropped
+ *  when the ring is full.
+ */
+typedef struct {
+    unsigned char* data;
+    unsigned       capacity;   /* Bytes in data */
+    unsigned       head;       /* Next write position */
+    unsigned       tail;       /* Oldest frame */
+    unsigned       used;       /* Bytes in use */
+    unsigned       count;      /* Frames to step back */
+    unsigned       max_count;
+
+    chip8_state    last;       /* Newest frame */
+    bool           has_last;
+    unsigned char  scratch[ sizeof(chip8_state) * 2 ];
+} rewind_buffer;
+
+/* Keep up to max_frames previous frames */
+bool RewindInit(rewind_buffer* rw, unsigned max_frames);
+void RewindFree(rewind_buffer* rw);
+
+/* Store current frame, call once per frame */
+void RewindCapture(rewind_buffer* rw, const chip8_hw* chip);
+
+/**
+ *  \brief  Restore frame before the last captured one
+ *  \return false if there are no older frames left
+ */
+bool RewindStep(rewind_buffer* rw, chip8_hw* chip);
+
+#endif // REWIND_H
@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "runner.h"
+#include "scheduler.h"
+#include "util.h"
+
+#define SECOND_IN_NSEC  1000000000
+#define CLOCK_CHECK_TICKS  64 /* Timer ticks between checks of config->max_seconds */
+
+/* Key callbacks have no context, so each thread can run a chip of its own */
+static __thread struct {
+    chip8_hw*         chip;
+    const key_script* script;
+    const input_log*  replay;
+    unsigned          next;      /* Next event in script or replay */
+    unsigned          next_key;  /* Next Fx0A event in replay */
+    unsigned short    keys;
+} input;
+
+static double GetSeconds()
+{
+    struct timespec ts = {0};
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + (double)ts.tv_nsec / SECOND_IN_NSEC;
+}
+
+bool KeyScriptLoad(key_script* script, const char* file)
+{
+    script->events = NULL;
+    script->count  = 0;
+
+    unsigned char* text = NULL;
+    unsigned len = 0;
+    if (!ReadFile(file, false, &text, &len)) return false;
+
+    unsigned capacity = 0;
+    unsigned prev_frame = 0;
+    bool ok = true;
+    for (char* line = strtok((char*)text, "\n"); line != NULL && ok; line = strtok(NULL, "\n"))
+    {
+        unsigned frame = 0, keys = 0;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%u %i", &frame, &keys) != 2) continue;
+        if (frame < prev_frame || keys > 0xffff)
+        {
+            fprintf(stderr, "ERROR: Invalid key event '%s' in %s\n", line, file);
+            ok = false;
+            break;
+        }
+        prev_frame = frame;
+
+        if (script->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            key_event* events = realloc(script->events, capacity * sizeof(key_event));
+            if (!events)
+            {
+                ok = false;
+                break;
+            }
+            script->events = events;
+        }
+        script->events[ script->count ].frame = frame;
+        script->events[ script->count ].keys  = keys;
+        script->count++;
+    }
+
+    free(text);
+    if (!ok) KeyScriptFree(script);
+    return ok;
+}
+
+void KeyScriptFree(key_script* script)
+{
+    free(script->events);
+    script->events = NULL;
+    script->count  = 0;
+}
+
+void InputLogInit(input_log* log, unsigned seed)
+{
+    log->seed      = seed;
+    log->end_cycle = 0;
+    log->events    = NULL;
+    log->count     = 0;
+    log->capacity  = 0;
+    log->keys      = 0;
+}
+
+void InputLogFree(input_log* log)
+{
+    free(log->events);
+    log->events   = NULL;
+    log->count    = 0;
+    log->capacity = 0;
+}
+
+bool InputLogAdd(input_log* log, unsigned long long cycle, unsigned short keys, bool blocking)
+{
+    if (log->count == log->capacity)
+    {
+        unsigned capacity = log->capacity ? log->capacity * 2 : 64;
+        input_event* events = realloc(log->events, capacity * sizeof(input_event));
+        if (!events) return false;
+        log->events   = events;
+        log->capacity = capacity;
+    }
+    if (blocking) cycle = log->count > 0 ? log->events[ log->count-1 ].cycle : 0;
+    log->events[ log->count ].cycle    = cycle;
+    log->events[ log->count ].keys     = keys;
+    log->events[ log->count ].blocking = blocking;
+    log->count++;
+    if (cycle > log->end_cycle) log->end_cycle = cycle;
+    return true;
+}
+
+void InputLogLatch(input_log* log, chip8_hw* chip, unsigned short keys)
+{
+    if (keys != log->keys && InputLogAdd(log, chip->cycles, keys, false))
+    {
+        log->keys = keys;
+    }
+    chip->keys = log->keys;
+}
+
+bool InputLogSave(const input_log* log, const char* file)
+{
+    FILE* f = fopen(file, "w");
+    if (!f) return false;
+
+    fprintf(f, "# chip8 input log\nseed %u\nend %llu\n", log->seed, log->end_cycle);
+    for (unsigned i = 0; i < log->count; i++)
+    {
+        const input_event* ev = &(log->events[i]);
+        if (ev->blocking) fprintf(f, "key %u\n", ev->keys);
+        else              fprintf(f, "%llu 0x%.4x\n", ev->cycle, ev->keys);
+    }
+    return fclose(f) == 0;
+}
+
+bool InputLogLoad(input_log* log, const char* file)
+{
+    InputLogInit(log, 0);
+
+    unsigned char* text = NULL;
+    unsigned len = 0;
+    if (!ReadFile(file, false, &text, &len)) return false;
+
+    unsigned long long end_cycle = 0;
+    bool ok = true;
+    for (char* line = strtok((char*)text, "\n"); line != NULL && ok; line = strtok(NULL, "\n"))
+    {
+        unsigned long long cycle = 0;
+        unsigned keys = 0;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "seed %u", &(log->seed)) == 1) continue;
+        if (sscanf(line, "end %llu", &end_cycle) == 1) continue;
+
+        // Older logs have a cycle on Fx0A events too, it's ignored
+        bool blocking = sscanf(line, "key %u", &keys) == 1 || sscanf(line, "%llu key %u", &cycle, &keys) == 2;
+        if (!blocking && sscanf(line, "%llu %i", &cycle, &keys) != 2) continue;
+        if ((!blocking && log->count > 0 && cycle < log->events[ log->count-1 ].cycle) ||
+            keys > (blocking ? CHIP8_KEY_COUNT - 1 : 0xffff))
+        {
+            fprintf(stderr, "ERROR: Invalid input event '%s' in %s\n", line, file);
+            ok = false;
+            break;
+        }
+        ok = InputLogAdd(log, cycle, keys, blocking);
+    }
+    if (end_cycle > log->end_cycle) log->end_cycle = end_cycle;
+
+    free(text);
+    if (!ok) InputLogFree(log);
+    return ok;
+}
+
+static void ApplyLoggedKeys(unsigned long long cycle)
+{
+    const input_log* log = input.replay;
+    for (; input.next < log->count && log->events[ input.next ].cycle <= cycle; input.next++)
+    {
+        if (!log->events[ input.next ].blocking) input.keys = log->events[ input.next ].keys;
+    }
+    input.chip->keys = input.keys;
+}
+
+static unsigned GetLoggedKey()
+{
+    const input_log* log = input.replay;
+    while (input.next_key < log->count && !log->events[ input.next_key ].blocking) input.next_key++;
+    if (input.next_key == log->count) return 0;
+    return log->events[ input.next_key++ ].keys;
+}
+
+static void ApplyKeyEvents(unsigned long long frame)
+{
+    const key_script* script = input.script;
+    while (script && input.next < script->count && script->events[ input.next ].frame <= frame)
+    {
+        input.keys = script->events[ input.next ].keys;
+        input.next++;
+    }
+    input.chip->keys = input.keys;
+}
+
+static unsigned GetKeyBlocking()
+{
+    // Nothing happens while waiting, so go straight to the next press
+    const key_script* script = input.script;
+    while (input.keys == 0 && script && input.next < script->count)
+    {
+        input.keys = script->events[ input.next ].keys;
+        input.next++;
+    }
+    input.chip->keys = input.keys;
+
+    for (unsigned key = 0; key < CHIP8_KEY_COUNT; key++)
+    {
+        if ((input.keys >> key) & 1) return key;
+    }
+    return 0;
+}
+
+void RunHeadless(chip8_hw* chip, const run_config* config, run_result* result)
+{
+    input.chip     = chip;
+    input.script   = config->script;
+    input.replay   = config->replay;
+    input.next     = 0;
+    input.next_key = 0;
+    input.keys     = 0;
+
+    if (input.replay) Chip8Seed(chip, input.replay->seed);
+
+    chip->is_key_down      = NULL;
+    chip->get_key_blocking = input.replay ? GetLoggedKey : GetKeyBlocking;
+    chip->draw_screen      = NULL;
+
+    chip8_scheduler sched;
+    SchedulerInit(&sched, CHIP8_CPU_FREQ, CHIP8_DT_FREQ);
+
+    unsigned long long start_cycles = chip->cycles;
+    double begin = GetSeconds();
+
+    result->status    = 0;
+    result->timed_out = false;
+    while (config->max_frames == 0 || sched.ticks < config->max_frames)
+    {
+        if (config->max_seconds > 0 && sched.ticks % CLOCK_CHECK_TICKS == 0 &&
+            GetSeconds() - begin >= config->max_seconds)
+        {
+            result->timed_out = true;
+            break;
+        }
+
+        if (input.replay) ApplyLoggedKeys(chip->cycles);
+        else              ApplyKeyEvents(sched.ticks);
+
+        // Last tick is cut short, timers only run for whole ticks
+        unsigned ops = SchedulerOpsForTick(&sched);
+        unsigned long long left = config->max_cycles - (chip->cycles - start_cycles);
+        bool partial = config->max_cycles && ops > left;
+        if (partial) ops = left;
+
+        result->status = config->sampler ? SamplerExecute(config->sampler, chip, ops) : Chip8Execute(chip, ops);
+        if (result->status != 0 || partial) break;
+
+        Chip8ProcessTimers(chip, 1);
+        sched.ticks++;
+        if (config->max_cycles && chip->cycles - start_cycles == config->max_cycles) break;
+    }
+
+    result->seconds = GetSeconds() - begin;
+    result->cycles  = chip->cycles - start_cycles;
+    result->frames  = sched.ticks;
+}
+
+bool RunWriteProfile(const chip8_hw* chip, const char* file)
+{
+    if (!Chip8GetProfile(chip))
+    {
+        fprintf(stderr, "No profile, build with PROFILE=1\n");
+        return false;
+    }
+
+    size_t len = strlen(file);
+    bool json = len >= 5 && strcmp(file + len - 5, ".json") == 0;
+    FILE* f = fopen(file, "w");
+    bool ok = f && Chip8WriteProfile(chip, f, json);
+    if (f && fclose(f) != 0) ok = false;
+    if (!ok) fprintf(stderr, "Failed to write profile to %s\n", file);
+    return ok;
+}
+
+unsigned long long RunStateHash(const chip8_hw* chip)
+{
+    // Only architectural state, counters and key latches depend on the engine and idle loop detection
+    const uint8_t regs[] = { chip->DT, chip->ST, chip->stack_top, chip->I >> 8, chip->I & 0xff, chip->PC >> 8, chip->PC & 0xff };
+    unsigned long long hash = HashFnv1a(chip->V, sizeof(chip->V));
+    hash = HashFnv1aNext(hash, regs, sizeof(regs));
+    hash = HashFnv1aNext(hash, chip->stack, sizeof(chip->stack));
+    hash = HashFnv1aNext(hash, &(chip->rng), sizeof(chip->rng));
+    hash = HashFnv1aNext(hash, chip->gfx, sizeof(chip->gfx));
+    return HashFnv1aNext(hash, chip->ram, sizeof(chip->ram));
+}
+
+void RunPrintResult(FILE* output, const chip8_hw* chip, const run_result* result)
+{
+    fprintf(output, "V :");
+    for (unsigned i = 0; i < REGISTER_V_COUNT; i++)
+    {
+        fprintf(output, " %.2x", chip->V[i]);
+    }
+    fprintf(output, "\n");
+    fprintf(output, "I : 0x%.4x PC: 0x%.4x DT: %u ST: %u SP: %u\n",
+            chip->I, chip->PC, chip->DT, chip->ST, chip->stack_top);
+    fprintf(output, "GFX: %.16llx State: %.16llx\n", HashFnv1a(chip->gfx, sizeof(chip->gfx)), RunStateHash(chip));
+    fprintf(output, "Status: %d, cycles: %llu (idle %llu), frames: %llu\n",
+            result->status, result->cycles, chip->idle_cycles, result->frames);
+    fprintf(output, "Time: %f s, %.0f instructions/s, %.0f frames/s\n", result->seconds,
+            result->seconds > 0 ? result->cycles / result->seconds : 0.0,
+            result->seconds > 0 ? result->frames / result->seconds : 0.0);
+}
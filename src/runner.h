@@ -0,0 +1,103 @@
+#ifndef RUNNER_H
+#define RUNNER_H
+
+#include <stdio.h>
+#include "chip8.h"
+#include "sampler.h"
+
+/* Keys held down from given frame on, one bit per key */
+typedef struct {
+    unsigned       frame;
+    unsigned short keys;
+} key_event;
+
+typedef struct {
+    key_event* events; /* Sorted by frame */
+    unsigned   count;
+} key_script;
+
+/*
+ *  Key state from given instruction count on, or key returned by Fx0A.
+ *  Fx0A runs within Chip8Execute(), where the count isn't known, so those
+ *  events are replayed in order and take the cycle of the event before.
+ */
+typedef struct {
+    unsigned long long cycle;
+    unsigned short     keys;     /* Key number if blocking */
+    bool               blocking;
+} input_event;
+
+/* Inputs of a session, replaying it from the same program gives the same state */
+typedef struct {
+    unsigned           seed;      /* Chip8Seed() of session */
+    unsigned long long end_cycle; /* Instructions run in session */
+    input_event*       events;    /* Sorted by cycle */
+    unsigned           count;
+    unsigned           capacity;
+    unsigned short     keys;      /* Last latched keys */
+} input_log;
+
+typedef struct {
+    unsigned long long max_cycles; /* Instructions to run, 0 for no limit */
+    unsigned long long max_frames; /* Timer ticks to run, 0 for no limit */
+    const key_script*  script;     /* NULL if no keys are pressed */
+    const input_log*   replay;     /* Inputs by instruction count, overrides script */
+    guest_sampler*     sampler;    /* Samples call stacks if not NULL */
+    double             max_seconds; /* Host time to run, 0 for no limit */
+} run_config;
+
+typedef struct {
+    unsigned long long cycles;  /* Instructions run */
+    unsigned long long frames;  /* Timer ticks run */
+    double             seconds; /* Host time spent */
+    int                status;  /* Result of Chip8Execute() */
+    bool               timed_out; /* Stopped by config->max_seconds */
+} run_result;
+
+/**
+ *  \brief  Read key script, each line has a frame and a key mask: "120 0x0020"
+ *  \note   Lines beginning with '#' are comments
+ */
+bool KeyScriptLoad(key_script* script, const char* file);
+void KeyScriptFree(key_script* script);
+
+void InputLogInit(input_log* log, unsigned seed);
+void InputLogFree(input_log* log);
+/**
+ *  \brief  Append event, cycle is ignored for Fx0A events
+ */
+bool InputLogAdd(input_log* log, unsigned long long cycle, unsigned short keys, bool blocking);
+
+/**
+ *  \brief  Latch keys into chip and log them if they changed
+ *  \note   Call only between ticks, replay latches keys at tick boundaries
+ */
+void InputLogLatch(input_log* log, chip8_hw* chip, unsigned short keys);
+
+/**
+ *  \brief  Write log as text: seed, end cycle and a line per event,
+ *          "<cycle> <key mask>" or "key <key>" for Fx0A
+ */
+bool InputLogSave(const input_log* log, const char* file);
+bool InputLogLoad(input_log* log, const char* file);
+
+/**
+ *  \brief  Run chip without UI until either limit in config is reached
+ *  \note   Latches keys from config->script at the start of each frame. Only
+ *          one chip can be run at a time by each thread. Fx0A takes the next key event
+ *          of the script early if no key is down, key 0 if there are none.
+ *          With config->replay keys are latched by instruction count and
+ *          Fx0A returns logged keys in order. The chip is seeded from it.
+ */
+void RunHeadless(chip8_hw* chip, const run_config* config, run_result* result);
+
+/* Hash of V, I, PC, timers, stack, RNG, display and RAM, same for all engines */
+unsigned long long RunStateHash(const chip8_hw* chip);
+
+/* Write Chip8WriteProfile() report to file, JSON if name ends in ".json", CSV otherwise */
+bool RunWriteProfile(const chip8_hw* chip, const char* file);
+
+/* Print registers, gfx hash and timing */
+void RunPrintResult(FILE* output, const chip8_hw* chip, const run_result* result);
+
+#endif // RUNNER_H
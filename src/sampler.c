@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "sampler.h"
+#include "util.h"
+
+bool SamplerInit(guest_sampler* sampler, unsigned interval)
+{
+    sampler->interval = interval ? interval : 1;
+    sampler->next     = sampler->interval;
+    sampler->samples  = 0;
+    sampler->dropped  = 0;
+    sampler->stacks   = (sampler_stack*)calloc(SAMPLER_MAX_STACKS, sizeof(sampler_stack));
+    sampler->labels   = (char**)calloc(CHIP8_RAM_LEN, sizeof(char*));
+    if (!sampler->stacks || !sampler->labels)
+    {
+        SamplerFree(sampler);
+        return false;
+    }
+    return true;
+}
+
+void SamplerFree(guest_sampler* sampler)
+{
+    if (sampler->labels)
+    {
+        for (unsigned i = 0; i < CHIP8_RAM_LEN; i++) free(sampler->labels[i]);
+    }
+    free(sampler->labels);
+    free(sampler->stacks);
+    sampler->labels = NULL;
+    sampler->stacks = NULL;
+}
+
+bool SamplerAddLabels(guest_sampler* sampler, const char* map)
+{
+    while (*map)
+    {
+        unsigned addr = 0;
+        int name_begin = 0, name_end = 0;
+        if (sscanf(map, "%i %n%*s%n", &addr, &name_begin, &name_end) >= 1 && name_end > name_begin && addr < CHIP8_RAM_LEN)
+        {
+            char* name = strndup(map + name_begin, name_end - name_begin);
+            if (!name) return false;
+            free(sampler->labels[addr]);
+            sampler->labels[addr] = name;
+        }
+
+        const char* eol = strchr(map, '\n');
+        if (!eol) break;
+        map = eol + 1;
+    }
+    return true;
+}
+
+bool SamplerLoadLabels(guest_sampler* sampler, const char* file)
+{
+    unsigned char* text = NULL;
+    unsigned len = 0;
+    if (!ReadFile(file, false, &text, &len)) return false;
+
+    bool ok = SamplerAddLabels(sampler, (const char*)text);
+    free(text);
+    return ok;
+}
+
+static void TakeSample(guest_sampler* sampler, const chip8_hw* chip)
+{
+    // Return address follows the CALL, which holds the routine address
+    sampler_stack cur = { { CHIP8_PROG_START }, 1, 0 };
+    for (unsigned i = 0; i < chip->stack_top && i < CHIP8_STACK_LEN; i++)
+    {
+        unsigned call = chip->stack[i] - 2;
+        unsigned target = call;
+        if (call < CHIP8_RAM_LEN - 1 && (chip->ram[call] >> 4) == 0x2)
+        {
+            target = (chip->ram[call] & 0xf) << 8 | chip->ram[call+1];
+        }
+        cur.frames[ cur.depth++ ] = target;
+    }
+
+    sampler->samples++;
+    unsigned hash = HashFnv1a(cur.frames, cur.depth * sizeof(cur.frames[0]));
+    for (unsigned probe = 0; probe < SAMPLER_MAX_STACKS; probe++)
+    {
+        sampler_stack* entry = &(sampler->stacks[ (hash + probe) % SAMPLER_MAX_STACKS ]);
+        if (entry->count == 0)
+        {
+            *entry = cur;
+        }
+        if (entry->depth == cur.depth && memcmp(entry->frames, cur.frames, cur.depth * sizeof(cur.frames[0])) == 0)
+        {
+            entry->count++;
+            return;
+        }
+    }
+    sampler->dropped++;
+}
+
+int SamplerExecute(guest_sampler* sampler, chip8_hw* chip, unsigned op_count)
+{
+    while (op_count > 0)
+    {
+        unsigned ops = op_count < sampler->next ? op_count : sampler->next;
+        int ret = Chip8Execute(chip, ops);
+        if (ret != 0) return ret;
+
+        op_count      -= ops;
+        sampler->next -= ops;
+        if (sampler->next == 0)
+        {
+            TakeSample(sampler, chip);
+            sampler->next = sampler->interval;
+        }
+    }
+    return 0;
+}
+
+bool SamplerWriteFolded(const guest_sampler* sampler, FILE* output)
+{
+    for (unsigned i = 0; i < SAMPLER_MAX_STACKS; i++)
+    {
+        const sampler_stack* entry = &(sampler->stacks[i]);
+        if (entry->count == 0) continue;
+
+        for (unsigned j = 0; j < entry->depth; j++)
+        {
+            unsigned addr = entry->frames[j];
+            const char* label = addr < CHIP8_RAM_LEN ? sampler->labels[addr] : NULL;
+            if (label) fprintf(output, "%s%s", j ? ";" : "", label);
+            else       fprintf(output, "%s0x%.4x", j ? ";" : "", addr);
+        }
+        fprintf(output, " %llu\n", entry->count);
+    }
+    return !ferror(output);
+}
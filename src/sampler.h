@@ -0,0 +1,46 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdio.h>
+#include "chip8.h"
+
+#define SAMPLER_MAX_STACKS  0x400 /* Distinct call stacks counted */
+
+/* Call stack as routine addresses, entry point first */
+typedef struct {
+    uint16_t frames[ CHIP8_STACK_LEN + 1 ];
+    unsigned depth;
+    unsigned long long count;
+} sampler_stack;
+
+/*
+ *  Guest sampling profiler. Every interval instructions the CALL targets
+ *  on chip->stack are read and the stack is counted, so time is attributed
+ *  to CHIP-8 subroutines without single-stepping.
+ */
+typedef struct {
+    unsigned interval;            /* Instructions between samples */
+    unsigned next;                /* Instructions left until next sample */
+    unsigned long long samples;
+    unsigned long long dropped;   /* Samples of stacks that didn't fit */
+    sampler_stack* stacks;        /* Hash table of SAMPLER_MAX_STACKS, empty if count is 0 */
+    char** labels;                /* Label of each RAM address, NULL if none */
+} guest_sampler;
+
+bool SamplerInit(guest_sampler* sampler, unsigned interval);
+void SamplerFree(guest_sampler* sampler);
+
+/* Name routines with labels of map, lines of "<address> <label>" as written by assembler -m */
+bool SamplerAddLabels(guest_sampler* sampler, const char* map);
+bool SamplerLoadLabels(guest_sampler* sampler, const char* file);
+
+/**
+ *  \brief  Chip8Execute() in parts, sampling the call stack in between
+ *  \return Result of Chip8Execute()
+ */
+int  SamplerExecute(guest_sampler* sampler, chip8_hw* chip, unsigned op_count);
+
+/* Write "routine;routine;... count" line for each stack, flamegraph.pl reads these */
+bool SamplerWriteFolded(const guest_sampler* sampler, FILE* output);
+
+#endif // SAMPLER_H
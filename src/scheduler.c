@@ -0,0 +1,99 @@
+#include <errno.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "scheduler.h"
+
+#define SECOND_IN_NSEC  1000000000ULL
+
+static unsigned long long GetNanoseconds()
+{
+    struct timespec ts = {0};
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * SECOND_IN_NSEC + ts.tv_nsec;
+}
+
+void SchedulerInit(chip8_scheduler* sched, unsigned cpu_freq, unsigned tick_freq)
+{
+    sched->cpu_freq    = cpu_freq;
+    sched->tick_freq   = tick_freq;
+    sched->remainder   = 0;
+    sched->max_catchup = SCHEDULER_MAX_CATCHUP;
+    sched->uncapped    = false;
+
+    sched->ticks   = 0;
+    sched->dropped = 0;
+    SchedulerResync(sched);
+}
+
+unsigned SchedulerOpsForTick(chip8_scheduler* sched)
+{
+    unsigned total = sched->remainder + sched->cpu_freq;
+    sched->remainder = total % sched->tick_freq;
+    return total / sched->tick_freq;
+}
+
+int SchedulerRunTick(chip8_scheduler* sched, chip8_hw* chip)
+{
+    int ret = Chip8Execute(chip, SchedulerOpsForTick(sched));
+    Chip8ProcessTimers(chip, 1);
+    sched->ticks++;
+    return ret;
+}
+
+unsigned SchedulerPendingTicks(chip8_scheduler* sched)
+{
+    if (sched->uncapped) return sched->max_catchup;
+
+    // Count from origin, so rounding errors don't accumulate
+    unsigned long long elapsed = GetNanoseconds() - sched->origin;
+    unsigned long long due     = elapsed * sched->tick_freq / SECOND_IN_NSEC;
+    unsigned long long done    = sched->ticks - sched->synced_ticks;
+    if (due <= done) return 0;
+
+    unsigned long long pending = due - done;
+    if (pending > sched->max_catchup)
+    {
+        sched->dropped      += pending - sched->max_catchup;
+        sched->synced_ticks -= pending - sched->max_catchup;
+        pending = sched->max_catchup;
+    }
+    return pending;
+}
+
+void SchedulerWaitNextTick(chip8_scheduler* sched)
+{
+    if (sched->uncapped) return;
+
+    unsigned long long next = sched->ticks - sched->synced_ticks + 1;
+    unsigned long long due  = sched->origin + (next * SECOND_IN_NSEC + sched->tick_freq - 1) / sched->tick_freq;
+    struct timespec ts = { due / SECOND_IN_NSEC, due % SECOND_IN_NSEC };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+void SchedulerResync(chip8_scheduler* sched)
+{
+    sched->origin       = GetNanoseconds();
+    sched->synced_ticks = sched->ticks;
+}
+
+int SchedulerUpdate(chip8_scheduler* sched, chip8_hw* chip)
+{
+    unsigned pending = SchedulerPendingTicks(sched);
+    unsigned i = 0;
+    while (i < pending)
+    {
+        int ret = SchedulerRunTick(sched, chip);
+        i++;
+        if (ret != 0) return -1;
+
+        // Time spent waiting for a key isn't caught up
+        if (chip->was_blocking)
+        {
+            chip->was_blocking = false;
+            SchedulerResync(sched);
+            break;
+        }
+    }
+    return i;
+}
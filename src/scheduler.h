@@ -0,0 +1,58 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "chip8.h"
+
+#define SCHEDULER_MAX_CATCHUP  6 /* Timer ticks run per update at most */
+
+/*
+ *  Emulated time advances in timer ticks. Every tick runs a fixed share of
+ *  cpu_freq instructions followed by one Chip8ProcessTimers(), so the result
+ *  of a run only depends on the number of ticks, not on the host.
+ */
+typedef struct {
+    unsigned cpu_freq;    /* Instructions per second */
+    unsigned tick_freq;   /* Timer ticks per second */
+    unsigned remainder;   /* Instructions carried to the next tick, times tick_freq */
+    unsigned max_catchup; /* Ticks run per update at most */
+    bool     uncapped;    /* Ignore wall clock, run max_catchup ticks per update */
+
+    unsigned long long origin;       /* Wall clock when tick synced_ticks was due, ns */
+    unsigned long long synced_ticks;
+    unsigned long long ticks;       /* Ticks run */
+    unsigned long long dropped;     /* Ticks skipped to catch up after stalls */
+} chip8_scheduler;
+
+void SchedulerInit(chip8_scheduler* sched, unsigned cpu_freq, unsigned tick_freq);
+
+/**
+ *  \brief  Instructions to run in the next tick
+ *  \note   Spreads cpu_freq / tick_freq evenly, e.g. 8, 8, 9, 8, 8, 9... for 500 / 60
+ */
+unsigned SchedulerOpsForTick(chip8_scheduler* sched);
+
+/**
+ *  \brief  Run instructions of one tick and decrement timers
+ *  \return Result of Chip8Execute()
+ */
+int  SchedulerRunTick(chip8_scheduler* sched, chip8_hw* chip);
+
+/**
+ *  \brief  Ticks due according to the wall clock, at most max_catchup
+ *  \note   Ticks over max_catchup are dropped, so a stall doesn't cause a burst
+ */
+unsigned SchedulerPendingTicks(chip8_scheduler* sched);
+
+/* Sleep until the next tick is due, returns at once if uncapped */
+void SchedulerWaitNextTick(chip8_scheduler* sched);
+
+/* Restart wall clock from now, e.g. after waiting for a key */
+void SchedulerResync(chip8_scheduler* sched);
+
+/**
+ *  \brief  Run pending ticks, stop early after a blocking instruction
+ *  \return Ticks run, -1 on error
+ */
+int  SchedulerUpdate(chip8_scheduler* sched, chip8_hw* chip);
+
+#endif // SCHEDULER_H
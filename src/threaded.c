@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "decoder.h"
+#include "opcodes.h"
+#include "threaded.h"
+
+/*
+ *  Direct-threaded execution engine. Each opcode is a label inside
+ *  Chip8ExecuteThreaded() and ends with its own copy of the dispatch code,
+ *  so there is no call and no shared indirect branch per instruction.
+ *  Opcodes touching the host or writing RAM fall back to their handler.
+ */
+
+static const void* dispatch[ DECODE_TABLE_INVALID ];
+
+/* Labels are only accessible inside the function, so let it fill the table */
+__attribute__((constructor))
+static void GenerateDispatchTable()
+{
+    Chip8ExecuteThreaded(NULL, 0);
+}
+
+int Chip8ExecuteThreaded(chip8_hw* chip, unsigned op_count)
+{
+    static const struct {
+        instr_fptr  fun;
+        const void* label;
+    } inlined[] = {
+        { _00EE, &&op_00EE },
+        { _1nnn, &&op_1nnn },
+        { _2nnn, &&op_2nnn },
+        { _3xnn, &&op_3xnn },
+        { _4xnn, &&op_4xnn },
+        { _5xy0, &&op_5xy0 },
+        { _6xnn, &&op_6xnn },
+        { _7xnn, &&op_7xnn },
+        { _8xy0, &&op_8xy0 },
+        { _8xy1, &&op_8xy1 },
+        { _8xy2, &&op_8xy2 },
+        { _8xy3, &&op_8xy3 },
+        { _8xy4, &&op_8xy4 },
+        { _8xy5, &&op_8xy5 },
+        { _8xy6, &&op_8xy6 },
+        { _8xy7, &&op_8xy7 },
+        { _8xyE, &&op_8xyE },
+        { _9xy0, &&op_9xy0 },
+        { _Annn, &&op_Annn },
+        { _Bnnn, &&op_Bnnn },
+        { _Cxnn, &&op_Cxnn },
+        { _Ex9E, &&op_Ex9E },
+        { _ExA1, &&op_ExA1 },
+        { _Fx07, &&op_Fx07 },
+        { _Fx15, &&op_Fx15 },
+        { _Fx18, &&op_Fx18 },
+        { _Fx1E, &&op_Fx1E },
+        { _Fx29, &&op_Fx29 },
+        { _Fx65, &&op_Fx65 },
+        { _invalid_op, &&op_nop },
+        { NULL, NULL }
+    };
+
+    if (chip == NULL)
+    {
+        for (unsigned i = 0; mnemonic_list[i].fun != NULL; i++)
+        {
+            dispatch[i] = &&op_fallback;
+            for (unsigned j = 0; inlined[j].fun != NULL; j++)
+            {
+                if (inlined[j].fun == mnemonic_list[i].fun)
+                {
+                    dispatch[i] = inlined[j].label;
+                }
+            }
+        }
+        return 0;
+    }
+
+    unsigned char* V  = chip->V;
+    decoded_instr* icache = chip->icache;
+    const decoded_instr* in = NULL;
+    unsigned pc = chip->PC;
+    unsigned remaining = op_count;
+
+#define DISPATCH() \
+    do { \
+        if (remaining == 0) goto done; \
+        remaining--; \
+        if (pc >= CHIP8_RAM_LEN - 1) goto out_of_ram; \
+        in = &(icache[ pc ]); \
+        if (in->fun == NULL && !DecodeOperands(chip->ram[pc] << 8 | chip->ram[pc+1], &(icache[ pc ]))) \
+            goto invalid_opcode; \
+        pc += 2; \
+        goto *dispatch[ in->index ]; \
+    } while (0)
+
+    DISPATCH();
+
+op_00EE:
+    chip->stack_top--;
+    pc = chip->stack[ chip->stack_top ];
+    DISPATCH();
+op_1nnn:
+    {
+        unsigned jump = pc - 2;
+        pc = in->nnn;
+        if (!in->busy) remaining -= Chip8SkipIdleLoop(chip, jump, pc, remaining);
+    }
+    DISPATCH();
+op_2nnn:
+    chip->stack[ chip->stack_top ] = pc;
+    chip->stack_top++;
+    pc = in->nnn;
+    DISPATCH();
+op_3xnn:
+    if (V[ in->x ] == in->nn) pc += 2;
+    DISPATCH();
+op_4xnn:
+    if (V[ in->x ] != in->nn) pc += 2;
+    DISPATCH();
+op_5xy0:
+    if (V[ in->x ] == V[ in->y ]) pc += 2;
+    DISPATCH();
+op_6xnn:
+    V[ in->x ] = in->nn;
+    DISPATCH();
+op_7xnn:
+    V[ in->x ] += in->nn;
+    DISPATCH();
+op_8xy0:
+    V[ in->x ] = V[ in->y ];
+    DISPATCH();
+op_8xy1:
+    V[ in->x ] |= V[ in->y ];
+    DISPATCH();
+op_8xy2:
+    V[ in->x ] &= V[ in->y ];
+    DISPATCH();
+op_8xy3:
+    V[ in->x ] ^= V[ in->y ];
+    DISPATCH();
+op_8xy4:
+    {
+        unsigned char y = V[ in->y ];
+        V[ in->x ] += y;
+        V[ 0xf ] = V[ in->x ] < y;
+    }
+    DISPATCH();
+op_8xy5:
+    {
+        unsigned char y = V[ in->y ];
+        unsigned char borrow = V[ in->x ] < y;
+        V[ 0xf ] = !borrow;
+        V[ in->x ] -= y;
+    }
+    DISPATCH();
+op_8xy6:
+    V[ 0xf ] = V[ in->x ] & 1;
+    V[ in->x ] = V[ in->x ] >> 1;
+    DISPATCH();
+op_8xy7:
+    {
+        unsigned char y = V[ in->y ];
+        unsigned char borrow = y < V[ in->x ];
+        V[ 0xf ] = !borrow;
+        V[ in->x ] = y - V[ in->x ];
+    }
+    DISPATCH();
+op_8xyE:
+    V[ 0xf ] = (V[ in->x ] & 0x80) != 0;
+    V[ in->x ] = V[ in->x ] << 1;
+    DISPATCH();
+op_9xy0:
+    if (V[ in->x ] != V[ in->y ]) pc += 2;
+    DISPATCH();
+op_Annn:
+    chip->I = in->nnn;
+    DISPATCH();
+op_Bnnn:
+    pc = V[0] + in->nnn;
+    DISPATCH();
+op_Cxnn:
+    V[ in->x ] = Chip8Random(chip) & in->nn;
+    DISPATCH();
+op_Ex9E:
+    if (Chip8IsKeyDown(chip, V[ in->x ])) pc += 2;
+    DISPATCH();
+op_ExA1:
+    if (!Chip8IsKeyDown(chip, V[ in->x ])) pc += 2;
+    DISPATCH();
+op_Fx07:
+    V[ in->x ] = chip->DT;
+    DISPATCH();
+op_Fx15:
+    chip->DT = V[ in->x ];
+    DISPATCH();
+op_Fx18:
+    chip->ST = V[ in->x ];
+    if (chip->play_sound) chip->play_sound(chip->ST);
+    DISPATCH();
+op_Fx1E:
+    chip->I += V[ in->x ];
+    DISPATCH();
+op_Fx29:
+    chip->I = CHIP8_RAM_CHARSET_BEGIN + CHIP8_CHAR_LEN * V[ in->x ];
+    DISPATCH();
+op_Fx65:
+    for (unsigned i = 0; i <= in->x; i++)
+    {
+        V[ i ] = chip->ram[ (chip->I + i) & CHIP8_ADDR_MASK ];
+    }
+    DISPATCH();
+op_nop:
+    DISPATCH();
+op_fallback:
+    chip->PC = pc;
+    in->fun(chip, in);
+    pc = chip->PC;
+    DISPATCH();
+
+#undef DISPATCH
+
+done:
+    chip->PC = pc;
+    return 0;
+
+out_of_ram:
+    chip->PC = pc;
+    fprintf(stderr, "ERROR: PC out of RAM at %u\n", pc);
+    return -1;
+
+invalid_opcode:
+    chip->PC = pc;
+    fprintf(stderr, "ERROR: Invalid opcode 0x%.4x at %u\n", chip->ram[pc] << 8 | chip->ram[pc+1], pc);
+    return -1;
+}
@@ -0,0 +1,12 @@
+#ifndef THREADED_H
+#define THREADED_H
+
+#include "chip8.h"
+
+/**
+ *  \brief  Execute op_count instructions with the threaded-code engine
+ *  \note   Results are identical to the interpreter in Chip8Execute()
+ */
+int Chip8ExecuteThreaded(chip8_hw* chip, unsigned op_count);
+
+#endif // THREADED_H
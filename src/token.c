@@ -24,6 +24,7 @@ typedef struct
     unsigned    name_len;
 
     unsigned    value;
+    bool        is_label; // Address of code, not a constant
 } var;
 
 typedef struct
@@ -145,6 +146,35 @@ int main()
 #endif
 
 bool CompileSource(const char* src, unsigned char** compiled_output, unsigned* output_len)
+{
+    return CompileSourceLabels(src, compiled_output, output_len, NULL);
+}
+
+/* "<address> <name>" line for each label */
+static char* CreateLabelMap(compile_data* c_data)
+{
+    unsigned len = 1;
+    for (node* vars = c_data->variables; vars != NULL; vars = vars->next)
+    {
+        var* tmp = (var*)vars->content;
+        if (tmp->is_label) len += tmp->name_len + 8;
+    }
+
+    char* map = (char*)malloc(len);
+    if (!map) return NULL;
+
+    unsigned pos = 0;
+    map[0] = '\0';
+    for (node* vars = c_data->variables; vars != NULL; vars = vars->next)
+    {
+        var* tmp = (var*)vars->content;
+        if (!tmp->is_label) continue;
+        pos += sprintf(map + pos, "0x%.4x %.*s\n", tmp->value & 0xffff, tmp->name_len, tmp->name);
+    }
+    return map;
+}
+
+bool CompileSourceLabels(const char* src, unsigned char** compiled_output, unsigned* output_len, char** label_map)
 {
     node* tok = ParseToTokens( src );
 
@@ -157,6 +187,7 @@ bool CompileSource(const char* src, unsigned char** compiled_output, unsigned* o
     {
         *compiled_output = (unsigned char*)calloc(data.bufferLen, sizeof(unsigned char));
         memcpy(*compiled_output, data.codeBuffer, data.bufferLen);
+        if (label_map) *label_map = CreateLabelMap( &data );
     }
 
     *output_len = data.bufferPos;
@@ -549,6 +580,7 @@ bool AddVariable(compile_data* c_data, const char* name, const unsigned name_len
     new_label->name     = name;
     new_label->name_len = name_len;
     new_label->value    = val;
+    new_label->is_label = false;
 
     c_data->variables = NodeAdd( c_data->variables, (void*)new_label );
     //printf("%s: %.*s = %u\n", __FUNCTION__, new_label->name_len, new_label->name, new_label->value );
@@ -709,6 +741,7 @@ unsigned StateAddLabel(node** nodes, compile_data* data)
     {
         return STATE_NONE;
     }
+    GetVariable(data, (char*)tok->ptr, tok->len)->is_label = true;
 
     *nodes = (*nodes)->next;
     return STATE_START;
@@ -9,4 +9,11 @@
  */
 bool CompileSource(const char* src, unsigned char** compiled_output, unsigned* output_len);
 
+/**
+ *  \brief  Compile given source code and list its labels
+ *  \param[out] label_map  Line "0x<address> <label>" for each label, NULL if not wanted
+ *  \note label_map must be freed too!
+ */
+bool CompileSourceLabels(const char* src, unsigned char** compiled_output, unsigned* output_len, char** label_map);
+
 #endif //TOKEN_H
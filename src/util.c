@@ -50,3 +50,19 @@ bool WriteFile(const char* file, bool isBinary, unsigned char* data, unsigned le
 
     return true;
 }
+
+unsigned long long HashFnv1a(const void* data, unsigned len)
+{
+    return HashFnv1aNext(0xcbf29ce484222325ULL, data, len);
+}
+
+unsigned long long HashFnv1aNext(unsigned long long hash, const void* data, unsigned len)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (unsigned i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
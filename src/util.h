@@ -2,3 +2,9 @@
 
 bool ReadFile(const char* file, bool isBinary, unsigned char** output, unsigned* len);
 bool WriteFile(const char* file, bool isBinary, unsigned char* data, unsigned len);
+
+/* 64-bit FNV-1a hash of data */
+unsigned long long HashFnv1a(const void* data, unsigned len);
+
+/* Continue FNV-1a hash of earlier data with more data */
+unsigned long long HashFnv1aNext(unsigned long long hash, const void* data, unsigned len);